@@ -0,0 +1,776 @@
+#define CUSTOM_BUILD_H_MAIN
+#include "wilco.h"
+
+#include "src/buildconfigurator.h"
+#include "src/commandprocessor.h"
+#include "src/database.h"
+#include "src/dependencyparser.h"
+#include "src/fileutil.h"
+#include "src/projectcache.h"
+#include "src/trace.h"
+#include "mockexecutor.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <iostream>
+#include <optional>
+#include <random>
+#include <sstream>
+#include <thread>
+
+#if __linux__
+#include <unistd.h>
+#endif
+
+// Needed since we link with wilco, even if this isn't really used
+void configure(Environment& env)
+{ }
+
+namespace
+{
+
+struct GraphSettings
+{
+    size_t commands;
+    size_t fanIn;
+    size_t fanOut;
+    size_t depFileHeaders;
+};
+
+struct Result
+{
+    std::string name;
+    GraphSettings graph;
+    size_t bytes;
+    std::vector<double> milliseconds;
+    // Counted during the last iteration
+    uint64_t allocations = 0;
+    uint64_t allocatedBytes = 0;
+    // Benchmark specific measurements, reported along with the timings
+    std::vector<std::pair<std::string, double>> metrics;
+};
+
+// Commands are spread over directories of this size, so huge graphs don't end up
+// with millions of files in a single directory.
+static constexpr size_t COMMANDS_PER_DIRECTORY = 1000;
+
+std::filesystem::path shardedPath(const std::filesystem::path& root, const char* kind, size_t index, const std::string& suffix)
+{
+    return root / kind / std::to_string(index / COMMANDS_PER_DIRECTORY) / (std::to_string(index) + suffix);
+}
+
+// Generates a compile-like command per source file. Each command reads its own
+// source plus fanIn - 1 outputs of earlier commands, writes fanOut outputs and
+// has a gcc style depfile listing headers from a shared pool. Everything is
+// written to disk so the graph can be checked like a real, fully built one.
+std::vector<CommandEntry> generateGraph(const GraphSettings& settings, const std::filesystem::path& root)
+{
+    std::mt19937 random(1234);
+    size_t headerCount = std::max((size_t)16, settings.commands / 8);
+    for(size_t header = 0; header < headerCount; ++header)
+    {
+        writeFile(shardedPath(root, "include", header, ".h"), "#pragma once\n", false);
+    }
+
+    // Real compile commands start with a long block of flags shared by the whole project
+    std::string commonFlags = "c++ -std=c++17 -O2 -g -Wall -Wextra -Wno-unused-parameter -fno-strict-aliasing -pthread -DNDEBUG";
+    for(size_t define = 0; define < 16; ++define)
+    {
+        commonFlags += " -DBENCHMARK_DEFINE_" + std::to_string(define) + "=1";
+    }
+    for(size_t include = 0; include < 16; ++include)
+    {
+        commonFlags += " -I" + (root / "include" / ("module_" + std::to_string(include))).string();
+    }
+
+    std::vector<CommandEntry> commands(settings.commands);
+    for(size_t index = 0; index < settings.commands; ++index)
+    {
+        auto& command = commands[index];
+        auto source = shardedPath(root, "src", index, ".cpp");
+        writeFile(source, "int f" + std::to_string(index) + "() { return 0; }\n", false);
+
+        command.workingDirectory = root;
+        command.description = "Compiling " + std::to_string(index);
+        command.inputs.push_back(source);
+        command.command = commonFlags + " -c " + source.string();
+
+        // Keep dependencies local so the graph is deep rather than one huge fan
+        if(index > 0)
+        {
+            size_t windowStart = index > 256 ? index - 256 : 0;
+            std::uniform_int_distribution<size_t> dependency(windowStart, index - 1);
+            for(size_t input = 1; input < settings.fanIn; ++input)
+            {
+                auto& dependencyOutputs = commands[dependency(random)].outputs;
+                if(!dependencyOutputs.empty())
+                {
+                    command.inputs.push_back(dependencyOutputs.front());
+                    command.command += " " + dependencyOutputs.front().string();
+                }
+            }
+        }
+
+        for(size_t output = 0; output < settings.fanOut; ++output)
+        {
+            auto outputPath = shardedPath(root, "out", index, "." + std::to_string(output) + ".o");
+            writeFile(outputPath, "", false);
+            command.outputs.push_back(outputPath);
+            command.command += " -o " + outputPath.string();
+        }
+
+        command.depFile = shardedPath(root, "dep", index, ".d");
+        command.command += " -MD -MF " + command.depFile.path.string();
+
+        std::string depFileData = (command.outputs.empty() ? source : command.outputs.front()).string() + ": " + source.string();
+        std::uniform_int_distribution<size_t> header(0, headerCount - 1);
+        for(size_t i = 0; i < settings.depFileHeaders; ++i)
+        {
+            depFileData += " \\\n " + shardedPath(root, "include", header(random), ".h").string();
+        }
+        depFileData += "\n";
+        writeFile(command.depFile, depFileData, false);
+    }
+
+    return commands;
+}
+
+// Brings the database to the state of a successful full build, so filtering measures a null build.
+void markBuilt(Database& database)
+{
+    auto& filePaths = database.getFilePaths();
+    auto& fileSignatures = database.getFileSignatures();
+    for(size_t index = 0; index < filePaths.size(); ++index)
+    {
+        updatePathSignature(fileSignatures[index], filePaths[index]);
+    }
+
+    auto& commands = database.getCommands();
+    auto& signatures = database.getCommandSignatures();
+    for(size_t index = 0; index < commands.size(); ++index)
+    {
+        signatures[index] = computeCommandSignature(commands[index]);
+    }
+}
+
+std::string generateGccDependencyData(size_t targetSize)
+{
+    std::string result = "obj/some/source/file.cpp.o: src/some/source/file.cpp \\\n";
+    size_t index = 0;
+    while(result.size() < targetSize)
+    {
+        result += " /usr/include/c++/12/bits/header_" + std::to_string(index) + ".h";
+        if(index % 16 == 0)
+        {
+            result += " third\\ party/with\\ spaces/header_" + std::to_string(index) + ".h";
+        }
+        result += " \\\n";
+        ++index;
+    }
+    return result;
+}
+
+std::string generateClDependencyData(size_t targetSize)
+{
+    std::string result = "{\n    \"Version\": \"1.1\",\n    \"Data\": {\n        \"Source\": \"c:\\\\src\\\\file.cpp\",\n        \"Includes\": [\n";
+    size_t index = 0;
+    while(result.size() < targetSize)
+    {
+        result += "            \"c:\\\\program files\\\\microsoft visual studio\\\\include\\\\header_" + std::to_string(index) + ".h\",\n";
+        ++index;
+    }
+    result += "            \"last.h\"\n        ]\n    }\n}\n";
+    return result;
+}
+
+class Runner
+{
+public:
+    Runner(size_t iterations)
+        : _iterations(iterations)
+    { }
+
+    // setup runs untimed before every iteration, for benchmarks that consume their input.
+    Result& run(std::string name, GraphSettings graph, size_t bytes, const std::function<void()>& setup, const std::function<void()>& benchmark)
+    {
+        std::cerr << "Running " << name << (graph.commands ? " (" + std::to_string(graph.commands) + " commands)" : "") << "..." << std::endl;
+
+        Result result = {std::move(name), graph, bytes};
+        for(size_t iteration = 0; iteration < _iterations; ++iteration)
+        {
+            if(setup)
+            {
+                setup();
+            }
+            auto allocations = trace::totalAllocations();
+            auto allocatedBytes = trace::totalAllocatedBytes();
+            auto start = std::chrono::steady_clock::now();
+            benchmark();
+            auto end = std::chrono::steady_clock::now();
+            result.milliseconds.push_back(std::chrono::duration<double, std::milli>(end - start).count());
+            result.allocations = trace::totalAllocations() - allocations;
+            result.allocatedBytes = trace::totalAllocatedBytes() - allocatedBytes;
+        }
+        std::sort(result.milliseconds.begin(), result.milliseconds.end());
+        _results.push_back(std::move(result));
+        return _results.back();
+    }
+
+    Result& run(std::string name, GraphSettings graph, const std::function<void()>& benchmark)
+    {
+        return run(std::move(name), graph, 0, {}, benchmark);
+    }
+
+    void writeJson(std::ostream& stream) const
+    {
+        stream << "{\n  \"iterations\": " << _iterations << ",\n  \"results\": [";
+        bool first = true;
+        for(auto& result : _results)
+        {
+            stream << (first ? "\n" : ",\n");
+            first = false;
+            stream << "    {\"name\": " << str::quote(result.name)
+                   << ", \"commands\": " << result.graph.commands
+                   << ", \"fanIn\": " << result.graph.fanIn
+                   << ", \"fanOut\": " << result.graph.fanOut
+                   << ", \"depFileHeaders\": " << result.graph.depFileHeaders
+                   << ", \"bytes\": " << result.bytes
+                   << ", \"minMs\": " << format(min(result))
+                   << ", \"medianMs\": " << format(median(result))
+                   << ", \"meanMs\": " << format(mean(result));
+            if(trace::countsAllocations())
+            {
+                stream << ", \"allocations\": " << result.allocations
+                       << ", \"allocatedBytes\": " << result.allocatedBytes;
+            }
+            for(auto& metric : result.metrics)
+            {
+                stream << ", " << str::quote(metric.first) << ": " << format(metric.second);
+            }
+            stream << "}";
+        }
+        stream << "\n  ]\n}\n";
+    }
+
+    void writeText(std::ostream& stream) const
+    {
+        stream << str::padRightToSize("Benchmark", 32) << str::padLeftToSize("Commands", 10)
+               << str::padLeftToSize("Min (ms)", 12) << str::padLeftToSize("Median (ms)", 13)
+               << str::padLeftToSize("Mean (ms)", 12) << str::padLeftToSize("MB/s", 10);
+        if(trace::countsAllocations())
+        {
+            stream << str::padLeftToSize("Allocations", 13) << str::padLeftToSize("Allocated MB", 14);
+        }
+        stream << "\n";
+        for(auto& result : _results)
+        {
+            double median = Runner::median(result);
+            stream << str::padRightToSize(result.name, 32)
+                   << str::padLeftToSize(result.graph.commands ? std::to_string(result.graph.commands) : "-", 10)
+                   << str::padLeftToSize(format(min(result)), 12)
+                   << str::padLeftToSize(format(median), 13)
+                   << str::padLeftToSize(format(mean(result)), 12)
+                   << str::padLeftToSize(result.bytes && median > 0 ? format(result.bytes / (median * 1000.0)) : "-", 10);
+            if(trace::countsAllocations())
+            {
+                stream << str::padLeftToSize(std::to_string(result.allocations), 13)
+                       << str::padLeftToSize(format(result.allocatedBytes / (1024.0 * 1024.0)), 14);
+            }
+            stream << "\n";
+            for(auto& metric : result.metrics)
+            {
+                stream << "    " << metric.first << ": " << format(metric.second) << "\n";
+            }
+        }
+    }
+
+private:
+    static std::string format(double value)
+    {
+        char buffer[32];
+        std::snprintf(buffer, sizeof(buffer), "%.3f", value);
+        return buffer;
+    }
+
+    static double min(const Result& result)
+    {
+        return result.milliseconds.front();
+    }
+
+    static double median(const Result& result)
+    {
+        return result.milliseconds[result.milliseconds.size() / 2];
+    }
+
+    static double mean(const Result& result)
+    {
+        double sum = 0;
+        for(auto value : result.milliseconds)
+        {
+            sum += value;
+        }
+        return sum / result.milliseconds.size();
+    }
+
+    const size_t _iterations;
+    std::vector<Result> _results;
+};
+
+void runGraphBenchmarks(Runner& runner, const GraphSettings& settings, const std::filesystem::path& workPath)
+{
+    auto root = workPath / ("graph_" + std::to_string(settings.commands));
+    std::filesystem::remove_all(root);
+
+    std::cerr << "Generating " << settings.commands << " commands in " << root.string() << "..." << std::endl;
+    auto commands = generateGraph(settings, root);
+
+    Database database;
+    std::vector<CommandEntry> commandsCopy;
+    runner.run("Database::setCommands", settings, 0, [&]()
+    {
+        database = Database();
+        commandsCopy = commands;
+    }, [&]()
+    {
+        database.setCommands(std::move(commandsCopy));
+    });
+
+    runner.run("Database::rebuildFileDependencies", settings, [&]()
+    {
+        database.rebuildFileDependencies();
+    });
+
+    markBuilt(database);
+
+    auto databasePath = root / ".build_db";
+    auto& saveResult = runner.run("Database::save", settings, [&]()
+    {
+        database.save(databasePath);
+    });
+    saveResult.metrics.push_back({"commandFileBytes", (double)std::filesystem::file_size(databasePath.string() + ".commands")});
+
+    runner.run("Database::load", settings, [&]()
+    {
+        Database loaded;
+        if(!loaded.load(databasePath))
+        {
+            throw std::runtime_error("Failed to load the saved database.");
+        }
+    });
+
+    size_t dirtyCommands = 0;
+    std::chrono::microseconds systemTime = {};
+    auto& nullBuildResult = runner.run("filterCommands (null build)", settings, [&]()
+    {
+        systemTime = trace::systemTime();
+        dirtyCommands = filterCommands(database).size();
+        systemTime = trace::systemTime() - systemTime;
+    });
+    nullBuildResult.metrics.push_back({"systemMs", systemTime.count() / 1000.0});
+    if(dirtyCommands != 0)
+    {
+        std::cerr << "Warning: " << dirtyCommands << " commands were dirty in the null build." << std::endl;
+    }
+
+    ChangeDetection directoryTimes;
+    directoryTimes.directoryTimes = true;
+    auto& directoryTimesResult = runner.run("filterCommands (null build, directory times)", settings, [&]()
+    {
+        systemTime = trace::systemTime();
+        dirtyCommands = filterCommands(database, {}, {}, directoryTimes).size();
+        systemTime = trace::systemTime() - systemTime;
+    });
+    directoryTimesResult.metrics.push_back({"systemMs", systemTime.count() / 1000.0});
+    if(dirtyCommands != 0)
+    {
+        std::cerr << "Warning: " << dirtyCommands << " commands were dirty in the null build." << std::endl;
+    }
+
+    // Everything dirty, with commands that finish straight away, to see how long it takes
+    // for the first command to start with and without checking and running overlapped.
+    size_t jobs = std::max((size_t)1, (size_t)std::thread::hardware_concurrency());
+    std::unique_ptr<MockExecutor> executor;
+    MockExecutor::Clock::time_point buildStart;
+    size_t completed = 0;
+    auto firstCommandMs = [&]()
+    {
+        auto& records = executor->records();
+        auto first = MockExecutor::Clock::time_point::max();
+        for(auto& record : records)
+        {
+            if(record.runs > 0)
+            {
+                first = std::min(first, record.start);
+            }
+        }
+        return std::chrono::duration<double, std::milli>(first - buildStart).count();
+    };
+    auto markDirty = [&]()
+    {
+        std::fill(database.getCommandSignatures().begin(), database.getCommandSignatures().end(), Signature());
+        executor = std::make_unique<MockExecutor>(database.getCommands());
+    };
+
+    auto& sequentialResult = runner.run("filterCommands + runCommands (all dirty)", settings, 0, markDirty, [&]()
+    {
+        std::ostringstream sink;
+        auto previous = std::cout.rdbuf(sink.rdbuf());
+        buildStart = MockExecutor::Clock::now();
+        auto filteredCommands = filterCommands(database);
+        completed = runCommands(filteredCommands, database, jobs, false, *executor);
+        std::cout.rdbuf(previous);
+    });
+    sequentialResult.metrics.push_back({"firstCommandMs", firstCommandMs()});
+    if(completed != database.getCommands().size())
+    {
+        throw std::runtime_error("Only " + std::to_string(completed) + " commands completed.");
+    }
+
+    auto& pipelinedResult = runner.run("buildCommands (all dirty)", settings, 0, markDirty, [&]()
+    {
+        std::ostringstream sink;
+        auto previous = std::cout.rdbuf(sink.rdbuf());
+        buildStart = MockExecutor::Clock::now();
+        completed = buildCommands(database, jobs, false, {}, {}, {}, *executor).completedCommands;
+        std::cout.rdbuf(previous);
+    });
+    pipelinedResult.metrics.push_back({"firstCommandMs", firstCommandMs()});
+    if(completed != database.getCommands().size())
+    {
+        throw std::runtime_error("Only " + std::to_string(completed) + " commands completed.");
+    }
+
+    runner.run("computeCommandSignature", settings, [&]()
+    {
+        for(auto& command : database.getCommands())
+        {
+            computeCommandSignature(command);
+        }
+    });
+}
+
+// Generates the commands for a single large project with the gcc-like toolchain,
+// which is where most of configure time goes for big code bases.
+void runConfigureBenchmark(Runner& runner, size_t sourceCount, const std::filesystem::path& workPath)
+{
+    static GccLikeToolchainProvider toolchain("benchmark-gcc", "g++", "", "g++", "ar");
+
+    cli::Context cliContext(workPath, "benchmarks", {});
+    std::unique_ptr<Environment> env;
+    Project* project = nullptr;
+    std::vector<CommandEntry> commands;
+    auto createProject = [&]()
+    {
+        env = std::make_unique<Environment>(cliContext);
+        project = &env->createProject("Benchmark", Executable);
+        project->toolchain = &toolchain;
+        project->features += { feature::Cpp17, feature::Optimize, feature::DebugSymbols, feature::Exceptions };
+        project->defines += { "NDEBUG", "BENCHMARK_VERSION=\"1.0\"" };
+        project->includePaths += { "include", "third_party/include" };
+        project->ext<extensions::Gcc>().compilerFlags += { "-Wall", "-Wextra" };
+        project->ext<extensions::Gcc>().pch.use = "src/pch.h";
+        project->output = "bin/benchmark";
+        for(size_t index = 0; index < sourceCount; ++index)
+        {
+            project->files += "src/module_" + std::to_string(index / COMMANDS_PER_DIRECTORY) + "/file_" + std::to_string(index) + ".cpp";
+        }
+        commands.clear();
+    };
+
+    auto& result = runner.run("GccLikeToolchainProvider::process", {sourceCount, 1, 1, 0}, 0, createProject, [&]()
+    {
+        BuildConfigurator::collectCommands(*env, commands, workPath / "configure", *project);
+    });
+
+    if(trace::countsAllocations())
+    {
+        result.metrics.push_back({"allocationsPerSource", (double)result.allocations / sourceCount});
+        result.metrics.push_back({"allocatedBytesPerSource", (double)result.allocatedBytes / sourceCount});
+    }
+
+    // Reconfiguring a project whose settings haven't changed
+    ProjectCache cache;
+    createProject();
+    auto settings = ProjectCache::digestProject(*project, workPath / "configure");
+    BuildConfigurator::collectCommands(*env, commands, workPath / "configure", *project);
+    cache.store(*project, *settings, commands);
+    runner.run("ProjectCache::restore", {sourceCount, 1, 1, 0}, 0, createProject, [&]()
+    {
+        auto settings = ProjectCache::digestProject(*project, workPath / "configure");
+        if(!settings || !cache.restore(*project, *settings, commands))
+        {
+            throw std::runtime_error("Project wasn't restored from the cache.");
+        }
+    });
+}
+
+// Resident memory of the process, where the platform makes it easy to get.
+size_t residentMemory()
+{
+#if __linux__
+    std::istringstream statm(readFile("/proc/self/statm"));
+    size_t totalPages = 0, residentPages = 0;
+    statm >> totalPages >> residentPages;
+    return residentPages * (size_t)sysconf(_SC_PAGESIZE);
+#else
+    return 0;
+#endif
+}
+
+// Runs no-op commands through the real scheduler, to measure its overhead without
+// process spawning getting in the way, and checks that it ran things in a valid order.
+void runSchedulerBenchmark(Runner& runner, size_t commandCount, size_t fanIn, size_t jobs)
+{
+    std::cerr << "Generating " << commandCount << " scheduler commands..." << std::endl;
+
+    std::mt19937 random(1234);
+    std::vector<CommandEntry> commands(commandCount);
+    for(size_t index = 0; index < commandCount; ++index)
+    {
+        auto& command = commands[index];
+        command.command = "noop " + std::to_string(index);
+        command.description = "Command " + std::to_string(index);
+        command.outputs.push_back("scheduler/out/" + std::to_string(index));
+        if(index > 0)
+        {
+            size_t windowStart = index > 256 ? index - 256 : 0;
+            std::uniform_int_distribution<size_t> dependency(windowStart, index - 1);
+            for(size_t input = 1; input < fanIn; ++input)
+            {
+                command.inputs.push_back(commands[dependency(random)].outputs.front());
+            }
+        }
+    }
+
+    Database database;
+    database.setCommands(std::move(commands));
+    auto& dependencies = database.getCommandDependencies();
+
+    std::vector<PendingCommand> filteredCommands;
+    std::unique_ptr<MockExecutor> executor;
+    size_t completed = 0;
+    size_t memoryBefore = 0;
+    size_t memoryAfter = 0;
+    auto& result = runner.run("runCommands (mock executor)", {commandCount, fanIn, 1, 0}, 0, [&]()
+    {
+        filteredCommands = filterCommands(database);
+        executor = std::make_unique<MockExecutor>(database.getCommands());
+        memoryBefore = residentMemory();
+    }, [&]()
+    {
+        // The scheduler prints progress for every command, which isn't what's being measured
+        std::ostringstream sink;
+        auto previous = std::cout.rdbuf(sink.rdbuf());
+        completed = runCommands(filteredCommands, database, jobs, false, *executor);
+        std::cout.rdbuf(previous);
+        memoryAfter = residentMemory();
+    });
+
+    if(completed != commandCount)
+    {
+        throw std::runtime_error("Scheduler completed " + std::to_string(completed) + " of " + std::to_string(commandCount) + " commands.");
+    }
+    if(executor->maxConcurrentCommands() > jobs)
+    {
+        throw std::runtime_error("Scheduler ran more than " + std::to_string(jobs) + " commands at once.");
+    }
+
+    // Fairness is measured as how long commands wait to be started once their dependencies are done
+    auto& records = executor->records();
+    auto buildStart = records.front().start;
+    for(auto& record : records)
+    {
+        buildStart = std::min(buildStart, record.start);
+    }
+
+    double totalWait = 0;
+    double maxWait = 0;
+    for(size_t index = 0; index < records.size(); ++index)
+    {
+        if(records[index].runs != 1)
+        {
+            throw std::runtime_error("Command " + std::to_string(index) + " ran " + std::to_string(records[index].runs) + " times.");
+        }
+
+        auto ready = buildStart;
+        for(auto dependency : dependencies[index])
+        {
+            if(records[dependency].end > records[index].start)
+            {
+                throw std::runtime_error("Command " + std::to_string(index) + " started before its dependency " + std::to_string(dependency) + " finished.");
+            }
+            ready = std::max(ready, records[dependency].end);
+        }
+
+        double wait = std::chrono::duration<double, std::micro>(records[index].start - ready).count();
+        totalWait += wait;
+        maxWait = std::max(maxWait, wait);
+    }
+
+    result.metrics.push_back({"jobs", (double)jobs});
+    result.metrics.push_back({"dispatchUsPerCommand", result.milliseconds[result.milliseconds.size() / 2] * 1000.0 / commandCount});
+    result.metrics.push_back({"meanReadyWaitUs", totalWait / records.size()});
+    result.metrics.push_back({"maxReadyWaitUs", maxWait});
+    result.metrics.push_back({"memoryGrowthBytes", (double)memoryAfter - (double)memoryBefore});
+}
+
+void runStandaloneBenchmarks(Runner& runner, const std::optional<std::filesystem::path>& depFile)
+{
+    std::vector<std::pair<std::string, std::string>> inputs = {
+        { "parseDependencyData gcc", generateGccDependencyData(8 << 20) },
+        { "parseDependencyData cl", generateClDependencyData(8 << 20) },
+    };
+    if(depFile)
+    {
+        inputs.push_back({ "parseDependencyData " + depFile->filename().string(), readFile(*depFile) });
+    }
+
+    for(auto& input : inputs)
+    {
+        runner.run(input.first, {}, input.second.size(), {}, [&input]()
+        {
+            size_t count = 0;
+            parseDependencyData(input.second, [&count](std::string_view path){
+                count += path.size();
+                return false;
+            });
+            if(count == 0)
+            {
+                throw std::runtime_error("No dependencies found in " + input.first + ".");
+            }
+        });
+    }
+
+    std::string data(64 << 20, 'x');
+    for(size_t i = 0; i < data.size(); ++i)
+    {
+        data[i] = (char)(i * 31);
+    }
+    runner.run("hash::Md5 64MB", {}, data.size(), {}, [&data]()
+    {
+        hash::md5(data);
+    });
+
+    // Small inputs are the common case, hashing paths and command lines
+    runner.run("hash::Md5 1M x 64B", {}, 64 << 20, {}, [&data]()
+    {
+        for(size_t offset = 0; offset < data.size(); offset += 64)
+        {
+            hash::md5(data.data() + offset, 64);
+        }
+    });
+}
+
+size_t toSize(cli::StringArgument& argument)
+{
+    try
+    {
+        return std::stoul(*argument);
+    }
+    catch(const std::exception&)
+    {
+        throw cli::argument_error("Expected a number for option '" + argument.name + "'.");
+    }
+}
+
+}
+
+// Benchmarks for wilco's core data paths, on synthetic command graphs of configurable
+// size and shape. Results are printed as json for tracking across releases.
+int main(int argc, const char** argv)
+{
+    std::vector<cli::Argument*> arguments;
+    cli::StringArgument commandCounts{arguments, "commands", "Comma separated sizes of the generated command graphs.", "1000,10000,100000"};
+    cli::StringArgument fanIn{arguments, "fan-in", "Inputs per command, including its own source file.", "3"};
+    cli::StringArgument fanOut{arguments, "fan-out", "Outputs per command.", "1"};
+    cli::StringArgument depFileHeaders{arguments, "depfile-headers", "Headers listed in each generated depfile.", "50"};
+    cli::StringArgument configureSources{arguments, "configure-sources", "Source files in the configure benchmark project, 0 to skip.", "50000"};
+    cli::StringArgument schedulerCommands{arguments, "scheduler-commands", "No-op commands to run through the scheduler, 0 to skip.", "100000"};
+    cli::StringArgument jobs{arguments, "jobs", "Concurrent commands in the scheduler benchmark.", std::to_string(std::max(1u, std::thread::hardware_concurrency()))};
+    cli::StringArgument iterations{arguments, "iterations", "Times to run each benchmark.", "5"};
+    cli::StringArgument format{arguments, "format", "Output format, json or text.", "json"};
+    cli::PathArgument workPath{arguments, "work-path", "Directory to generate command graphs in.", std::filesystem::temp_directory_path() / "wilco_benchmarks"};
+    cli::PathArgument depFile{arguments, "depfile", "Real world depfile to add to the parser benchmarks."};
+    cli::BoolArgument keep{arguments, "keep", "Keep the generated command graphs."};
+
+    cli::Context cliContext(
+        std::filesystem::current_path(),
+        argc > 0 ? argv[0] : "",
+        std::vector<std::string>(argv+std::min(1, argc), argv+argc));
+    try
+    {
+        cliContext.extractArguments(arguments);
+        cliContext.requireAllArgumentsUsed();
+        if(*format != "json" && *format != "text")
+        {
+            throw cli::argument_error("Unknown format \"" + *format + "\".");
+        }
+
+        // Allocations are counted for every benchmark, if built to count them
+        trace::enableProfiling();
+
+        Runner runner(std::max((size_t)1, toSize(iterations)));
+        runStandaloneBenchmarks(runner, depFile.value);
+
+        if(toSize(configureSources) > 0)
+        {
+            runConfigureBenchmark(runner, toSize(configureSources), *workPath);
+        }
+
+        if(toSize(schedulerCommands) > 0)
+        {
+            runSchedulerBenchmark(runner, toSize(schedulerCommands), std::max((size_t)1, toSize(fanIn)), std::max((size_t)1, toSize(jobs)));
+        }
+
+        for(auto& count : str::splitAll(*commandCounts, ','))
+        {
+            GraphSettings settings;
+            try
+            {
+                settings.commands = std::stoul(count);
+            }
+            catch(const std::exception&)
+            {
+                throw cli::argument_error("Invalid command count \"" + count + "\".");
+            }
+            settings.fanIn = std::max((size_t)1, toSize(fanIn));
+            settings.fanOut = std::max((size_t)1, toSize(fanOut));
+            settings.depFileHeaders = toSize(depFileHeaders);
+
+            runGraphBenchmarks(runner, settings, *workPath);
+        }
+
+        if(!keep)
+        {
+            std::filesystem::remove_all(*workPath);
+        }
+
+        if(*format == "json")
+        {
+            runner.writeJson(std::cout);
+        }
+        else
+        {
+            runner.writeText(std::cout);
+        }
+    }
+    catch(const cli::argument_error& e)
+    {
+        std::cout << "Usage: " << cliContext.invocation << " [options]\n\n";
+        for(auto argument : arguments)
+        {
+            std::cout << "  " << str::padRightToSize(argument->example, 30) + "  " + argument->description + "\n";
+        }
+        std::cerr << "ERROR: " << e.what() << '\n';
+        return -1;
+    }
+    catch(const std::exception& e)
+    {
+        std::cerr << "ERROR: " << e.what() << '\n';
+        return -1;
+    }
+
+    return 0;
+}
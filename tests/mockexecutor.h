@@ -0,0 +1,117 @@
+#pragma once
+
+#include "src/commandprocessor.h"
+#include "util/interrupt.h"
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <limits>
+#include <thread>
+#include <vector>
+
+// Stands in for running processes, so the scheduler in runCommands can be tested
+// and measured on its own. Records when each command started and finished.
+class MockExecutor : public CommandExecutor
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+    struct Settings
+    {
+        // Each command takes a duration in [minDuration, maxDuration], picked from its index.
+        std::chrono::microseconds minDuration{0};
+        std::chrono::microseconds maxDuration{0};
+        // Bytes of output produced by each command, in lines of up to 80 characters.
+        size_t outputSize = 0;
+        // Commands for which this returns true exit with 1.
+        std::function<bool(size_t index)> fails;
+        // Interrupts the build once this many commands have started.
+        size_t interruptAfter = std::numeric_limits<size_t>::max();
+    };
+
+    struct Record
+    {
+        Clock::time_point start;
+        Clock::time_point end;
+        uint32_t runs = 0;
+    };
+
+    // Commands are identified by their position in commands, which has to be the
+    // list the scheduler runs from (i.e. Database::getCommands).
+    MockExecutor(const std::vector<CommandEntry>& commands)
+        : MockExecutor(commands, Settings())
+    { }
+
+    MockExecutor(const std::vector<CommandEntry>& commands, Settings settings)
+        : _commands(commands)
+        , _settings(std::move(settings))
+        , _records(commands.size())
+    { }
+
+    process::ProcessResult run(const CommandEntry& command, const process::OutputCallback& outputCallback) override
+    {
+        size_t index = &command - _commands.data();
+        auto& record = _records.at(index);
+        record.start = Clock::now();
+        ++record.runs;
+
+        size_t running = ++_running;
+        size_t maxRunning = _maxRunning;
+        while(running > maxRunning && !_maxRunning.compare_exchange_weak(maxRunning, running))
+        { }
+
+        if(++_started >= _settings.interruptAfter)
+        {
+            interrupt::setInterrupted(true);
+        }
+
+        auto durationRange = _settings.maxDuration - _settings.minDuration;
+        if(durationRange.count() > 0)
+        {
+            // Deterministic but scattered durations
+            auto offset = (index * 2654435761u) % ((size_t)durationRange.count() + 1);
+            std::this_thread::sleep_for(_settings.minDuration + std::chrono::microseconds(offset));
+        }
+        else if(_settings.minDuration.count() > 0)
+        {
+            std::this_thread::sleep_for(_settings.minDuration);
+        }
+
+        if(_settings.outputSize > 0 && outputCallback)
+        {
+            std::string line(79, 'x');
+            line += '\n';
+            for(size_t remaining = _settings.outputSize; remaining > 0; )
+            {
+                size_t size = std::min(remaining, line.size());
+                outputCallback(std::string_view(line).substr(line.size() - size));
+                remaining -= size;
+            }
+        }
+
+        int exitCode = _settings.fails && _settings.fails(index) ? 1 : 0;
+
+        --_running;
+        record.end = Clock::now();
+        return { exitCode };
+    }
+
+    const std::vector<Record>& records() const
+    {
+        return _records;
+    }
+
+    size_t maxConcurrentCommands() const
+    {
+        return _maxRunning;
+    }
+
+private:
+    const std::vector<CommandEntry>& _commands;
+    const Settings _settings;
+    std::vector<Record> _records;
+    std::atomic<size_t> _running = 0;
+    std::atomic<size_t> _maxRunning = 0;
+    std::atomic<size_t> _started = 0;
+};
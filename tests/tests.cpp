@@ -4,7 +4,19 @@
 #undef INPUT
 #include "catch2/catch.hpp"
 
+#include "src/autopch.h"
+#include "src/buildconfigurator.h"
 #include "src/dependencyparser.h"
+#include "src/fileutil.h"
+#include "src/git.h"
+#include "src/projectcache.h"
+#include "src/threadpool.h"
+#include "mockexecutor.h"
+
+#include <fstream>
+#include <functional>
+#include <random>
+#include <sstream>
 
 // Needed since we link with wilco, even if this isn't really used
 void configure(Environment& env)
@@ -37,6 +49,7 @@ TEST_CASE( "Dependency Parser" ) {
         path"with"quotes
         m\ u\ l\ tiple\ s\ p\ aces
         endoffile)--";
+        const std::string originalData = dependencyData;
 
         std::vector<std::string> result;
         REQUIRE(!parseDependencyData(dependencyData, [&result](std::string_view path){
@@ -53,6 +66,7 @@ TEST_CASE( "Dependency Parser" ) {
             R"--(m u l tiple s p aces)--",
             R"--(endoffile)--",
         });
+        CHECK(dependencyData == originalData);
     }
 
     SECTION("cl style") {
@@ -76,6 +90,7 @@ TEST_CASE( "Dependency Parser" ) {
     }
 }           
         )--";
+        const std::string originalData = dependencyData;
 
         std::vector<std::string> result;
         REQUIRE(!parseDependencyData(dependencyData, [&result](std::string_view path){
@@ -92,6 +107,77 @@ TEST_CASE( "Dependency Parser" ) {
             R"--(m u l tiple s p aces)--",
             R"--(endoffile)--",
         });
+        CHECK(dependencyData == originalData);
+    }
+}
+
+TEST_CASE( "Module scan parser" ) {
+    std::string scanData = R"--({
+  "revision": 0,
+  "rules": [
+    {
+      "primary-output": "b.o",
+      "provides": [
+        {
+          "is-interface": true,
+          "logical-name": "b:part",
+          "source-path": "c:\\some\\b.cppm"
+        }
+      ],
+      "requires": [
+        { "logical-name": "a" },
+        { "logical-name": "std", "lookup-method": "by-name" }
+      ]
+    }
+  ],
+  "version": 1
+}
+)--";
+
+    std::vector<std::string> provided;
+    std::vector<std::string> required;
+    parseModuleDependencies(scanData, [&provided](std::string_view name) { provided.emplace_back(name); }, [&required](std::string_view name) { required.emplace_back(name); });
+    CHECK(provided == std::vector<std::string>{"b:part"});
+    CHECK(required == std::vector<std::string>{"a", "std"});
+}
+
+TEST_CASE( "Dependency scanner" ) {
+    // Lengths and needle positions chosen to hit both the vector loop and the scalar tail
+    std::string data(100, 'x');
+    for(size_t needlePos = 0; needlePos <= data.size(); ++needlePos)
+    {
+        std::string haystack = data;
+        if(needlePos < haystack.size())
+        {
+            haystack[needlePos] = needlePos % 2 ? ' ' : '\r';
+        }
+        for(size_t begin = 0; begin < 20; ++begin)
+        {
+            const char* first = haystack.data() + begin;
+            const char* last = haystack.data() + haystack.size();
+            CHECK(dependencyparser::findFirstOf<' ', '\n', '\r'>(first, last) == dependencyparser::findFirstOfScalar<' ', '\n', '\r'>(first, last));
+        }
+    }
+}
+
+TEST_CASE( "Path normalization" ) {
+    std::vector<std::string> inputs = {
+        "relative/path.h",
+        "./relative/../other/path.h",
+        "../up.h",
+        std::filesystem::current_path().string(),
+        (std::filesystem::current_path() / "dir" / "").string(),
+        (std::filesystem::current_path() / "dir" / ".." / "file.h").string(),
+        (std::filesystem::current_path() / "dir" / "." / "file.h").string(),
+    };
+
+    paths::NormalizationCache cache;
+    for(auto& input : inputs)
+    {
+        auto expected = std::filesystem::absolute(input).lexically_normal();
+        CHECK(cache.absoluteNormal(input) == expected);
+        CHECK(cache.absoluteNormal(std::filesystem::path(input)) == expected);
+        CHECK(paths::isAbsoluteNormal(input) == (input == expected.string()));
     }
 }
 
@@ -102,6 +188,1112 @@ TEST_CASE( "Hash" ) {
     CHECK(hash::md5String("A slightly longer text string of text to hash.") == "69f519d9eca214b238de1f92e52e9e1d");
 }
 
+TEST_CASE( "Thread pool" ) {
+    ThreadPool pool(4);
+
+    SECTION("parallelFor covers every index once") {
+        std::vector<int> counts(10000);
+        parallelFor(counts.size(), 7, [&counts](size_t begin, size_t end){
+            for(size_t i = begin; i < end; ++i)
+            {
+                ++counts[i];
+            }
+        }, pool);
+        CHECK(std::all_of(counts.begin(), counts.end(), [](int count) { return count == 1; }));
+    }
+
+    SECTION("task groups can nest and propagate exceptions") {
+        std::atomic<int> sum = 0;
+        TaskGroup outer(pool);
+        for(int i = 0; i < 8; ++i)
+        {
+            outer.run([&sum, &pool](){
+                TaskGroup inner(pool);
+                for(int j = 0; j < 8; ++j)
+                {
+                    inner.run([&sum](){ ++sum; });
+                }
+                inner.wait();
+            });
+        }
+        outer.wait();
+        CHECK(sum == 64);
+
+        TaskGroup failing(pool);
+        failing.run([](){ throw std::runtime_error("task failed"); });
+        CHECK_THROWS_AS(failing.wait(), std::runtime_error);
+    }
+
+    SECTION("async returns results") {
+        auto future = pool.async([](){ return 42; });
+        CHECK(future.get() == 42);
+    }
+
+    SECTION("waiting only runs the group's own tasks") {
+        ThreadPool single(1);
+        std::promise<void> started;
+        std::promise<void> release;
+        auto released = release.get_future().share();
+        auto blocking = single.async([&started, released](){ started.set_value(); released.wait(); });
+        started.get_future().wait();
+
+        // The worker is busy, so both of these are queued. Running the second one while
+        // waiting for the group would never return.
+        bool ran = false;
+        TaskGroup group(single);
+        group.run([&ran](){ ran = true; });
+        auto queued = single.async([released](){ released.wait(); });
+        group.wait();
+        CHECK(ran);
+
+        release.set_value();
+        blocking.wait();
+        queued.wait();
+    }
+}
+
+// Commands reading the outputs of up to three random earlier commands
+static Database generateSchedulerDatabase(size_t commandCount)
+{
+    std::mt19937 random(42);
+    std::vector<CommandEntry> commands(commandCount);
+    for(size_t i = 0; i < commandCount; ++i)
+    {
+        commands[i].command = "noop " + std::to_string(i);
+        commands[i].description = "Command " + std::to_string(i);
+        commands[i].inputs.push_back("scheduler_test/in/" + std::to_string(i));
+        commands[i].outputs.push_back("scheduler_test/out/" + std::to_string(i));
+        for(size_t input = 0; input < 3 && i > 0; ++input)
+        {
+            commands[i].inputs.push_back(commands[std::uniform_int_distribution<size_t>(0, i - 1)(random)].outputs.front());
+        }
+    }
+
+    Database database;
+    database.setCommands(std::move(commands));
+    return database;
+}
+
+// Keeps build progress from cluttering the test output
+struct SilenceStdout
+{
+    SilenceStdout()
+        : previous(std::cout.rdbuf(sink.rdbuf()))
+    { }
+
+    ~SilenceStdout()
+    {
+        std::cout.rdbuf(previous);
+    }
+
+    std::ostringstream sink;
+    std::streambuf* previous;
+};
+
+TEST_CASE( "Scheduler" ) {
+    auto database = generateSchedulerDatabase(2000);
+    auto& dependencies = database.getCommandDependencies();
+    auto filteredCommands = filterCommands(database);
+    REQUIRE(filteredCommands.size() == 2000);
+
+    SECTION("dependencies finish before dependents start") {
+        MockExecutor executor(database.getCommands(), {std::chrono::microseconds(0), std::chrono::microseconds(200), 200});
+        size_t completed;
+        {
+            SilenceStdout silence;
+            completed = runCommands(filteredCommands, database, 8, false, executor);
+        }
+        CHECK(completed == 2000);
+        CHECK(executor.maxConcurrentCommands() <= 8);
+
+        auto& records = executor.records();
+        CHECK(std::all_of(records.begin(), records.end(), [](auto& record) { return record.runs == 1; }));
+        for(size_t i = 0; i < records.size(); ++i)
+        {
+            for(auto dependency : dependencies[i])
+            {
+                CHECK(records[dependency].end <= records[i].start);
+            }
+        }
+    }
+
+    SECTION("failures stop dependents from running") {
+        MockExecutor::Settings settings;
+        settings.fails = [](size_t index) { return index == 100; };
+        MockExecutor executor(database.getCommands(), settings);
+        size_t completed;
+        {
+            SilenceStdout silence;
+            completed = runCommands(filteredCommands, database, 4, false, executor);
+        }
+        CHECK(completed < 2000);
+
+        auto& records = executor.records();
+        for(size_t i = 0; i < records.size(); ++i)
+        {
+            for(auto dependency : dependencies[i])
+            {
+                if(dependency == 100)
+                {
+                    CHECK(records[i].runs == 0);
+                }
+            }
+        }
+    }
+
+    SECTION("interrupts stop new commands from starting") {
+        MockExecutor::Settings settings;
+        settings.interruptAfter = 50;
+        MockExecutor executor(database.getCommands(), settings);
+        size_t completed;
+        {
+            SilenceStdout silence;
+            completed = runCommands(filteredCommands, database, 4, false, executor);
+        }
+        interrupt::setInterrupted(false);
+        CHECK(completed < 50);
+
+        auto& records = executor.records();
+        size_t started = std::count_if(records.begin(), records.end(), [](auto& record) { return record.runs > 0; });
+        // Commands already handed to the thread pool still run
+        CHECK(started < 50 + 4);
+    }
+
+    SECTION("commands run while the graph is being checked") {
+        MockExecutor executor(database.getCommands(), {std::chrono::microseconds(0), std::chrono::microseconds(200), 200});
+        BuildResult result;
+        {
+            SilenceStdout silence;
+            result = buildCommands(database, 8, false, {}, {database.getCommands()[1000].description}, {}, executor);
+        }
+
+        std::vector<bool> needed(2000, false);
+        std::vector<uint32_t> stack = {1000};
+        while(!stack.empty())
+        {
+            auto command = stack.back();
+            stack.pop_back();
+            needed[command] = true;
+            stack.insert(stack.end(), dependencies[command].begin(), dependencies[command].end());
+        }
+        size_t neededCount = std::count(needed.begin(), needed.end(), true);
+        CHECK(result.dirtyCommands == neededCount);
+        CHECK(result.completedCommands == neededCount);
+
+        auto& records = executor.records();
+        for(size_t i = 0; i < records.size(); ++i)
+        {
+            CHECK(records[i].runs == (needed[i] ? 1 : 0));
+            for(auto dependency : dependencies[i])
+            {
+                CHECK((!needed[i] || records[dependency].end <= records[i].start));
+            }
+        }
+    }
+}
+
+TEST_CASE( "Depfiles of finished commands" ) {
+    auto root = std::filesystem::absolute("depfile_test");
+    std::filesystem::create_directories(root);
+    std::ofstream(root / "a.h");
+    std::ofstream(root / "b.h");
+
+    std::vector<CommandEntry> commands(20);
+    for(size_t i = 0; i < commands.size(); ++i)
+    {
+        auto index = std::to_string(i);
+        std::ofstream(root / (index + ".cpp"));
+        std::ofstream(root / (index + ".d")) << index << ".o: " << (root / (index + ".cpp")).string() << " " << (root / (i % 2 ? "a.h" : "b.h")).string() << "\n";
+        commands[i].command = "noop " + index;
+        commands[i].inputs.push_back(root / (index + ".cpp"));
+        commands[i].outputs.push_back(root / (index + ".o"));
+        commands[i].depFile = root / (index + ".d");
+    }
+
+    Database database;
+    database.setCommands(std::move(commands));
+    auto filteredCommands = filterCommands(database);
+    REQUIRE(filteredCommands.size() == 20);
+
+    MockExecutor executor(database.getCommands());
+    size_t completed;
+    {
+        SilenceStdout silence;
+        completed = runCommands(filteredCommands, database, 4, false, executor);
+    }
+    CHECK(completed == 20);
+
+    auto& signatures = database.getCommandSignatures();
+    CHECK(std::none_of(signatures.begin(), signatures.end(), [](auto& signature) { return signature == EMPTY_SIGNATURE; }));
+    for(auto header : {"a.h", "b.h"})
+    {
+        auto& paths = database.getFilePaths();
+        auto it = std::find(paths.begin(), paths.end(), root / header);
+        REQUIRE(it != paths.end());
+        CHECK(database.getFileSignatures()[it - paths.begin()].first != EMPTY_SIGNATURE);
+        CHECK(database.getFileDependents()[it - paths.begin()].size() == 10);
+    }
+
+    std::filesystem::remove_all(root);
+}
+
+TEST_CASE( "Automatic PCH" ) {
+    auto root = std::filesystem::absolute("autopch_test");
+    std::filesystem::create_directories(root / "project");
+    std::filesystem::create_directories(root / "external");
+    for(auto header : {"external/common.h", "external/some.h", "project/local.h"})
+    {
+        std::ofstream(root / header) << "#pragma once\n";
+    }
+
+    autopch::Settings settings;
+    settings.root = root / "project";
+    auto header = autopch::headerPath(root / "project/data", "Project");
+    autopch::configureHeader(header, settings);
+
+    std::vector<CommandEntry> commands(11);
+    commands[0].command = "noop pch";
+    commands[0].inputs.push_back(header);
+    commands[0].outputs.push_back(root / "project/data/project.pch");
+    for(size_t i = 1; i < commands.size(); ++i)
+    {
+        auto index = std::to_string(i);
+        auto source = root / "project" / (index + ".cpp");
+        std::ofstream(source.string());
+        // Everything includes common.h and local.h, but only some include some.h
+        std::ofstream(root / "project" / (index + ".d")) << index << ".o: " << source.string() << " "
+            << (root / "external/common.h").string() << " " << (root / "project/local.h").string()
+            << (i <= 4 ? " " + (root / "external/some.h").string() : "") << "\n";
+        commands[i].command = "noop " + index;
+        commands[i].inputs = { source, root / "project/data/project.pch" };
+        commands[i].outputs.push_back(root / "project" / (index + ".o"));
+        commands[i].depFile = root / "project" / (index + ".d");
+    }
+
+    Database database;
+    database.setCommands(std::move(commands));
+    CHECK(autopch::update(database) == 0);
+
+    auto filteredCommands = filterCommands(database);
+    MockExecutor executor(database.getCommands());
+    {
+        SilenceStdout silence;
+        runCommands(filteredCommands, database, 4, false, executor);
+    }
+
+    CHECK(autopch::update(database) == 1);
+    auto contents = readFile(header);
+    CHECK(contents.find("#include \"" + (root / "external/common.h").generic_string() + "\"\n") != std::string::npos);
+    CHECK(contents.find("some.h") == std::string::npos);
+    CHECK(contents.find("local.h") == std::string::npos);
+
+    // Nothing changed, so the header is left alone
+    CHECK(autopch::update(database) == 0);
+
+    std::filesystem::remove_all(root);
+}
+
+TEST_CASE( "Unity batches" ) {
+    static GccLikeToolchainProvider toolchain("unity-gcc", "g++", "", "g++", "ar");
+    auto root = std::filesystem::absolute("unity_test");
+
+    cli::Context cliContext(root, "tests", {});
+    Environment env(cliContext);
+    auto& project = env.createProject("Unity", Executable);
+    project.toolchain = &toolchain;
+    project.output = "bin/unity";
+    auto& unity = project.ext<extensions::Gcc>().unity;
+    unity.enabled = true;
+    unity.maxFiles = 3;
+    unity.ignoredFiles += "src/a/4.cpp";
+    // Added out of order, which mustn't change the batches
+    for(auto file : {"src/a/2.cpp", "src/a/0.cpp", "src/a/1.cpp", "src/a/3.cpp", "src/a/4.cpp", "src/b/0.cpp", "src/c/0.c", "src/c/1.c", "src/c/2.cpp"})
+    {
+        project.files += file;
+    }
+
+    std::vector<CommandEntry> commands;
+    BuildConfigurator::collectCommands(env, commands, root, project);
+
+    std::vector<std::string> compiled;
+    for(auto& command : commands)
+    {
+        if(str::startsWith(command.description, "Compiling "))
+        {
+            compiled.push_back(command.inputs.front().filename().string() + " " + std::to_string(command.inputs.size()));
+        }
+    }
+    // a/0-2 in a batch where a/2 was, a/3 left alone, a/4 ignored, b/0 alone, c/0-1 batched apart from c/2
+    CHECK(compiled == std::vector<std::string>{"unity_0.cpp 4", "3.cpp 1", "4.cpp 1", "0.cpp 1", "unity_0.c 3", "2.cpp 1"});
+    CHECK(readFile(root / "unity/Unity/src/a/unity_0.cpp") ==
+        "#include \"" + (std::filesystem::current_path() / "src/a/0.cpp").generic_string() + "\"\n"
+        "#include \"" + (std::filesystem::current_path() / "src/a/1.cpp").generic_string() + "\"\n"
+        "#include \"" + (std::filesystem::current_path() / "src/a/2.cpp").generic_string() + "\"\n");
+
+    std::filesystem::remove_all(root);
+}
+
+TEST_CASE( "Unity isolation of changed files" ) {
+    static GccLikeToolchainProvider toolchain("unity-isolation-gcc", "g++", "", "g++", "ar");
+    auto root = std::filesystem::absolute("unity_isolation_test");
+    std::filesystem::remove_all(root);
+    std::filesystem::create_directories(root / "src");
+    for(auto file : {"0.cpp", "1.cpp", "2.cpp"})
+    {
+        writeFile(root / "src" / file, "// " + std::string(file) + "\n");
+    }
+
+    auto previousPath = std::filesystem::current_path();
+    std::filesystem::current_path(root);
+    if(std::system("git init -q && git add src && git -c user.name=wilco -c user.email=wilco@localhost commit -q -m sources") != 0)
+    {
+        std::filesystem::current_path(previousPath);
+        std::filesystem::remove_all(root);
+        WARN("Skipped, git isn't available.");
+        return;
+    }
+
+    cli::Context cliContext(root, "tests", {});
+    auto collect = [&](const std::string& name)
+    {
+        Environment env(cliContext);
+        auto& project = env.createProject(name, Executable);
+        project.toolchain = &toolchain;
+        project.output = "bin/" + name;
+        for(auto file : {"src/0.cpp", "src/1.cpp", "src/2.cpp"})
+        {
+            project.files += file;
+        }
+        auto& unity = project.ext<extensions::Gcc>().unity;
+        unity.enabled = true;
+        unity.isolateChangedFiles = true;
+
+        std::vector<CommandEntry> commands;
+        BuildConfigurator::collectCommands(env, commands, root, project);
+        BuildConfigurator::addToolchainConfigurationDependencies(env, project);
+
+        std::vector<std::string> compiled;
+        for(auto& command : commands)
+        {
+            if(str::startsWith(command.description, "Compiling "))
+            {
+                compiled.push_back(command.inputs.front().filename().string());
+            }
+        }
+        return std::make_pair(compiled, env.configurationDependencies);
+    };
+
+    // Batched sources are watched, so editing one configures again
+    auto [compiled, dependencies] = collect("Clean");
+    CHECK(compiled == std::vector<std::string>{"unity_0.cpp"});
+    CHECK(dependencies == std::set<std::filesystem::path>{root / "src/0.cpp", root / "src/1.cpp", root / "src/2.cpp"});
+
+    // ...which takes the edited one out of the batch
+    writeFile(root / "src/1.cpp", "// edited\n");
+    std::tie(compiled, dependencies) = collect("Edited");
+    CHECK(compiled == std::vector<std::string>{"unity_0.cpp", "1.cpp"});
+    CHECK(dependencies == std::set<std::filesystem::path>{root / "src/0.cpp", root / "src/2.cpp"});
+
+    std::filesystem::current_path(previousPath);
+    std::filesystem::remove_all(root);
+}
+
+TEST_CASE( "Git change detection" ) {
+    auto root = std::filesystem::absolute("git_change_detection_test");
+    std::filesystem::remove_all(root);
+    std::filesystem::create_directories(root / "src");
+    writeFile(root / "src/a.cpp", "// a\n");
+    writeFile(root / "src/b.cpp", "// b\n");
+    writeFile(root / ".gitignore", "*.o\n");
+
+    auto previousPath = std::filesystem::current_path();
+    std::filesystem::current_path(root);
+    const std::string commit = "git -c user.name=wilco -c user.email=wilco@localhost commit -q -a -m ";
+    if(std::system(("git init -q && git add .gitignore src && " + commit + "sources").c_str()) != 0)
+    {
+        std::filesystem::current_path(previousPath);
+        std::filesystem::remove_all(root);
+        WARN("Skipped, git isn't available.");
+        return;
+    }
+
+    std::vector<std::filesystem::path> paths = { root / "src/a.cpp", root / "src/b.cpp" };
+    std::string state;
+    std::vector<bool> unchanged;
+    std::vector<bool> changed;
+
+    // Without a previous state nothing is known to be unchanged, but the state is recorded
+    CHECK_FALSE(git::findUnchangedFiles(paths, state, unchanged));
+    CHECK(unchanged == std::vector<bool>{false, false});
+    CHECK_FALSE(state.empty());
+
+    // Clean tree
+    CHECK(git::findUnchangedFiles(paths, state, unchanged));
+    CHECK(unchanged == std::vector<bool>{true, true});
+    CHECK(git::findChangedFiles(paths, changed));
+    CHECK(changed == std::vector<bool>{false, false});
+
+    // Modified tracked file
+    writeFile(root / "src/a.cpp", "// a, modified\n");
+    CHECK(git::findUnchangedFiles(paths, state, unchanged));
+    CHECK(unchanged == std::vector<bool>{false, true});
+    CHECK(git::findChangedFiles(paths, changed));
+    CHECK(changed == std::vector<bool>{true, false});
+
+    // Untracked file
+    writeFile(root / "src/c.cpp", "// c\n");
+    paths.push_back(root / "src/c.cpp");
+    CHECK(git::findUnchangedFiles(paths, state, unchanged));
+    CHECK(unchanged == std::vector<bool>{false, true, false});
+    CHECK(git::findChangedFiles(paths, changed));
+    CHECK(changed == std::vector<bool>{true, false, true});
+
+    // Ignored file
+    writeFile(root / "src/a.o", "");
+    paths.push_back(root / "src/a.o");
+    CHECK(git::findUnchangedFiles(paths, state, unchanged));
+    CHECK(unchanged == std::vector<bool>{false, true, false, false});
+    CHECK(git::findChangedFiles(paths, changed));
+    CHECK(changed == std::vector<bool>{true, false, true, true});
+
+    // HEAD changed between runs, with b.cpp edited and committed in between, so only
+    // the difference between the two HEADs tells it changed
+    writeFile(root / "src/b.cpp", "// b, committed\n");
+    REQUIRE(std::system((commit + "edits").c_str()) == 0);
+    CHECK(git::findUnchangedFiles(paths, state, unchanged));
+    CHECK(unchanged == std::vector<bool>{false, false, false, false});
+    CHECK(git::findChangedFiles(paths, changed));
+    CHECK(changed == std::vector<bool>{false, false, true, true});
+
+    // ...and nothing changed since
+    CHECK(git::findUnchangedFiles(paths, state, unchanged));
+    CHECK(unchanged == std::vector<bool>{true, true, false, false});
+    auto recordedState = state;
+
+#if !_WIN32
+    // Without git, everything is verified in full
+    std::string previousSearchPath = getenv("PATH");
+    setenv("PATH", "", 1);
+    CHECK_FALSE(git::findUnchangedFiles(paths, state, unchanged));
+    CHECK(unchanged == std::vector<bool>{false, false, false, false});
+    CHECK_FALSE(git::findChangedFiles(paths, changed));
+    CHECK(changed == std::vector<bool>{false, false, false, false});
+    setenv("PATH", previousSearchPath.c_str(), 1);
+#endif
+
+    // Outside a repository too
+    auto plainDirectory = std::filesystem::temp_directory_path() / "wilco_git_change_detection_test";
+    std::filesystem::create_directories(plainDirectory);
+    std::filesystem::current_path(plainDirectory);
+    state = recordedState;
+    CHECK_FALSE(git::findUnchangedFiles(paths, state, unchanged));
+    CHECK(unchanged == std::vector<bool>{false, false, false, false});
+    CHECK_FALSE(git::findChangedFiles(paths, changed));
+    CHECK(changed == std::vector<bool>{false, false, false, false});
+
+    std::filesystem::current_path(previousPath);
+    std::filesystem::remove_all(plainDirectory);
+    std::filesystem::remove_all(root);
+}
+
+// Collects the commands gcc-like toolchains make for executables building src/main.cpp,
+// with the data directory removed again when done
+struct ToolchainTest
+{
+    ToolchainTest(const std::string& directory)
+        : root(std::filesystem::absolute(directory))
+        , cliContext(root, "tests", {})
+        , env(cliContext)
+    { }
+
+    ~ToolchainTest()
+    {
+        std::filesystem::remove_all(root);
+    }
+
+    static const GccLikeToolchainProvider& gcc()
+    {
+        static GccLikeToolchainProvider toolchain("test-gcc", "g++", "", "g++", "ar");
+        return toolchain;
+    }
+
+    static const GccLikeToolchainProvider& clang()
+    {
+        static GccLikeToolchainProvider toolchain("test-clang", "clang++", "", "clang++", "ar");
+        return toolchain;
+    }
+
+    // setup adjusts the project before its commands are collected
+    std::vector<CommandEntry> collect(const GccLikeToolchainProvider& toolchain, const std::string& name, const std::function<void(Project&)>& setup = {})
+    {
+        auto& project = env.createProject(name, Executable);
+        project.toolchain = &toolchain;
+        project.output = "bin/" + name;
+        project.files += "src/main.cpp";
+        if(setup)
+        {
+            setup(project);
+        }
+
+        std::vector<CommandEntry> commands;
+        BuildConfigurator::collectCommands(env, commands, root, project);
+        return commands;
+    }
+
+    std::filesystem::path root;
+    cli::Context cliContext;
+    Environment env;
+};
+
+// The first command whose description starts with prefix, failing the test if there is none
+static CommandEntry& requireCommand(std::vector<CommandEntry>& commands, std::string_view prefix)
+{
+    auto it = std::find_if(commands.begin(), commands.end(), [prefix](auto& command) { return str::startsWith(command.description, prefix); });
+    REQUIRE(it != commands.end());
+    return *it;
+}
+
+static bool contains(const std::vector<std::filesystem::path>& paths, const std::filesystem::path& path)
+{
+    return std::find(paths.begin(), paths.end(), path) != paths.end();
+}
+
+TEST_CASE( "Link time features" ) {
+    ToolchainTest test("features_test");
+    auto commands = test.collect(ToolchainTest::gcc(), "Features", [](Project& project)
+    {
+        project.features += { feature::SplitDebugInfo, feature::RemoveUnusedCode, feature::UseLld };
+    });
+    auto& compile = requireCommand(commands, "Compiling ");
+    auto& link = requireCommand(commands, "Linking ");
+
+    CHECK(compile.command.find(" -ffunction-sections -fdata-sections") != std::string::npos);
+    CHECK(link.command.find(" -fuse-ld=lld") != std::string::npos);
+    if(OperatingSystem::current() != MacOS)
+    {
+        CHECK(compile.command.find(" -gsplit-dwarf") != std::string::npos);
+        REQUIRE(compile.outputs.size() == 2);
+        CHECK(compile.outputs[1].extension() == ".dwo");
+        CHECK(compile.outputs[1].stem() == compile.outputs[0].stem());
+        CHECK(link.command.find(" -Wl,--gc-sections") != std::string::npos);
+        CHECK(link.command.find(" -Wl,--gdb-index") != std::string::npos);
+    }
+}
+
+TEST_CASE( "LTO" ) {
+    ToolchainTest test("lto_test");
+    auto thinLto = [](Project& project)
+    {
+        project.features += { feature::ThinLTO, feature::UseLld };
+    };
+
+    // gcc has no ThinLTO and falls back to regular LTO
+    auto gcc = test.collect(ToolchainTest::gcc(), "LtoGcc", thinLto);
+    auto& gccCompile = requireCommand(gcc, "Compiling ");
+    auto& gccLink = requireCommand(gcc, "Linking ");
+    CHECK(gccCompile.command.find(" -flto") != std::string::npos);
+    CHECK(gccCompile.command.find("-flto=thin") == std::string::npos);
+    CHECK(gccLink.command.find(" -flto=auto") != std::string::npos);
+    CHECK(gccLink.command.find("cache") == std::string::npos);
+
+    auto clang = test.collect(ToolchainTest::clang(), "LtoClang", thinLto);
+    auto& clangCompile = requireCommand(clang, "Compiling ");
+    auto& clangLink = requireCommand(clang, "Linking ");
+    CHECK(clangCompile.command.find(" -flto=thin") != std::string::npos);
+    CHECK(clangLink.command.find(" -flto=thin") != std::string::npos);
+    CHECK(clangLink.command.find(" -flto-jobs=") == std::string::npos);
+    if(OperatingSystem::current() != MacOS)
+    {
+        CHECK(clangLink.command.find(" -Wl,--thinlto-cache-dir=") != std::string::npos);
+        CHECK(clangLink.command.find(" -Wl,--thinlto-cache-policy=cache_size_bytes=4096m:prune_after=168h") != std::string::npos);
+    }
+
+    ltoJobs.value = "2";
+    auto gccJobs = test.collect(ToolchainTest::gcc(), "LtoGccJobs", thinLto);
+    auto clangJobs = test.collect(ToolchainTest::clang(), "LtoClangJobs", thinLto);
+    CHECK(requireCommand(gccJobs, "Linking ").command.find(" -flto=2") != std::string::npos);
+    CHECK(requireCommand(clangJobs, "Linking ").command.find(" -flto-jobs=2") != std::string::npos);
+    ltoJobs.value = "all";
+    CHECK_THROWS_AS(test.collect(ToolchainTest::clang(), "LtoClangBadJobs", thinLto), cli::argument_error);
+    ltoJobs.reset();
+}
+
+TEST_CASE( "Profile guided optimization" ) {
+    ToolchainTest test("pgo_test");
+    auto& gcc = ToolchainTest::gcc();
+    auto& clang = ToolchainTest::clang();
+
+    pgoMode.value = "generate";
+    auto generate = test.collect(gcc, "GenerateGcc");
+    CHECK(requireCommand(generate, "Compiling ").command.find(" -fprofile-generate") != std::string::npos);
+    CHECK(requireCommand(generate, "Linking ").command.find(" -fprofile-generate") != std::string::npos);
+
+    // gcc takes the profile next to the object, if the object's code has run
+    pgoMode.value = "use";
+    auto gccUse = test.collect(gcc, "UseGcc");
+    auto& gccCompile = requireCommand(gccUse, "Compiling ");
+    CHECK(gccCompile.command.find(" -fprofile-use") != std::string::npos);
+    CHECK(gccCompile.inputs.size() == 1);
+    auto gcdaPath = gccCompile.outputs[0].generic_string();
+    gcdaPath.replace(gcdaPath.find("/UseGcc/"), 8, "/UseGccProfiled/");
+    auto gcda = std::filesystem::path(gcdaPath).replace_extension(".gcda");
+    std::filesystem::create_directories(gcda.parent_path());
+    std::ofstream(gcda.string()).put('\n');
+    auto gccProfiled = test.collect(gcc, "UseGccProfiled");
+    CHECK(contains(requireCommand(gccProfiled, "Compiling ").inputs, gcda));
+
+    // clang merges the raw profiles into one profile used by every compile
+    pgoMode.value = "generate";
+    auto clangGenerate = test.collect(clang, "ClangGenerate");
+    CHECK(requireCommand(clangGenerate, "Compiling ").command.find(" -fprofile-generate=") != std::string::npos);
+    pgoMode.value = "use";
+    auto clangUse = test.collect(clang, "ClangUse");
+    auto& merge = requireCommand(clangUse, "Merging ");
+    auto& clangCompile = requireCommand(clangUse, "Compiling ");
+    REQUIRE(merge.outputs.size() == 1);
+    CHECK(merge.command.find("llvm-profdata\" merge") != std::string::npos);
+    CHECK(clangCompile.command.find(" -fprofile-use=") != std::string::npos);
+    CHECK(contains(clangCompile.inputs, merge.outputs[0]));
+    CHECK(requireCommand(clangUse, "Linking ").command.find("-fprofile") == std::string::npos);
+
+    auto profileDir = merge.inputs[0];
+    std::filesystem::create_directories(profileDir.parent_path() / "ClangProfiled");
+    std::ofstream((profileDir.parent_path() / "ClangProfiled" / "default_1.profraw").string()).put('\n');
+    auto clangProfiled = test.collect(clang, "ClangProfiled");
+    CHECK(requireCommand(clangProfiled, "Merging ").inputs.size() == 2);
+
+    pgoMode.value = "unknown";
+    CHECK_THROWS(test.collect(gcc, "Unknown"));
+
+    pgoMode.reset();
+}
+
+TEST_CASE( "BOLT" ) {
+    ToolchainTest test("bolt_test");
+    auto collect = [&test](const std::string& name, extensions::Gcc::Bolt::Profile profile)
+    {
+        return test.collect(ToolchainTest::gcc(), name, [profile](Project& project)
+        {
+            auto& bolt = project.ext<extensions::Gcc>().bolt;
+            bolt.enabled = true;
+            bolt.profile = profile;
+            bolt.trainingArguments = "--benchmark";
+            bolt.trainingInputs += "data/workload.txt";
+        });
+    };
+
+    // The linked executable is trained on, and rewritten into the output
+    auto perf = collect("Perf", extensions::Gcc::Bolt::Perf);
+    auto& link = requireCommand(perf, "Linking ");
+    auto& training = requireCommand(perf, "Training ");
+    auto& optimize = requireCommand(perf, "Optimizing ");
+    CHECK(link.command.find(" -Wl,--emit-relocs") != std::string::npos);
+    CHECK(link.outputs[0] != std::filesystem::path("bin/Perf"));
+    CHECK(str::startsWith(training.command, "\"perf\" record"));
+    CHECK(training.command.find(" --benchmark") != std::string::npos);
+    CHECK(contains(training.inputs, link.outputs[0]));
+    CHECK(contains(training.inputs, "data/workload.txt"));
+    CHECK(contains(optimize.inputs, link.outputs[0]));
+    CHECK(contains(optimize.inputs, training.outputs[0]));
+    CHECK(optimize.outputs == std::vector<std::filesystem::path>{"bin/Perf"});
+
+    auto instrument = collect("Instrument", extensions::Gcc::Bolt::Instrument);
+    auto& instrumentLink = requireCommand(instrument, "Linking ");
+    auto& instrumented = requireCommand(instrument, "Instrumenting ");
+    auto& instrumentTraining = requireCommand(instrument, "Training ");
+    CHECK(contains(instrumented.inputs, instrumentLink.outputs[0]));
+    CHECK(contains(instrumentTraining.inputs, instrumented.outputs[0]));
+    CHECK(instrumentTraining.command.find("perf") == std::string::npos);
+    CHECK(contains(requireCommand(instrument, "Optimizing ").inputs, instrumentTraining.outputs[0]));
+}
+
+TEST_CASE( "Project cache" ) {
+    static GccLikeToolchainProvider toolchain("cache-gcc", "g++", "", "g++", "ar");
+    auto root = std::filesystem::absolute("project_cache_test");
+    std::filesystem::create_directories(root);
+    const auto cachePath = root / "project_cache";
+    const Signature key = hash::md5("key");
+
+    cli::Context cliContext(root, "tests", {});
+    auto configure = [&](Environment& env, const std::string& libSource)
+    {
+        auto& lib = env.createProject("Lib", StaticLib);
+        lib.toolchain = &toolchain;
+        lib.output = "lib/lib";
+        lib.files += libSource;
+        lib.exports.includePaths += "include";
+
+        auto& app = env.createProject("App", Executable);
+        app.toolchain = &toolchain;
+        app.output = "bin/app";
+        app.files += "src/main.cpp";
+        app.ext<extensions::Gcc>().compilerFlags += "-Wall";
+        app.import(lib);
+    };
+
+    // Collects commands like configuring does, returning the names of the projects processed
+    auto collect = [&](Environment& env, std::vector<CommandEntry>& commands)
+    {
+        ProjectCache previous;
+        previous.load(cachePath, key);
+        ProjectCache cache;
+        std::vector<std::string> processed;
+        for(auto& project : env.projects)
+        {
+            std::vector<CommandEntry> projectCommands;
+            auto settings = ProjectCache::digestProject(*project, root);
+            REQUIRE(settings);
+            if(!previous.restore(*project, *settings, projectCommands))
+            {
+                BuildConfigurator::collectCommands(env, projectCommands, root, *project);
+                processed.push_back(project->name);
+            }
+            cache.store(*project, *settings, projectCommands);
+            commands.insert(commands.end(), projectCommands.begin(), projectCommands.end());
+        }
+        cache.save(cachePath, key);
+        return processed;
+    };
+
+    Environment first(cliContext);
+    configure(first, "src/lib.cpp");
+    std::vector<CommandEntry> firstCommands;
+    CHECK(collect(first, firstCommands) == std::vector<std::string>{"Lib", "App"});
+
+    // Nothing changed, so everything comes from the cache, including what the app links with
+    Environment second(cliContext);
+    configure(second, "src/lib.cpp");
+    std::vector<CommandEntry> secondCommands;
+    CHECK(collect(second, secondCommands).empty());
+    CHECK(secondCommands == firstCommands);
+    for(size_t i = 0; i < firstCommands.size(); ++i)
+    {
+        CHECK(secondCommands[i].description == firstCommands[i].description);
+        CHECK(secondCommands[i].rspContents == firstCommands[i].rspContents);
+    }
+    CHECK(second.projects[0]->ext<extensions::internal::ToolchainOutputs>().libraryFiles.vector() == first.projects[0]->ext<extensions::internal::ToolchainOutputs>().libraryFiles.vector());
+
+    // The library's sources don't change what the app links with
+    Environment third(cliContext);
+    configure(third, "src/other.cpp");
+    std::vector<CommandEntry> thirdCommands;
+    CHECK(collect(third, thirdCommands) == std::vector<std::string>{"Lib"});
+
+    // Settings the cache can't tell have changed aren't cached
+    Environment fourth(cliContext);
+    configure(fourth, "src/other.cpp");
+    fourth.projects[0]->ext<extensions::Gcc>().unity.enabled = true;
+    CHECK(!ProjectCache::digestProject(*fourth.projects[0], root));
+
+    // A different key drops everything
+    ProjectCache cache;
+    CHECK(cache.load(cachePath, key));
+    CHECK(cache.size() == 2);
+    CHECK(!cache.load(cachePath, hash::md5("other key")));
+    CHECK(cache.size() == 0);
+
+    std::filesystem::remove_all(root);
+}
+
+TEST_CASE( "Project waves" ) {
+    cli::Context cliContext(".", "tests", {});
+    Environment env(cliContext);
+    auto& base = env.createProject("Base", StaticLib);
+    auto& a = env.createProject("A", StaticLib);
+    auto& b = env.createProject("B", StaticLib);
+    env.createProject("Tool", Executable);
+    auto& app = env.createProject("App", Executable);
+    a.dependencies += &base;
+    b.dependencies += &base;
+    app.dependencies += &a;
+    app.dependencies += &b;
+
+    auto waves = BuildConfigurator::getProjectWaves(env.projects);
+    CHECK(waves == std::vector<std::vector<size_t>>{{0, 3}, {1, 2}, {4}});
+
+    // Dependencies have to come first
+    std::swap(env.projects[0], env.projects[1]);
+    CHECK_THROWS(BuildConfigurator::getProjectWaves(env.projects));
+}
+
+TEST_CASE( "C++ modules" ) {
+    auto root = std::filesystem::absolute("modules_test");
+    std::filesystem::create_directories(root);
+
+    // main imports b, which imports a. Commands are listed importers first, so going by
+    // static dependencies alone they'd run in the wrong order.
+    struct Source
+    {
+        std::string name;
+        std::string provides;
+        std::string requires;
+    };
+    std::vector<Source> sources = {{"main.cpp", "", "b"}, {"b.cppm", "b", "a"}, {"a.cppm", "a", ""}};
+    std::vector<CommandEntry> commands;
+    for(auto& source : sources)
+    {
+        auto path = root / source.name;
+        std::ofstream(path.string()) << source.name << "\n";
+        std::ofstream(path.string() + ".o");
+
+        auto scanPath = path.string() + ".ddi";
+        std::ofstream scanFile(scanPath);
+        scanFile << "{\"rules\": [{\"primary-output\": \"" << source.name << ".o\"";
+        scanFile << ", \"provides\": [" << (source.provides.empty() ? "" : "{\"logical-name\": \"" + source.provides + "\"}") << "]";
+        scanFile << ", \"requires\": [" << (source.requires.empty() ? "" : "{\"logical-name\": \"" + source.requires + "\"}") << "]}]}\n";
+
+        CommandEntry scan;
+        scan.command = "noop scan";
+        scan.description = "Scanning " + source.name;
+        scan.inputs = {path};
+        scan.outputs = {scanPath};
+        commands.push_back(scan);
+
+        CommandEntry compile;
+        compile.command = "noop compile";
+        compile.description = "Compiling " + source.name;
+        compile.inputs = {path, scanPath};
+        compile.outputs = {path.string() + ".o"};
+        compile.moduleScan.path = scanPath;
+        compile.moduleScan.mapFile = path.string() + ".modmap";
+        if(!source.provides.empty())
+        {
+            compile.moduleScan.moduleOutput = path.string() + ".pcm";
+            compile.outputs.push_back(compile.moduleScan.moduleOutput);
+            std::ofstream(compile.moduleScan.moduleOutput.string());
+        }
+        commands.push_back(compile);
+    }
+
+    Database database;
+    database.setCommands(std::move(commands));
+    auto findCommand = [&database](const std::string& description)
+    {
+        auto& commands = database.getCommands();
+        return (size_t)(std::find_if(commands.begin(), commands.end(), [&description](auto& command) { return command.description == description; }) - commands.begin());
+    };
+
+    std::vector<std::string> descriptions;
+    for(auto& command : database.getCommands())
+    {
+        descriptions.push_back(command.description);
+    }
+    auto filteredCommands = filterCommands(database);
+    MockExecutor executor(database.getCommands());
+    size_t completed;
+    {
+        SilenceStdout silence;
+        completed = runCommands(filteredCommands, database, 1, false, executor);
+    }
+    CHECK(completed == 6);
+
+    auto& records = executor.records();
+    auto recordOf = [&](const std::string& description)
+    {
+        return records[std::find(descriptions.begin(), descriptions.end(), description) - descriptions.begin()];
+    };
+    CHECK(recordOf("Compiling a.cppm").end <= recordOf("Compiling b.cppm").start);
+    CHECK(recordOf("Compiling b.cppm").end <= recordOf("Compiling main.cpp").start);
+
+    // Imports are passed on, as the compiler needs every module an import depends on
+    auto map = readFile(root / "main.cpp.modmap");
+    CHECK(map.find("\"-fmodule-file=b=" + str::replaceAll((root / "b.cppm.pcm").string(), "\\", "\\\\") + "\"\n") != std::string::npos);
+    CHECK(map.find("\"-fmodule-file=a=") != std::string::npos);
+
+    // The imports found become graph edges, which are kept in the database
+    auto main = findCommand("Compiling main.cpp");
+    CHECK(database.getDiscoveredDependencies()[main].inputs == std::vector<std::filesystem::path>{root / "b.cppm.pcm"});
+    auto mainDependencies = database.getCommandDependencies()[main];
+    CHECK(std::find(mainDependencies.begin(), mainDependencies.end(), findCommand("Compiling b.cppm")) != mainDependencies.end());
+
+    database.save((root / ".build_db").string());
+    Database loaded;
+    REQUIRE(loaded.load((root / ".build_db").string()));
+    CHECK(loaded.getDiscoveredDependencies() == database.getDiscoveredDependencies());
+    CHECK(loaded.getCommandDependencies() == database.getCommandDependencies());
+
+    // Changing a module rebuilds what imports it, and nothing else
+    CHECK(filterCommands(database).empty());
+    std::ofstream((root / "b.cppm").string()) << "changed\n";
+    std::vector<std::string> dirty;
+    for(auto& command : filterCommands(database))
+    {
+        dirty.push_back(database.getCommands()[command.command].description);
+    }
+    std::sort(dirty.begin(), dirty.end());
+    CHECK(dirty == std::vector<std::string>{"Compiling b.cppm", "Compiling main.cpp", "Scanning b.cppm"});
+
+    std::filesystem::remove_all(root);
+}
+
+TEST_CASE( "Dyndep manifests" ) {
+    auto root = std::filesystem::absolute("dyndep_test");
+    std::filesystem::create_directories(root / "gen");
+    for(auto file : {"c1.cpp", "c2.cpp", "gen/a.pb.h", "gen/extra.h", "c1.o", "c2.o"})
+    {
+        std::ofstream((root / file).string()) << file << "\n";
+    }
+
+    // The scan finds that c1.o needs a header another command generates
+    std::ofstream((root / "gen/scan.dd").string()) << "# Written by the scan\noutput gen/extra.h\ncommand c1.o\ninput gen/a.pb.h\n";
+
+    std::vector<CommandEntry> commands(4);
+    commands[0].description = "Scan";
+    commands[0].outputs = {root / "gen/scan.dd"};
+    commands[0].dyndepFile = root / "gen/scan.dd";
+    commands[1].description = "Compile c1";
+    commands[1].inputs = {root / "c1.cpp"};
+    commands[1].outputs = {root / "c1.o"};
+    commands[2].description = "Generate";
+    commands[2].outputs = {root / "gen/a.pb.h"};
+    commands[3].description = "Compile c2";
+    commands[3].inputs = {root / "c2.cpp"};
+    commands[3].outputs = {root / "c2.o"};
+    for(auto& command : commands)
+    {
+        command.command = "noop " + command.description;
+        command.workingDirectory = root;
+    }
+
+    Database database;
+    database.setCommands(std::move(commands));
+    auto findCommand = [&database](const std::string& description)
+    {
+        auto& commands = database.getCommands();
+        return (CommandId)(std::find_if(commands.begin(), commands.end(), [&description](auto& command) { return command.description == description; }) - commands.begin());
+    };
+    auto scan = findCommand("Scan");
+    auto compile = findCommand("Compile c1");
+    auto generate = findCommand("Generate");
+
+    auto filteredCommands = filterCommands(database);
+    MockExecutor executor(database.getCommands());
+    {
+        SilenceStdout silence;
+        CHECK(runCommands(filteredCommands, database, 1, false, executor) == 4);
+    }
+    // One at a time, the compile would have run before the generator without the manifest
+    CHECK(compile < generate);
+    CHECK(executor.records()[generate].end <= executor.records()[compile].start);
+
+    // Ids change as the edges are added to the graph
+    scan = findCommand("Scan");
+    compile = findCommand("Compile c1");
+    generate = findCommand("Generate");
+    auto& found = database.getDiscoveredDependencies()[scan];
+    CHECK(found.outputs == std::vector<std::filesystem::path>{root / "gen/extra.h"});
+    CHECK(found.dependentInputs == std::vector<std::pair<std::filesystem::path, std::filesystem::path>>{{root / "c1.o", root / "gen/a.pb.h"}});
+    auto compileDependencies = database.getCommandDependencies()[compile];
+    CHECK(std::vector<CommandId>(compileDependencies.begin(), compileDependencies.end()) == std::vector<CommandId>{generate});
+
+    database.save((root / ".build_db").string());
+    Database loaded;
+    REQUIRE(loaded.load((root / ".build_db").string()));
+    CHECK(loaded.getDiscoveredDependencies() == database.getDiscoveredDependencies());
+    CHECK(loaded.getCommandDependencies() == database.getCommandDependencies());
+
+    // Outputs from the manifest are checked like declared ones
+    CHECK(filterCommands(database).empty());
+    std::filesystem::remove(root / "gen/extra.h");
+    auto dirty = filterCommands(database);
+    REQUIRE(dirty.size() == 1);
+    CHECK(dirty[0].command == scan);
+
+    CHECK(!parseDyndepManifest("outputs gen/a.h\n", [](auto) {}, [](auto, auto) {}));
+    CHECK(!parseDyndepManifest("input gen/a.h\n", [](auto) {}, [](auto, auto) {}));
+
+    std::filesystem::remove_all(root);
+}
+
+TEST_CASE( "Database round trip" ) {
+    // Long shared flags, so command lines get split into a shared prefix and a suffix
+    std::string flags = "c++";
+    for(int i = 0; i < 20; ++i)
+    {
+        flags += " -DDEFINE_" + std::to_string(i);
+    }
+
+    std::vector<CommandEntry> commands(50);
+    for(size_t i = 0; i < commands.size(); ++i)
+    {
+        auto index = std::to_string(i);
+        commands[i].command = (i % 10 == 0 ? "link" : flags) + " -c database_test/" + index + ".cpp -o database_test/" + index + ".o";
+        commands[i].description = "Command " + index;
+        commands[i].workingDirectory = "database_test";
+        commands[i].inputs.push_back("database_test/" + index + ".cpp");
+        commands[i].inputs.push_back("database_test/shared.h");
+        commands[i].outputs.push_back("database_test/" + index + ".o");
+        if(i % 2 == 0)
+        {
+            commands[i].depFile = "database_test/" + index + ".d";
+            commands[i].depFile.format = i % 4 == 0 ? DepFile::MSVC : DepFile::GCC;
+            commands[i].rspFile = "database_test/" + index + ".rsp";
+            commands[i].rspContents = "-O2";
+        }
+    }
+
+    Database database;
+    database.setCommands(commands);
+    std::filesystem::create_directories("database_test");
+    database.save("database_test/.build_db");
+
+    Database loaded;
+    REQUIRE(loaded.load("database_test/.build_db"));
+    auto& saved = database.getCommands();
+    auto& restored = loaded.getCommands();
+    REQUIRE(restored.size() == saved.size());
+    for(size_t i = 0; i < saved.size(); ++i)
+    {
+        CHECK(restored[i] == saved[i]);
+        CHECK(restored[i].description == saved[i].description);
+        CHECK(restored[i].depFile.format == saved[i].depFile.format);
+        CHECK(restored[i].rspFile == saved[i].rspFile);
+        CHECK(restored[i].rspContents == saved[i].rspContents);
+    }
+    CHECK(loaded.getCommandDependencies() == database.getCommandDependencies());
+
+    std::filesystem::remove_all("database_test");
+}
+
+TEST_CASE( "Directory change detection" ) {
+    auto root = std::filesystem::absolute("change_test");
+    std::filesystem::create_directories(root / "include");
+    std::ofstream(root / "include" / "a.h") << "#pragma once\n";
+    std::ofstream(root / "a.o");
+
+    CommandEntry command;
+    command.command = "noop";
+    command.inputs.push_back(root / "include" / "a.h");
+    command.outputs.push_back(root / "a.o");
+    Database database;
+    database.setCommands({command});
+
+    ChangeDetection directoryTimes;
+    directoryTimes.directoryTimes = true;
+    CHECK(filterCommands(database).size() == 1);
+    database.getCommandSignatures()[0] = computeCommandSignature(database.getCommands()[0]);
+    CHECK(filterCommands(database, {}, {}, directoryTimes).empty());
+
+    auto touch = [](const std::filesystem::path& path)
+    {
+        std::filesystem::last_write_time(path, std::filesystem::last_write_time(path) + std::chrono::seconds(10));
+    };
+
+    SECTION("edits in place are only seen by full checks") {
+        touch(root / "include" / "a.h");
+        CHECK(filterCommands(database, {}, {}, directoryTimes).empty());
+        CHECK(filterCommands(database).size() == 1);
+    }
+
+    SECTION("files in modified directories are checked") {
+        touch(root / "include" / "a.h");
+        touch(root / "include");
+        CHECK(filterCommands(database, {}, {}, directoryTimes).size() == 1);
+    }
+
+    std::filesystem::remove_all(root);
+}
+
 namespace Catch {
     template<>
     struct StringMaker<uuid::uuid> {
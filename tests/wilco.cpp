@@ -7,4 +7,11 @@ void configure(Environment& env)
     tests.includePaths += "../wilco";
     tests.files += "tests.cpp";
     tests.files += env.listFiles("../wilco/src");
+
+    Project& benchmarks = env.createProject("Benchmarks", Executable);
+    benchmarks.features += { feature::Cpp17, feature::Exceptions, feature::Optimize };
+    benchmarks.includePaths += "../wilco";
+    benchmarks.defines += "WILCO_COUNT_ALLOCATIONS";
+    benchmarks.files += "benchmarks.cpp";
+    benchmarks.files += env.listFiles("../wilco/src");
 }
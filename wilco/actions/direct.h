@@ -42,6 +42,9 @@ public:
 
     cli::BoolArgument verbose{arguments, "verbose", "Display full command line of commands as they are executed."};
     cli::BoolArgument displayTime{arguments, "display-time", "Display total build time after finishing a build."};
+    cli::BoolArgument trustDirectoryTimes{arguments, "trust-directory-times", "Only check input files in directories modified since the last build. Misses files edited in place."};
+    cli::BoolArgument gitStatus{arguments, "git-status", "Only check input files that git reports as changed since the last build, and files git doesn't track."};
+    cli::PathArgument trace{arguments, "trace", "Write a Chrome trace event file (chrome://tracing, Perfetto) of the build to the given path."};
     TargetArgument targets{arguments};
 
     DirectBuilder();
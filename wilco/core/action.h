@@ -10,6 +10,7 @@
 extern cli::PathArgument wilcoFilesPath;
 extern cli::PathArgument targetPath;
 extern cli::BoolArgument noRebuild;
+extern cli::BoolArgument profilePhases;
 
 struct Action;
 
@@ -5,6 +5,7 @@
 #include <optional>
 #include <set>
 #include <string>
+#include <type_traits>
 #include <vector>
 
 #include "core/arch.h"
@@ -18,6 +19,11 @@
 struct Environment;
 struct Project;
 
+namespace hash
+{
+    struct Md5;
+}
+
 enum ProjectType
 {
     Executable,
@@ -164,6 +170,10 @@ struct BuildSettings
 		return extensionEntry->extensionData;
 	}
 
+    /** Adds the settings to a hash, to tell if they've changed since another time they were hashed.
+        Returns false if an extension can't be hashed, for lack of a digest(hash::Md5&) const member. */
+    bool digest(hash::Md5& hasher) const;
+
 	/** Checks if an extension of type ExtensionType is present in this ProjectSettings. */
     template<typename ExtensionType>
     bool hasExt() const
@@ -182,8 +192,15 @@ private:
         virtual ~ExtensionEntry() = default;
         virtual void import(const ExtensionEntry& other) = 0;
         virtual std::unique_ptr<ExtensionEntry> clone() const = 0;
+        virtual bool digest(hash::Md5& hasher) const = 0;
     };
 
+    template<typename ExtensionType, typename = void>
+    struct HasDigest : std::false_type {};
+
+    template<typename ExtensionType>
+    struct HasDigest<ExtensionType, std::void_t<decltype(std::declval<const ExtensionType&>().digest(std::declval<hash::Md5&>()))>> : std::true_type {};
+
     template<typename ExtensionType>
     struct ExtensionEntryImpl : public ExtensionEntry
     {
@@ -199,6 +216,19 @@ private:
             return std::unique_ptr<ExtensionEntry>(newExtension);
         }
 
+        bool digest(hash::Md5& hasher) const override
+        {
+            if constexpr(HasDigest<ExtensionType>::value)
+            {
+                extensionData.digest(hasher);
+                return true;
+            }
+            else
+            {
+                return false;
+            }
+        }
+
         ExtensionType extensionData;
     };
 
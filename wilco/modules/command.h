@@ -32,6 +32,30 @@ struct DepFile
     }
 };
 
+// Where a command compiling C++ modules learns which modules its source provides and
+// imports. That's only known once another command has scanned the source, writing path.
+struct ModuleScan
+{
+    // P1689 scan result
+    std::filesystem::path path;
+    // Where the command writes the module its source provides, if it's a module interface
+    std::filesystem::path moduleOutput;
+    // Written before the command runs, telling the compiler where imported modules are
+    std::filesystem::path mapFile;
+    enum Format
+    {
+        // -fmodule-file= flags in a response file
+        Clang,
+        // gcc -fmodule-mapper file
+        GCC
+    } format = Clang;
+
+    operator bool() const
+    {
+        return !path.empty();
+    }
+};
+
 struct CommandEntry
 {
     std::string command;
@@ -42,6 +66,10 @@ struct CommandEntry
     std::string description;
     std::filesystem::path rspFile;
     std::string rspContents;
+    ModuleScan moduleScan;
+    // Manifest the command writes listing outputs it has besides the declared ones, and
+    // inputs of other commands. See parseDyndepManifest for the format.
+    std::filesystem::path dyndepFile;
 
     bool operator ==(const CommandEntry& other) const
     {
@@ -49,7 +77,9 @@ struct CommandEntry
                outputs == other.outputs &&
                inputs == other.inputs &&
                workingDirectory == other.workingDirectory &&
-               depFile.path == other.depFile.path;
+               depFile.path == other.depFile.path &&
+               moduleScan.path == other.moduleScan.path &&
+               dyndepFile == other.dyndepFile;
     }
 };
 
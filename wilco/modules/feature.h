@@ -40,6 +40,37 @@ inline Feature Optimize{"Optimize"};
  * Use compiler specific flags for more detailed control.
 */
 inline Feature FastMath{"FastMath"};
+/** Put debug info in a file next to each object rather than in the object, so linking doesn't process it.
+ * Corresponds to "-g -gsplit-dwarf" on gcc/clang, and "--gdb-index" when linking with lld or mold.
+ * The .dwo files are outputs of the compile commands. Ignored on macOS and msvc/cl.
+*/
+inline Feature SplitDebugInfo{"SplitDebugInfo"};
+/** Leave functions and data nothing refers to out of linked binaries.
+ * Corresponds to "-ffunction-sections -fdata-sections" and "--gc-sections" ("-dead_strip" on macOS)
+ * on gcc/clang, and "/Gy" and "/OPT:REF" on msvc/cl.
+*/
+inline Feature RemoveUnusedCode{"RemoveUnusedCode"};
+/** Merge functions with identical code when linking.
+ * Corresponds to "-ffunction-sections" and "--icf=all" on gcc/clang, which only applies when linking
+ * with lld or mold, and "/Gy" and "/OPT:ICF" on msvc/cl.
+*/
+inline Feature IdenticalCodeFolding{"IdenticalCodeFolding"};
+/** Optimize across translation units when linking.
+ * Corresponds to "-flto" on gcc/clang. Code generation threads per link are set with --lto-jobs:
+ * clang links with "-flto-jobs=N", or its own default without it, and gcc links with "-flto=N",
+ * or "-flto=auto" without it. These threads don't take wilco's job slots, and wilco provides
+ * no jobserver for them to share.
+*/
+inline Feature LTO{"LTO"};
+/** Optimize across translation units when linking, in parallel and incrementally.
+ * Corresponds to "-flto=thin" on clang, which keeps a cache of generated code between links,
+ * and "-flto" on gcc. Threads per link are set with --lto-jobs, as for LTO.
+*/
+inline Feature ThinLTO{"ThinLTO"};
+/** Link with lld. Corresponds to "-fuse-ld=lld" on gcc/clang. */
+inline Feature UseLld{"UseLld"};
+/** Link with mold. Corresponds to "-fuse-ld=mold" on gcc/clang. */
+inline Feature UseMold{"UseMold"};
 
 namespace windows
 {
@@ -23,6 +23,8 @@ namespace lang
 inline Language Auto{"Auto"};
 inline Language C{"C"};
 inline Language Cpp{ "C++" };
+// C++ module interface unit
+inline Language CppModule{ "C++ module" };
 inline Language Rc{"Rc"};
 inline Language ObjectiveC{"Objective-C"};
 inline Language ObjectiveCpp{"Objective-C++"};
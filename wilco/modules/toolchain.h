@@ -7,6 +7,7 @@
 #include "core/project.h"
 #include "core/property.h"
 #include "modules/language.h"
+#include "util/hash.h"
 
 struct ToolchainProvider;
 
@@ -16,11 +17,20 @@ struct ToolchainOutputs
 {
 	ListPropertyValue<std::filesystem::path> objectFiles;
 	ListPropertyValue<std::filesystem::path> libraryFiles;
+	// Files the commands were made from, which make the configuration run again when changed
+	ListPropertyValue<std::filesystem::path> configurationDependencies;
 
 	virtual void import(const ToolchainOutputs& other)
 	{
 		// These properties are used internally by toolchains and never imported
 	}
+
+	virtual void digest(hash::Md5& hasher) const
+	{
+		hash::digestList(hasher, objectFiles);
+		hash::digestList(hasher, libraryFiles);
+		hash::digestList(hasher, configurationDependencies);
+	}
 };
 } // namespace extensions::internal
 
@@ -57,4 +67,13 @@ struct ToolchainProvider
     }
 
 	virtual void process(Project& project, const std::filesystem::path& workingDir, const std::filesystem::path& dataDir) const = 0;
+
+	/** Adds anything process() reads for the project besides its own settings to hasher, e.g. compiler
+	    paths and the toolchain outputs of its dependencies. Returns false if the commands can't be told to
+	    be the same from that, e.g. when process() reads files, in which case the project is processed
+	    every time it's configured. */
+	virtual bool digest(const Project& project, hash::Md5& hasher) const
+	{
+		return false;
+	}
 };
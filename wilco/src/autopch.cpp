@@ -0,0 +1,294 @@
+#include "autopch.h"
+#include "modules/language.h"
+#include "util/string.h"
+#include "fileutil.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <sstream>
+#include <unordered_set>
+#include <vector>
+
+namespace
+{
+    const std::string MARKER = "// Precompiled header picked by wilco from what the project's sources include. Edits are overwritten.";
+
+    struct Header
+    {
+        autopch::Settings settings;
+        // Sorted
+        std::vector<std::string> includes;
+    };
+
+    bool isGeneratedHeader(const std::filesystem::path& path)
+    {
+        auto directory = path.parent_path();
+        return path.extension() == ".h" && directory.filename() == "auto" && directory.parent_path().filename() == "pch";
+    }
+
+    // The first line marks the header as generated and the second holds its settings,
+    // so everything needed to update it is in the header itself.
+    bool readHeader(const std::filesystem::path& path, Header& header)
+    {
+        std::error_code ec;
+        if(!std::filesystem::exists(path, ec))
+        {
+            return false;
+        }
+
+        std::istringstream stream(readFile(path));
+        std::string line;
+        if(!std::getline(stream, line) || line != MARKER || !std::getline(stream, line))
+        {
+            return false;
+        }
+
+        auto rootStart = line.find(" root=");
+        if(rootStart == std::string::npos)
+        {
+            return false;
+        }
+        header.settings.root = line.substr(rootStart + 6);
+        std::istringstream values(line.substr(0, rootStart));
+        std::string token;
+        while(values >> token)
+        {
+            auto separator = token.find('=');
+            if(separator == std::string::npos)
+            {
+                continue;
+            }
+            std::istringstream value(token.substr(separator + 1));
+            auto key = token.substr(0, separator);
+            if(key == "minShare")
+            {
+                value >> header.settings.minShare;
+            }
+            else if(key == "maxHeaders")
+            {
+                value >> header.settings.maxHeaders;
+            }
+            else if(key == "projectHeaders")
+            {
+                value >> header.settings.projectHeaders;
+            }
+        }
+
+        while(std::getline(stream, line))
+        {
+            if(str::startsWith(line, "#include \"") && line.size() > 11 && line.back() == '"')
+            {
+                header.includes.push_back(line.substr(10, line.size() - 11));
+            }
+        }
+        std::sort(header.includes.begin(), header.includes.end());
+        return true;
+    }
+
+    bool writeHeader(const std::filesystem::path& path, const Header& header)
+    {
+        std::ostringstream stream;
+        stream << MARKER << "\n";
+        stream << "// minShare=" << header.settings.minShare
+               << " maxHeaders=" << header.settings.maxHeaders
+               << " projectHeaders=" << header.settings.projectHeaders
+               << " root=" << header.settings.root.generic_string() << "\n";
+        for(auto& include : header.includes)
+        {
+            stream << "#include \"" << include << "\"\n";
+        }
+        return writeFile(path, stream.str());
+    }
+
+    struct Candidate
+    {
+        std::string path;
+        double score;
+    };
+
+    // Ranks the headers included by the sources built with a header's PCH. counts has the
+    // number of those sources including each file in the database, out of sampled.
+    std::vector<std::string> pickHeaders(const Header& header, const std::vector<std::filesystem::path>& filePaths, const std::vector<uint32_t>& counts, size_t sampled)
+    {
+        auto& settings = header.settings;
+        auto root = settings.root.generic_string() + "/";
+        std::unordered_set<std::string> current(header.includes.begin(), header.includes.end());
+
+        // Compilers differ in whether headers that came through a PCH are listed as
+        // dependencies. If none of the picked ones are, there's nothing telling whether
+        // they are still used, so they are kept.
+        bool observed = false;
+        for(size_t file = 0; file < filePaths.size() && !observed; ++file)
+        {
+            observed = counts[file] > 0 && current.find(filePaths[file].generic_string()) != current.end();
+        }
+
+        auto getScore = [](const std::string& path, size_t count)
+        {
+            // File size stands in for the cost of parsing it
+            std::error_code ec;
+            auto size = std::filesystem::file_size(path, ec);
+            return (double)count * (double)(ec ? 1 : std::max((uintmax_t)1, size));
+        };
+
+        double addThreshold = settings.minShare * sampled;
+        double keepThreshold = addThreshold * 0.5;
+        std::vector<Candidate> candidates;
+        for(size_t file = 0; file < filePaths.size(); ++file)
+        {
+            if(counts[file] == 0)
+            {
+                continue;
+            }
+            auto& path = filePaths[file];
+            auto pathStr = path.generic_string();
+            bool picked = current.find(pathStr) != current.end();
+            if(counts[file] < (picked ? keepThreshold : addThreshold))
+            {
+                continue;
+            }
+            if(Language::getByPath(path) != lang::None || isGeneratedHeader(path) || (!settings.projectHeaders && str::startsWith(pathStr, root)))
+            {
+                continue;
+            }
+            candidates.push_back({pathStr, getScore(pathStr, counts[file])});
+            current.erase(pathStr);
+        }
+        if(!observed)
+        {
+            for(auto& path : current)
+            {
+                std::error_code ec;
+                if(std::filesystem::exists(path, ec))
+                {
+                    candidates.push_back({path, getScore(path, sampled)});
+                }
+            }
+        }
+
+        std::sort(candidates.begin(), candidates.end(), [](const Candidate& a, const Candidate& b)
+        {
+            return a.score != b.score ? a.score > b.score : a.path < b.path;
+        });
+        if(candidates.size() > settings.maxHeaders)
+        {
+            candidates.resize(settings.maxHeaders);
+        }
+
+        std::vector<std::string> result;
+        result.reserve(candidates.size());
+        for(auto& candidate : candidates)
+        {
+            result.push_back(std::move(candidate.path));
+        }
+        std::sort(result.begin(), result.end());
+        return result;
+    }
+}
+
+namespace autopch
+{
+
+std::filesystem::path headerPath(const std::filesystem::path& dataDir, const std::string& projectName)
+{
+    return dataDir / std::filesystem::path("pch") / "auto" / (projectName + ".h");
+}
+
+void configureHeader(const std::filesystem::path& path, const Settings& settings)
+{
+    Header header;
+    readHeader(path, header);
+    header.settings = settings;
+    writeHeader(path, header);
+}
+
+size_t update(Database& database)
+{
+    trace::Scope traceScope("Update automatic PCHs");
+
+    static constexpr uint32_t NONE = UINT32_MAX;
+    auto& commands = database.getCommands();
+
+    // Commands building the PCH of each generated header, which is their only input
+    std::vector<std::filesystem::path> headers;
+    std::vector<uint32_t> headerOf(commands.size(), NONE);
+    for(size_t command = 0; command < commands.size(); ++command)
+    {
+        auto& inputs = commands[command].inputs;
+        if(inputs.size() != 1 || !isGeneratedHeader(inputs.front()))
+        {
+            continue;
+        }
+        auto it = std::find(headers.begin(), headers.end(), inputs.front());
+        headerOf[command] = (uint32_t)(it - headers.begin());
+        if(it == headers.end())
+        {
+            headers.push_back(inputs.front());
+        }
+    }
+    if(headers.empty())
+    {
+        return 0;
+    }
+
+    // Commands built with each PCH, of which only the ones that have been built have
+    // their includes recorded
+    auto& dependencies = database.getCommandDependencies();
+    auto& signatures = database.getCommandSignatures();
+    std::vector<uint32_t> sampledHeaderOf(commands.size(), NONE);
+    std::vector<size_t> users(headers.size());
+    std::vector<size_t> sampled(headers.size());
+    for(size_t command = 0; command < commands.size(); ++command)
+    {
+        for(auto dependency : dependencies[command])
+        {
+            if(headerOf[dependency] == NONE)
+            {
+                continue;
+            }
+            auto header = headerOf[dependency];
+            ++users[header];
+            if(signatures[command] != EMPTY_SIGNATURE)
+            {
+                ++sampled[header];
+                sampledHeaderOf[command] = header;
+            }
+            break;
+        }
+    }
+
+    auto& filePaths = database.getFilePaths();
+    auto& fileDependents = database.getFileDependents();
+    std::vector<std::vector<uint32_t>> counts(headers.size(), std::vector<uint32_t>(filePaths.size()));
+    for(size_t file = 0; file < filePaths.size(); ++file)
+    {
+        for(auto command : fileDependents[file])
+        {
+            if(sampledHeaderOf[command] != NONE)
+            {
+                ++counts[sampledHeaderOf[command]][file];
+            }
+        }
+    }
+
+    size_t rewritten = 0;
+    for(size_t index = 0; index < headers.size(); ++index)
+    {
+        // Until most sources have been built, what they include says little about the rest
+        Header header;
+        if(sampled[index] == 0 || sampled[index] * 2 < users[index] || !readHeader(headers[index], header))
+        {
+            continue;
+        }
+
+        auto includes = pickHeaders(header, filePaths, counts[index], sampled[index]);
+        if(includes != header.includes)
+        {
+            header.includes = std::move(includes);
+            rewritten += writeHeader(headers[index], header) ? 1 : 0;
+        }
+    }
+    return rewritten;
+}
+
+}
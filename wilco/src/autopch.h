@@ -0,0 +1,35 @@
+#pragma once
+
+#include <filesystem>
+#include <string>
+
+#include "database.h"
+
+// Precompiled headers picked from what a project's sources actually include. Each project
+// gets a generated header including its most commonly included headers, which the toolchain
+// builds and uses as the project's PCH. The selection is kept up to date from the
+// dependencies recorded in the build database, and the header is only rewritten when the
+// selection changes, since that rebuilds everything using it.
+namespace autopch
+{
+    struct Settings
+    {
+        // Share of the sources using the PCH that must include a header for it to be picked.
+        // Headers already picked stay until their share drops below half of this.
+        double minShare = 0.5;
+        size_t maxHeaders = 64;
+        // Headers under root are left out unless set, as editing them rebuilds the PCH
+        // and everything using it.
+        bool projectHeaders = false;
+        std::filesystem::path root;
+    };
+
+    std::filesystem::path headerPath(const std::filesystem::path& dataDir, const std::string& projectName);
+
+    // Creates the header if needed and updates its settings, keeping the headers already picked.
+    void configureHeader(const std::filesystem::path& path, const Settings& settings);
+
+    // Re-picks the headers of every generated header the commands in database use, from what
+    // the commands built with its PCH included. Returns the number of headers rewritten.
+    size_t update(Database& database);
+}
@@ -5,14 +5,20 @@
 #include "actions/configure.h"
 #include "fileutil.h"
 #include "commandprocessor.h"
+#include "projectcache.h"
+#include "threadpool.h"
+#include "trace.h"
+#include "util/hash.h"
 #include "util/string.h"
 #include <algorithm>
 #include <iostream>
 #include <memory>
+#include <optional>
 #include <sstream>
 #include <fstream>
 #include <stdexcept>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 #define DEBUG_LOG 0
@@ -46,6 +52,7 @@ void BuildConfigurator::collectCommands(Environment& env, std::vector<CommandEnt
 		throw std::runtime_error("Command project '" + project.name + "' has no commands.");
 	}
 
+	const size_t firstCommand = collectedCommands.size();
 	collectedCommands.reserve(collectedCommands.size() + project.commands.size() + 1);
 	for (auto& command : project.commands)
 	{
@@ -68,8 +75,9 @@ void BuildConfigurator::collectCommands(Environment& env, std::vector<CommandEnt
 	CommandEntry phonyProjectCommand;
 	std::set<std::filesystem::path> inputs;
 	std::set<std::filesystem::path> outputs;
-	for (auto& command : collectedCommands)
+	for (size_t i = firstCommand; i < collectedCommands.size(); ++i)
 	{
+		auto& command = collectedCommands[i];
 		inputs.insert(command.inputs.begin(), command.inputs.end());
 		outputs.insert(command.outputs.begin(), command.outputs.end());
 	}
@@ -134,9 +142,72 @@ static void generateCompileCommandsJson(std::ostream& stream, const Database& da
     stream << "\n]";
 }
 
+// Anything about the configuration binary may change how commands are made from settings
+static Signature getProjectCacheKey()
+{
+    hash::Md5 hasher;
+    auto binary = process::findCurrentModulePath();
+    std::error_code ec;
+    auto time = std::filesystem::last_write_time(binary, ec);
+    hash::digestValue(hasher, binary);
+    hasher.digest(reinterpret_cast<const char*>(&time), sizeof(time));
+    return hasher.finalize();
+}
+
+void BuildConfigurator::addToolchainConfigurationDependencies(Environment& env, const Project& project)
+{
+    auto add = [&env](const extensions::internal::ToolchainOutputs& outputs)
+    {
+        for(auto& path : outputs.configurationDependencies)
+        {
+            env.addConfigurationDependency(path);
+        }
+    };
+
+    if(project.hasExt<extensions::internal::ToolchainOutputs>())
+    {
+        add(project.ext<extensions::internal::ToolchainOutputs>());
+    }
+    for(auto& [arch, settings] : project.archSettings)
+    {
+        if(settings.hasExt<extensions::internal::ToolchainOutputs>())
+        {
+            add(settings.ext<extensions::internal::ToolchainOutputs>());
+        }
+    }
+}
+
+std::vector<std::vector<size_t>> BuildConfigurator::getProjectWaves(const std::vector<std::unique_ptr<Project>>& projects)
+{
+    std::unordered_map<const Project*, size_t> waveOf;
+    std::vector<std::vector<size_t>> waves;
+    for(size_t i = 0; i < projects.size(); ++i)
+    {
+        size_t wave = 0;
+        for(auto dependency : projects[i]->dependencies)
+        {
+            auto it = waveOf.find(dependency);
+            if(it == waveOf.end())
+            {
+                throw std::runtime_error("Project '" + projects[i]->name + "' comes before its dependency '" + dependency->name + "'.");
+            }
+            wave = std::max(wave, it->second + 1);
+        }
+        waveOf[projects[i].get()] = wave;
+        if(wave >= waves.size())
+        {
+            waves.resize(wave + 1);
+        }
+        waves[wave].push_back(i);
+    }
+    return waves;
+}
+
 BuildConfigurator::BuildConfigurator(cli::Context cliContext, bool useExisting)
     : cliContext(std::move(cliContext))
 {
+    trace::Scope traceScope("Load configuration");
+
     dataPath = *targetPath;
 
     _configDatabasePath = dataPath / ".config_db";
@@ -184,14 +255,65 @@ BuildConfigurator::BuildConfigurator(cli::Context cliContext, bool useExisting)
     if(configDirty)
     {
         std::cout << (hasDatabase ? "Reconfiguring " : "Configuring ") << (*targetPath).string() << "..." << std::endl;
+        trace::Scope traceScope("Configure");
 
         cli::Context configureContext(cliContext.startPath, cliContext.invocation, args);
         Environment env = configureEnvironment(configureContext);
 
+		// Projects whose settings hash the same as last time get the commands they had then
+		const auto projectCachePath = dataPath / ".project_cache";
+		const auto projectCacheKey = getProjectCacheKey();
+		ProjectCache previousProjects;
+		previousProjects.load(projectCachePath, projectCacheKey);
+		ProjectCache projects;
+
+		// Projects only read their dependencies' toolchain outputs, so each wave of projects
+		// whose dependencies are all in earlier waves is processed in parallel. Commands are
+		// kept per project and merged in project order, so the result doesn't depend on timing.
+		std::vector<std::vector<CommandEntry>> projectCommands(env.projects.size());
+		std::vector<std::optional<Signature>> projectSettings(env.projects.size());
+		for (auto& wave : getProjectWaves(env.projects))
+		{
+			parallelFor(wave.size(), 1, [&](size_t begin, size_t end)
+			{
+				for (size_t w = begin; w < end; ++w)
+				{
+					const size_t i = wave[w];
+					auto& project = *env.projects[i];
+					projectSettings[i] = ProjectCache::digestProject(project, dataPath);
+					if (!projectSettings[i] || !previousProjects.restore(project, *projectSettings[i], projectCommands[i]))
+					{
+						collectCommands(env, projectCommands[i], dataPath, project);
+					}
+				}
+			});
+
+			// Later waves only look these up, so make sure reading them won't insert anything
+			for (size_t i : wave)
+			{
+				auto& project = *env.projects[i];
+				project.ext<extensions::internal::ToolchainOutputs>();
+				for (auto& [arch, settings] : project.archSettings)
+				{
+					settings.ext<extensions::internal::ToolchainOutputs>();
+				}
+			}
+		}
+
+		for (size_t i = 0; i < env.projects.size(); ++i)
+		{
+			if (projectSettings[i])
+			{
+				projects.store(*env.projects[i], *projectSettings[i], projectCommands[i]);
+			}
+			addToolchainConfigurationDependencies(env, *env.projects[i]);
+		}
+		projects.save(projectCachePath, projectCacheKey);
+
 		std::vector<CommandEntry> commands;
-		for (auto& project : env.projects)
+		for (auto& list : projectCommands)
 		{
-			collectCommands(env, commands, dataPath, *project);
+			std::move(list.begin(), list.end(), std::back_inserter(commands));
 		}
 		database.setCommands(std::move(commands));
 
@@ -214,6 +336,8 @@ BuildConfigurator::BuildConfigurator(cli::Context cliContext, bool useExisting)
 
 BuildConfigurator::~BuildConfigurator()
 {
+    trace::Scope traceScope("Save configuration");
+
     std::filesystem::current_path(cliContext.startPath);
 
     if(!_databasePath.empty())
@@ -269,9 +393,11 @@ void BuildConfigurator::updateConfigDatabase(std::set<std::filesystem::path> con
     // Recompute all input signatures. If a file has changed _while_ the configuration
     // is running, those changes will not trigger a new run. Maybe there is a better
     // scheme for this.
-    for(auto& input : database.getFileDependencies())
+    auto& filePaths = database.getFilePaths();
+    auto& fileSignatures = database.getFileSignatures();
+    for(size_t i = 0; i < filePaths.size(); ++i)
     {
-        updatePathSignature(input.signaturePair, input.path);
+        updatePathSignature(fileSignatures[i], filePaths[i]);
     }
 }
 
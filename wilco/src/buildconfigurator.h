@@ -6,6 +6,8 @@
 #include <string>
 #include <optional>
 #include <filesystem>
+#include <memory>
+#include <vector>
 
 struct Project;
 
@@ -19,6 +21,11 @@ public:
     static std::optional<std::vector<std::string>> getPreviousConfigDatabaseArguments(const Database& database);
     static void updateConfigDatabase(std::set<std::filesystem::path> configDependencies, Database& database, const std::vector<std::string>& args);
     static Environment configureEnvironment(cli::Context& cliContext);
+    // Adds the files the project's toolchain made its commands from to the configuration's dependencies.
+    static void addToolchainConfigurationDependencies(Environment& env, const Project& project);
+    // Groups indices of projects, which must come after their dependencies, into waves
+    // where every project only depends on projects in earlier waves.
+    static std::vector<std::vector<size_t>> getProjectWaves(const std::vector<std::unique_ptr<Project>>& projects);
 
     cli::Context cliContext;
     Database database;
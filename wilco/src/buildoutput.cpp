@@ -0,0 +1,301 @@
+#include "buildoutput.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+#if _WIN32
+#define NOMINMAX
+#include <windows.h>
+#include <io.h>
+#else
+#include <sys/ioctl.h>
+#include <unistd.h>
+#endif
+
+namespace
+{
+    bool enableStatusLine()
+    {
+#if _WIN32
+        if(!_isatty(_fileno(stdout)))
+        {
+            return false;
+        }
+
+        // The status line relies on VT escape sequences, which have to be enabled explicitly
+        HANDLE console = GetStdHandle(STD_OUTPUT_HANDLE);
+        DWORD mode = 0;
+        if(!GetConsoleMode(console, &mode))
+        {
+            return false;
+        }
+        return SetConsoleMode(console, mode | ENABLE_VIRTUAL_TERMINAL_PROCESSING) != 0;
+#else
+        if(!isatty(STDOUT_FILENO))
+        {
+            return false;
+        }
+
+        auto term = std::getenv("TERM");
+        return !term || std::strcmp(term, "dumb") != 0;
+#endif
+    }
+
+    size_t terminalWidth()
+    {
+#if _WIN32
+        CONSOLE_SCREEN_BUFFER_INFO info;
+        if(GetConsoleScreenBufferInfo(GetStdHandle(STD_OUTPUT_HANDLE), &info))
+        {
+            return info.srWindow.Right - info.srWindow.Left + 1;
+        }
+#else
+        winsize size;
+        if(ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) == 0 && size.ws_col > 0)
+        {
+            return size.ws_col;
+        }
+#endif
+        return 80;
+    }
+
+    std::string formatDuration(std::chrono::steady_clock::duration duration)
+    {
+        auto seconds = std::chrono::duration_cast<std::chrono::seconds>(duration).count();
+        if(seconds < 60)
+        {
+            return std::to_string(seconds) + "s";
+        }
+
+        auto remainder = seconds % 60;
+        return std::to_string(seconds / 60) + "m" + (remainder < 10 ? "0" : "") + std::to_string(remainder) + "s";
+    }
+}
+
+BuildOutput::BuildOutput(size_t totalCommands, size_t maxConcurrentCommands, bool verbose)
+    : _totalCommands(totalCommands)
+    , _maxConcurrentCommands(std::max((size_t)1, maxConcurrentCommands))
+    , _verbose(verbose)
+{
+    _statusLine = enableStatusLine();
+    _thread = std::thread([this]() { printLoop(); });
+}
+
+BuildOutput::~BuildOutput()
+{
+    {
+        std::scoped_lock lock(_mutex);
+        for(auto& entry : _running)
+        {
+            if(!entry.second.partialLine.empty())
+            {
+                appendLine(entry.second, entry.second.partialLine);
+            }
+        }
+        _stopping = true;
+    }
+    _wakeCondition.notify_all();
+    _thread.join();
+}
+
+void BuildOutput::commandStarted(size_t id, const CommandEntry& command)
+{
+    std::scoped_lock lock(_mutex);
+
+    auto& running = _running[id];
+    running.number = ++_started;
+    running.description = command.description;
+    running.startTime = Clock::now();
+    // TODO: Make something better than a hardcoded filter for CL filename echo
+    if(!command.inputs.empty())
+    {
+        running.suppressedLine = command.inputs.front().filename().string();
+    }
+
+    if(!_statusLine || _verbose)
+    {
+        _pending += "[" + std::to_string(running.number) + "/" + std::to_string(_totalCommands) + "] " + command.description + "\n";
+        running.described = true;
+    }
+    if(_verbose)
+    {
+        _pending += command.command + "\n";
+        if(!command.rspFile.empty())
+        {
+            _pending += "rsp:\n" + command.rspContents + "\n";
+        }
+    }
+}
+
+void BuildOutput::commandOutput(size_t id, std::string_view output)
+{
+    std::scoped_lock lock(_mutex);
+
+    auto it = _running.find(id);
+    if(it == _running.end())
+    {
+        return;
+    }
+    auto& command = it->second;
+
+    while(!output.empty())
+    {
+        auto lineEnd = output.find('\n');
+        if(lineEnd == std::string_view::npos)
+        {
+            command.partialLine += output;
+            break;
+        }
+
+        if(command.partialLine.empty())
+        {
+            appendLine(command, output.substr(0, lineEnd));
+        }
+        else
+        {
+            command.partialLine += output.substr(0, lineEnd);
+            appendLine(command, command.partialLine);
+            command.partialLine.clear();
+        }
+        output.remove_prefix(lineEnd + 1);
+    }
+}
+
+void BuildOutput::commandFinished(size_t id, int exitCode)
+{
+    std::scoped_lock lock(_mutex);
+
+    auto it = _running.find(id);
+    if(it == _running.end())
+    {
+        return;
+    }
+    auto& command = it->second;
+
+    if(!command.partialLine.empty())
+    {
+        appendLine(command, command.partialLine);
+    }
+    if(exitCode != 0)
+    {
+        _pending += "[" + std::to_string(command.number) + "] " + command.description + ": command returned " + std::to_string(exitCode) + "\n";
+    }
+
+    ++_finished;
+    _finishedDuration += Clock::now() - command.startTime;
+    _running.erase(it);
+}
+
+void BuildOutput::addCommands(size_t count)
+{
+    std::scoped_lock lock(_mutex);
+    _totalCommands += count;
+}
+
+void BuildOutput::print(std::string_view text)
+{
+    std::scoped_lock lock(_mutex);
+    _pending += text;
+}
+
+void BuildOutput::appendLine(RunningCommand& command, std::string_view line)
+{
+    if(!line.empty() && line.back() == '\r')
+    {
+        line.remove_suffix(1);
+    }
+
+    bool firstLine = !command.anyLines;
+    command.anyLines = true;
+    if(firstLine && line == command.suppressedLine)
+    {
+        return;
+    }
+
+    if(!command.described)
+    {
+        _pending += "[" + std::to_string(command.number) + "] " + command.description + "\n";
+        command.described = true;
+    }
+    _pending += "[" + std::to_string(command.number) + "] ";
+    _pending += line;
+    _pending += "\n";
+}
+
+std::string BuildOutput::formatStatusLine(Clock::time_point now) const
+{
+    std::string status = "[" + std::to_string(_finished) + "/" + std::to_string(_totalCommands) + "] " + std::to_string(_running.size()) + " running";
+
+    if(_finished > 0)
+    {
+        size_t remaining = _totalCommands - _finished;
+        size_t concurrency = std::max((size_t)1, std::min(_maxConcurrentCommands, remaining));
+        auto estimate = _finishedDuration / _finished * remaining / concurrency;
+        status += ", ETA " + formatDuration(estimate);
+    }
+
+    const RunningCommand* slowest = nullptr;
+    for(auto& entry : _running)
+    {
+        if(!slowest || entry.second.startTime < slowest->startTime)
+        {
+            slowest = &entry.second;
+        }
+    }
+    if(slowest)
+    {
+        status += ", slowest " + formatDuration(now - slowest->startTime) + ": " + slowest->description;
+    }
+
+    // Wrapping would break overwriting the line, so make sure it fits
+    size_t width = terminalWidth();
+    if(width > 1 && status.size() >= width)
+    {
+        status.resize(width - 1);
+    }
+
+    return status;
+}
+
+void BuildOutput::printLoop()
+{
+    using namespace std::chrono_literals;
+
+    std::string lastStatus;
+    std::unique_lock lock(_mutex);
+    while(true)
+    {
+        // Waking up at a fixed rate batches output from many commands into fewer writes
+        _wakeCondition.wait_for(lock, 50ms, [this]() { return _stopping; });
+        bool stopping = _stopping;
+
+        std::string text;
+        std::swap(text, _pending);
+        std::string status;
+        if(_statusLine && !stopping)
+        {
+            status = formatStatusLine(Clock::now());
+        }
+        lock.unlock();
+
+        if(_statusLine && (!text.empty() || status != lastStatus || stopping))
+        {
+            text = "\33[2K\r" + text + status;
+            lastStatus = status;
+        }
+
+        if(!text.empty())
+        {
+            std::cout.write(text.data(), text.size());
+            std::cout.flush();
+        }
+
+        lock.lock();
+        if(stopping && _pending.empty())
+        {
+            break;
+        }
+    }
+}
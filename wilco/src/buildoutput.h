@@ -0,0 +1,73 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+
+#include "modules/command.h"
+
+// Collects progress and streamed command output during a build and writes it to
+// stdout from a separate thread, so the scheduler never waits on the terminal.
+// Output is line buffered per command and prefixed with the command's number.
+// When stdout is a terminal, progress is shown as a single status line that is
+// continuously overwritten rather than a line per started command.
+class BuildOutput
+{
+public:
+    BuildOutput(size_t totalCommands, size_t maxConcurrentCommands, bool verbose);
+    ~BuildOutput();
+
+    BuildOutput(const BuildOutput& other) = delete;
+    BuildOutput& operator=(const BuildOutput& other) = delete;
+
+    // id is any caller chosen key identifying the command until it's finished.
+    void commandStarted(size_t id, const CommandEntry& command);
+    // Safe to call from any thread.
+    void commandOutput(size_t id, std::string_view output);
+    void commandFinished(size_t id, int exitCode);
+
+    // Raises the total shown in progress, for builds that find commands to run as they go.
+    void addCommands(size_t count);
+
+    // Prints text as is, outside of any command.
+    void print(std::string_view text);
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    struct RunningCommand
+    {
+        size_t number;
+        std::string description;
+        Clock::time_point startTime;
+        std::string partialLine;
+        // Line to drop if it's the first thing the command prints (cl echoes the input file name)
+        std::string suppressedLine;
+        bool anyLines = false;
+        // Whether "[number] description" has been printed, which the status line doesn't do on start
+        bool described = false;
+    };
+
+    void appendLine(RunningCommand& command, std::string_view line);
+    std::string formatStatusLine(Clock::time_point now) const;
+    void printLoop();
+
+    size_t _totalCommands;
+    const size_t _maxConcurrentCommands;
+    const bool _verbose;
+    bool _statusLine = false;
+
+    std::mutex _mutex;
+    std::condition_variable _wakeCondition;
+    std::string _pending;
+    std::map<size_t, RunningCommand> _running;
+    size_t _started = 0;
+    size_t _finished = 0;
+    Clock::duration _finishedDuration = {};
+    bool _stopping = false;
+    std::thread _thread;
+};
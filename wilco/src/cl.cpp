@@ -12,6 +12,27 @@ ClToolchainProvider::ClToolchainProvider(std::string name, std::string compiler,
 {
 }
 
+bool ClToolchainProvider::digest(const Project& project, hash::Md5& hasher) const
+{
+    hash::digestValue(hasher, compiler);
+    hash::digestValue(hasher, resourceCompiler);
+    hash::digestValue(hasher, linker);
+    hash::digestValue(hasher, archiver);
+    hash::digestList(hasher, sysIncludePaths);
+    hash::digestList(hasher, sysLibPaths);
+
+    for(auto& dependency : project.dependencies)
+    {
+        hash::digestList(hasher, dependency->ext<extensions::internal::ToolchainOutputs>().libraryFiles);
+        for(auto& [arch, settings] : dependency->archSettings)
+        {
+            hash::digestValue(hasher, arch);
+            hash::digestList(hasher, settings.ext<extensions::internal::ToolchainOutputs>().libraryFiles);
+        }
+    }
+    return true;
+}
+
 std::string ClToolchainProvider::getCompiler(Project& project, std::filesystem::path pathOffset, Language language) const 
 {
     if(language == lang::Cpp || language == lang::C)
@@ -60,6 +81,8 @@ std::string ClToolchainProvider::getCommonCompilerFlags(Project& project, std::f
             { feature::WarningsAsErrors, " /WX"},
             { feature::FastMath, " /fp:fast"},
             { feature::Exceptions, " /EHsc"},
+            { feature::RemoveUnusedCode, " /Gy"},
+            { feature::IdenticalCodeFolding, " /Gy"},
             { feature::windows::StaticRuntime, " /MT"},
             { feature::windows::StaticDebugRuntime, " /MTd"},
             { feature::windows::SharedRuntime, " /MD"},
@@ -149,6 +172,8 @@ std::string ClToolchainProvider::getCommonLinkerFlags(Project& project, std::fil
 
         std::map<Feature, std::string> featureMap = {
             { feature::DebugSymbols, " /DEBUG"},
+            { feature::RemoveUnusedCode, " /OPT:REF"},
+            { feature::IdenticalCodeFolding, " /OPT:ICF"},
         };
         for(auto& feature : project.features)
         {
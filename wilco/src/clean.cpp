@@ -59,11 +59,16 @@ void Clean::run(cli::Context cliContext)
     }
 
     std::cout << "Cleaning..." << std::endl;
-    for(auto& command : configurator.database.getCommands())
+    auto& commands = configurator.database.getCommands();
+    auto& discovered = configurator.database.getDiscoveredDependencies();
+    for(size_t index = 0; index < commands.size(); ++index)
     {
-        for(auto& output : command.outputs)
+        for(auto* outputs : {&commands[index].outputs, &discovered[index].outputs})
         {
-            std::filesystem::remove(output);
+            for(auto& output : *outputs)
+            {
+                std::filesystem::remove(output);
+            }
         }
     }
     std::cout << "Done." << std::endl;
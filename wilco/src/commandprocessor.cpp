@@ -3,11 +3,22 @@
 #include "util/hash.h"
 #include "util/string.h"
 #include "util/interrupt.h"
+#include "util/path.h"
 #include "fileutil.h"
+#include "buildoutput.h"
 #include "dependencyparser.h"
+#include "git.h"
+#include "threadpool.h"
+#include "trace.h"
 #include <assert.h>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <numeric>
+#include <optional>
 #include <thread>
 #include <filesystem>
+#include <unordered_set>
 
 #define LOG_DIRTY_REASON 0
 
@@ -103,47 +114,328 @@ bool updatePathSignature(SignaturePair& signaturePair, const std::filesystem::pa
     return true;
 }
 
-void checkInputSignatures(std::vector<Signature>& commandSignatures, std::vector<PendingCommand>& filteredCommands, std::vector<FileDependencies>::iterator begin, std::vector<FileDependencies>::iterator end)
+// Checks the files of a directory. Files in unchangedFiles are known to be unchanged by other means.
+void checkInputSignatures(Database& database, size_t directory, const ChangeDetection& changeDetection, const std::vector<bool>& unchangedFiles)
 {
-    for(auto fileDependency = begin; fileDependency != end; ++fileDependency)
+    auto& commandSignatures = database.getCommandSignatures();
+    auto& paths = database.getFilePaths();
+    auto& signatures = database.getFileSignatures();
+    auto& dependents = database.getFileDependents();
+    auto& directorySignatures = database.getDirectorySignatures();
+
+    // Taken before looking at the files, so anything replaced while they are
+    // checked changes the directory again.
+    auto directorySignature = computeFileSignature(database.getDirectoryPaths()[directory]);
+    bool unchanged = changeDetection.directoryTimes && directorySignature != EMPTY_SIGNATURE && directorySignature == directorySignatures[directory];
+
+    for(auto file : database.getDirectoryFiles()[directory])
     {
-        bool dirty = updatePathSignature(fileDependency->signaturePair, fileDependency->path);
+        // Files without a signature (missing, or never checked) are always looked at
+        if((unchanged || (!unchangedFiles.empty() && unchangedFiles[file])) && signatures[file].first != EMPTY_SIGNATURE)
+        {
+            continue;
+        }
+
+        bool dirty = updatePathSignature(signatures[file], paths[file]);
         if(dirty)
         {
-            for(auto& commandId : fileDependency->dependentCommands)
+            for(auto commandId : dependents[file])
             {
                 commandSignatures[commandId] = {};
             }
         }
     }
+
+    directorySignatures[directory] = directorySignature;
 }
 
-// This currently doesn't actually check the _signatures_ of the outputs, just the existence
-void checkOutputSignatures(std::vector<Signature>& commandSignatures, const std::vector<CommandEntry>& commands, int beginIndex, int endIndex)
+// Checks the outputs and command line of a command whose inputs have been checked. This currently
+// doesn't actually check the _signatures_ of the outputs, just the existence
+void checkCommandSignature(Signature& commandSignature, const CommandEntry& command, const DiscoveredDependencies& discovered)
 {
-    for(int i = beginIndex; i != endIndex; ++i)
+    if(commandSignature == EMPTY_SIGNATURE)
     {
-        if(commandSignatures[i] == EMPTY_SIGNATURE)
-        {
-            continue;
-        }
-        for(auto& output : commands[i].outputs)
+#if LOG_DIRTY_REASON
+        std::cout << "dirty: Signature missing for " << command.description << std::endl;
+#endif
+        return;
+    }
+
+    for(auto* outputs : {&command.outputs, &discovered.outputs})
+    {
+        for(auto& output : *outputs)
         {
             std::error_code ec;
             bool exists = std::filesystem::exists(output, ec);
             if(ec || !exists)
             {
 #if LOG_DIRTY_REASON
-                std::cout << "dirty: Output " << output << " missing for " << commands[i].description << std::endl;
+                std::cout << "dirty: Output " << output << " missing for " << command.description << std::endl;
 #endif
-                commandSignatures[i] = {};
-                break;
+                commandSignature = {};
+                return;
             }
         }
     }
+
+    if(commandSignature != computeCommandSignature(command))
+    {
+#if LOG_DIRTY_REASON
+        std::cout << "dirty: Signature mismatching for " << command.description << std::endl;
+#endif
+        commandSignature = {};
+    }
+}
+
+namespace
+{
+    // Works out which commands are dirty on the thread pool, deciding each command as soon
+    // as its own inputs have been checked and everything it depends on has been decided.
+    // This lets a build start running commands while the rest of the graph is still being
+    // checked. Directories and commands feeding the included commands are checked first.
+    class DirtyCheck
+    {
+    public:
+        // Called from pool threads for every command as it's decided.
+        using DecidedCallback = std::function<void(uint32_t command, bool dirty)>;
+        // Called from a pool thread once all checking is done, whether or not it succeeded.
+        using FinishedCallback = std::function<void()>;
+
+        DirtyCheck(Database& database, const std::vector<bool>& included, ChangeDetection changeDetection)
+            : _database(database)
+            , _changeDetection(changeDetection)
+            , _uncheckedFiles(database.getCommands().size())
+            , _undecided(database.getCommands().size())
+            , _dirty(database.getCommands().size(), false)
+        {
+            if(changeDetection.git)
+            {
+                trace::Scope traceScope("Query git");
+                git::findUnchangedFiles(database.getFilePaths(), database.getChangeDetectionState(), _unchangedFiles);
+            }
+            else
+            {
+                // Files may change and be checked without git noticing, so what it saw
+                // last time can't be relied on later.
+                database.getChangeDetectionState().clear();
+            }
+
+            auto& dependencies = database.getCommandDependencies();
+            std::vector<std::pair<uint32_t, CommandId>> edges;
+            for(uint32_t command = 0; command < dependencies.size(); ++command)
+            {
+                _undecided[command] = (uint32_t)dependencies[command].size() + 1;
+                for(auto dependency : dependencies[command])
+                {
+                    edges.push_back({dependency, command});
+                }
+            }
+            _dependents.assign(dependencies.size(), edges);
+
+            // Counted without atomics first, as there are a lot of these
+            auto& fileDependents = database.getFileDependents();
+            std::vector<uint32_t> fileCounts(_uncheckedFiles.size(), 0);
+            std::vector<bool> feedsIncluded(fileDependents.size(), false);
+            for(size_t file = 0; file < fileDependents.size(); ++file)
+            {
+                for(auto command : fileDependents[file])
+                {
+                    ++fileCounts[command];
+                    if(included[command])
+                    {
+                        feedsIncluded[file] = true;
+                    }
+                }
+            }
+            for(size_t command = 0; command < fileCounts.size(); ++command)
+            {
+                _uncheckedFiles[command] = fileCounts[command];
+            }
+
+            auto& directoryFiles = database.getDirectoryFiles();
+            _directories.resize(directoryFiles.size());
+            std::iota(_directories.begin(), _directories.end(), 0);
+            std::stable_partition(_directories.begin(), _directories.end(), [&](uint32_t directory)
+            {
+                auto files = directoryFiles[directory];
+                return std::any_of(files.begin(), files.end(), [&](auto file) { return feedsIncluded[file]; });
+            });
+
+            // Commands without input files are ready to be checked straight away
+            for(uint32_t command = 0; command < fileCounts.size(); ++command)
+            {
+                if(fileCounts[command] == 0)
+                {
+                    _inputlessCommands.push_back(command);
+                }
+            }
+            std::stable_partition(_inputlessCommands.begin(), _inputlessCommands.end(), [&](uint32_t command) { return included[command]; });
+        }
+
+        // Checks on up to workers pool threads.
+        void start(size_t workers, DecidedCallback decided = {}, FinishedCallback finished = {})
+        {
+            _decided = std::move(decided);
+            _finished = std::move(finished);
+
+            workers = std::max((size_t)1, std::min(workers, _directories.size() + _inputlessCommands.size()));
+            _activeWorkers = workers;
+            for(size_t worker = 0; worker < workers; ++worker)
+            {
+                _group.run([this, worker]()
+                {
+                    trace::Scope traceScope("Check signatures", trace::FIRST_CHECK_THREAD + (uint32_t)worker);
+                    try
+                    {
+                        work();
+                    }
+                    catch(...)
+                    {
+                        finishWorker();
+                        throw;
+                    }
+                    finishWorker();
+                });
+            }
+        }
+
+        // Waits for all checking to finish, rethrowing anything that went wrong.
+        void wait()
+        {
+            _group.wait();
+        }
+
+    private:
+        void work()
+        {
+            auto& dependents = _database.getFileDependents();
+            auto& directoryFiles = _database.getDirectoryFiles();
+            size_t itemCount = _directories.size() + _inputlessCommands.size();
+            // Commands are checked in order, which is a lot kinder to the cache than
+            // the order their last input happens to be found in.
+            std::vector<uint32_t> ready;
+            std::vector<uint32_t> stack;
+            // Items are handed out one at a time and in order, so the ones that matter
+            // most for the build are checked first.
+            for(size_t item = _nextItem++; item < itemCount; item = _nextItem++)
+            {
+                if(item >= _directories.size())
+                {
+                    checkCommand(_inputlessCommands[item - _directories.size()], stack);
+                    continue;
+                }
+
+                auto directory = _directories[item];
+                checkInputSignatures(_database, directory, _changeDetection, _unchangedFiles);
+                for(auto file : directoryFiles[directory])
+                {
+                    for(auto command : dependents[file])
+                    {
+                        if(--_uncheckedFiles[command] == 0)
+                        {
+                            ready.push_back(command);
+                        }
+                    }
+                }
+                std::sort(ready.begin(), ready.end());
+                for(auto command : ready)
+                {
+                    checkCommand(command, stack);
+                }
+                ready.clear();
+            }
+        }
+
+        void checkCommand(uint32_t command, std::vector<uint32_t>& stack)
+        {
+            checkCommandSignature(_database.getCommandSignatures()[command], _database.getCommands()[command], _database.getDiscoveredDependencies()[command]);
+            if(--_undecided[command] == 0)
+            {
+                decide(command, stack);
+            }
+        }
+
+        // Decides a command whose own check and dependencies are done, then any dependents
+        // that were only waiting for it.
+        void decide(uint32_t command, std::vector<uint32_t>& stack)
+        {
+            auto& commandSignatures = _database.getCommandSignatures();
+            auto& dependencies = _database.getCommandDependencies();
+
+            stack.push_back(command);
+            while(!stack.empty())
+            {
+                command = stack.back();
+                stack.pop_back();
+
+                auto& commandSignature = commandSignatures[command];
+                if(commandSignature != EMPTY_SIGNATURE)
+                {
+                    for(auto dependency : dependencies[command])
+                    {
+                        if(_dirty[dependency])
+                        {
+#if LOG_DIRTY_REASON
+                            std::cout << "dirty: Transitive " << _database.getCommands()[command].description << std::endl;
+#endif
+                            commandSignature = {};
+                            break;
+                        }
+                    }
+                }
+                _dirty[command] = commandSignature == EMPTY_SIGNATURE;
+
+                if(_decided)
+                {
+                    _decided(command, _dirty[command]);
+                }
+
+                for(auto dependent : _dependents[command])
+                {
+                    if(--_undecided[dependent] == 0)
+                    {
+                        stack.push_back(dependent);
+                    }
+                }
+            }
+        }
+
+        void finishWorker()
+        {
+            if(--_activeWorkers == 0 && _finished)
+            {
+                _finished();
+            }
+        }
+
+        Database& _database;
+        const ChangeDetection _changeDetection;
+        std::vector<bool> _unchangedFiles;
+        // Directories, then commands without input files, in the order they are checked
+        std::vector<uint32_t> _directories;
+        std::vector<uint32_t> _inputlessCommands;
+        // Input files of each command left to check
+        std::vector<std::atomic<uint32_t>> _uncheckedFiles;
+        // Dependencies of each command left to decide, plus one for the command's own check
+        std::vector<std::atomic<uint32_t>> _undecided;
+        // One byte per command rather than std::vector<bool>, as they are written from different threads
+        std::vector<uint8_t> _dirty;
+        AdjacencyList _dependents;
+        DecidedCallback _decided;
+        FinishedCallback _finished;
+        std::atomic<size_t> _nextItem = 0;
+        std::atomic<size_t> _activeWorkers = 0;
+        TaskGroup _group;
+    };
+}
+
+ProcessExecutor& ProcessExecutor::instance()
+{
+    static ProcessExecutor executor;
+    return executor;
 }
 
-static process::ProcessResult runCommand(const CommandEntry& command)
+process::ProcessResult ProcessExecutor::run(const CommandEntry& command, const process::OutputCallback& outputCallback)
 {
     if(command.command.empty())
     {
@@ -195,7 +487,7 @@ static process::ProcessResult runCommand(const CommandEntry& command)
     std::string cwdString = command.workingDirectory.empty() ? "." : command.workingDirectory.string();
     std::string commandString = "cd \"" + cwdString + "\" && " + command.command + " 2>&1";
 
-    process::ProcessResult result = process::run(commandString);
+    process::ProcessResult result = process::run(commandString, outputCallback);
 
     if(!command.rspFile.empty())
     {
@@ -206,394 +498,865 @@ static process::ProcessResult runCommand(const CommandEntry& command)
     return result;
 }
 
-size_t runCommands(std::vector<PendingCommand>& filteredCommands, Database& database, size_t maxConcurrentCommands, bool verbose)
+namespace
 {
-    const auto& commandDefinitions = database.getCommands();
-    const auto& dependencies = database.getCommandDependencies();
-    auto& commandSignatures = database.getCommandSignatures();
-    auto& depFileSignatures = database.getDepFileSignatures();
-
-    std::unordered_map<std::filesystem::path, SignaturePair, PathHash> newInputSignatures;
+    // Signatures of the files mentioned by changed depfiles, collected from the pool
+    // threads commands finish on.
+    struct DependencySignatures
+    {
+        std::mutex mutex;
+        std::unordered_map<std::filesystem::path, SignaturePair, PathHash> signatures;
+        paths::NormalizationCache pathCache;
+    };
 
-    // Not loving this, but since the dependency map are indices
-    // in the unfiltered commands we need the full list
-    // TODO: Test if a mapping table is faster or not
-    std::vector<bool> commandCompleted;
-    commandCompleted.resize(database.getCommands().size(), true);
-    for(auto& filteredCommands : filteredCommands)
+    // Done on the pool thread a command ran on once it succeeds, so the scheduler only has
+    // to copy the results. Returns true if the command's depfile has changed.
+    bool finishCommand(const CommandEntry& command, const Signature& depFileSignature, DependencySignatures& dependencySignatures, Signature& commandSignature)
     {
-        commandCompleted[filteredCommands.command] = false;
-    }
+        commandSignature = computeCommandSignature(command);
+        if(!command.depFile)
+        {
+            return false;
+        }
 
-    bool rebuildDependencies = false;
+        auto depFileContents = readFile(command.depFile);
+        if(hash::md5(depFileContents) == depFileSignature)
+        {
+            return false;
+        }
 
-    size_t count = 0;
-    size_t completed = 0;
-    size_t firstPending = 0;
-    std::vector<PendingCommand*> runningCommands;
-    bool halt = false;
-    std::mutex doneMutex;
-    std::vector<PendingCommand*> doneCommands;
-    while((!halt && firstPending < filteredCommands.size()) || !runningCommands.empty())
-    {
-        // TODO: Semaphore of some kind instead of semi-spin lock
-        using namespace std::chrono_literals;
-        std::this_thread::sleep_for(10ms);
+        std::vector<const std::filesystem::path*> paths;
+        parseDependencyData(depFileContents, [&paths, &dependencySignatures](std::string_view path){
+            paths.push_back(&dependencySignatures.pathCache.absoluteNormal(path));
+            return false;
+        });
 
+        // Only files no other command has mentioned yet are looked at, outside the lock
         {
-            std::scoped_lock doneLock(doneMutex);
-            for(auto it = doneCommands.begin(); it != doneCommands.end(); )
+            std::scoped_lock lock(dependencySignatures.mutex);
+            paths.erase(std::remove_if(paths.begin(), paths.end(), [&dependencySignatures](auto path)
             {
-                auto command = *it;
-                commandCompleted[command->command] = true;
+                return dependencySignatures.signatures.count(*path) != 0;
+            }), paths.end());
+        }
+        std::vector<SignaturePair> signatures(paths.size());
+        for(size_t i = 0; i < paths.size(); ++i)
+        {
+            updatePathSignature(signatures[i], *paths[i]);
+        }
+        {
+            std::scoped_lock lock(dependencySignatures.mutex);
+            for(size_t i = 0; i < paths.size(); ++i)
+            {
+                dependencySignatures.signatures.emplace(*paths[i], signatures[i]);
+            }
+        }
+        return true;
+    }
+
+    // Reads the dyndep manifest of a command that has run. Relative paths are relative to
+    // the command's working directory.
+    DiscoveredDependencies readDyndepManifest(const CommandEntry& command, paths::NormalizationCache& pathCache)
+    {
+        auto resolve = [&command, &pathCache](std::string_view path) -> const std::filesystem::path&
+        {
+            std::filesystem::path result(path);
+            if(result.is_relative())
+            {
+                result = command.workingDirectory / result;
+            }
+            return pathCache.absoluteNormal(result);
+        };
 
-                auto result = command->result.get();
-                auto output = str::trim(std::string_view(result.output));
+        DiscoveredDependencies result;
+        bool valid = parseDyndepManifest(readFile(command.dyndepFile), [&](std::string_view output)
+        {
+            result.outputs.push_back(resolve(output));
+        }, [&](std::string_view command, std::string_view input)
+        {
+            result.dependentInputs.emplace_back(resolve(command), resolve(input));
+        });
+        if(!valid)
+        {
+            throw std::runtime_error("Malformed dyndep manifest " + command.dyndepFile.string() + ".");
+        }
+        return result;
+    }
 
-                // TODO: Make something better than a hardcoded filter for CL filename echo
-                if(!commandDefinitions[command->command].inputs.empty() && output == commandDefinitions[command->command].inputs.front().filename())
+    // Which commands provide and import which C++ modules, going by the results of the scans
+    // done for commands with a module scan. Read once no scan is left to run in a build.
+    class ModuleGraph
+    {
+    public:
+        explicit ModuleGraph(const std::vector<CommandEntry>& commands)
+            : _commands(commands)
+        {
+            std::unordered_set<std::filesystem::path, PathHash> scanResults;
+            for(auto& command : _commands)
+            {
+                if(command.moduleScan)
                 {
-                    output = {};
+                    scanResults.insert(command.moduleScan.path);
                 }
+            }
+            if(scanResults.empty())
+            {
+                return;
+            }
 
-                if(!output.empty() && !interrupt::isInterrupted())
+            _isScan.resize(_commands.size(), false);
+            for(size_t command = 0; command < _commands.size(); ++command)
+            {
+                for(auto& output : _commands[command].outputs)
                 {
-                    std::cout << "\n" << output;
+                    if(scanResults.count(output) != 0)
+                    {
+                        _isScan[command] = true;
+                        break;
+                    }
                 }
+            }
+        }
+
+        // True if no command uses modules
+        bool empty() const
+        {
+            return _isScan.empty();
+        }
+
+        bool isScan(CommandId command) const
+        {
+            return !_isScan.empty() && _isScan[command];
+        }
+
+        bool isLoaded() const
+        {
+            return _loaded;
+        }
+
+        void load()
+        {
+            trace::Scope traceScope("Read module scans");
 
-                if(interrupt::isInterrupted())
+            _provides.resize(_commands.size());
+            _requires.resize(_commands.size());
+            parallelFor(_commands.size(), 0, [this](size_t begin, size_t end)
+            {
+                for(size_t command = begin; command < end; ++command)
                 {
-                    halt = true;
+                    auto& scan = _commands[command].moduleScan;
+                    std::error_code ec;
+                    if(!scan || !std::filesystem::exists(scan.path, ec))
+                    {
+                        continue;
+                    }
+                    parseModuleDependencies(readFile(scan.path), [this, command](std::string_view name)
+                    {
+                        _provides[command].emplace_back(name);
+                    }, [this, command](std::string_view name)
+                    {
+                        _requires[command].emplace_back(name);
+                    });
                 }
-                else if(result.exitCode != 0)
+            });
+
+            for(CommandId command = 0; command < _commands.size(); ++command)
+            {
+                if(_commands[command].moduleScan.moduleOutput.empty())
                 {
-                    std::cout << "\nCommand returned " + std::to_string(result.exitCode);
-                    halt = true;
+                    continue;
                 }
-                else
+                for(auto& name : _provides[command])
                 {
-                    if(commandDefinitions[command->command].depFile)
-                    {
-                        auto depFileContents = readFile(commandDefinitions[command->command].depFile);
-                        auto depFileSignature = hash::md5(depFileContents);
-                        if(depFileSignature != depFileSignatures[command->command])
-                        {
-                            parseDependencyData(depFileContents, [&newInputSignatures](std::string_view path){
-                                auto absPath = std::filesystem::absolute(path).lexically_normal();
-                                auto it = newInputSignatures.find(absPath);
-                                if(it == newInputSignatures.end())
-                                {
-                                    updatePathSignature(newInputSignatures[absPath], absPath);
-                                }
+                    _providers.emplace(name, command);
+                }
+            }
+            _loaded = true;
+        }
 
-                                return false;
-                            });
-                            rebuildDependencies = true;
-                        }
-                    }
-                    commandSignatures[command->command] = computeCommandSignature(commandDefinitions[command->command]);
-                    ++completed;
+        // Commands providing the modules command imports directly. Imports nothing provides
+        // are left for the compiler to report.
+        std::vector<CommandId> getProviders(CommandId command) const
+        {
+            std::vector<CommandId> result;
+            for(auto& name : _requires[command])
+            {
+                auto it = _providers.find(name);
+                if(it != _providers.end())
+                {
+                    result.push_back(it->second);
                 }
-                it = doneCommands.erase(it);
+            }
+            return result;
+        }
 
-                auto runIt = std::find(runningCommands.begin(), runningCommands.end(), command);
-                assert(runIt != runningCommands.end());
-                if(runIt != runningCommands.end())
+        // What the compiler needs to find the modules command imports, including the ones
+        // they import in turn, in the command's map file format.
+        std::string getMap(CommandId command) const
+        {
+            auto& scan = _commands[command].moduleScan;
+            std::string result;
+            auto addModule = [&](const std::string& name, const std::filesystem::path& path)
+            {
+                if(scan.format == ModuleScan::Format::GCC)
                 {
-                    runningCommands.erase(runIt);
+                    result += name + " " + path.string() + "\n";
                 }
                 else
                 {
-                    throw std::runtime_error("Internal error. (Completed command not found in running list.)");
+                    result += "\"-fmodule-file=" + name + "=" + str::replaceAll(path.string(), "\\", "\\\\") + "\"\n";
+                }
+            };
+
+            // gcc is also told where to put the module the command provides
+            if(scan.format == ModuleScan::Format::GCC && !scan.moduleOutput.empty())
+            {
+                for(auto& name : _provides[command])
+                {
+                    addModule(name, scan.moduleOutput);
                 }
+            }
 
-                std::cout << std::flush;
+            std::unordered_set<std::string> visited;
+            std::vector<CommandId> stack = {command};
+            while(!stack.empty())
+            {
+                auto importer = stack.back();
+                stack.pop_back();
+                for(auto& name : _requires[importer])
+                {
+                    auto it = _providers.find(name);
+                    if(it == _providers.end() || !visited.insert(name).second)
+                    {
+                        continue;
+                    }
+                    addModule(name, _commands[it->second].moduleScan.moduleOutput);
+                    stack.push_back(it->second);
+                }
             }
+            return result;
         }
 
-        if(halt)
+    private:
+        const std::vector<CommandEntry>& _commands;
+        std::vector<bool> _isScan;
+        bool _loaded = false;
+        std::vector<std::vector<std::string>> _provides;
+        std::vector<std::vector<std::string>> _requires;
+        std::unordered_map<std::string, CommandId> _providers;
+    };
+
+    // Runs filteredCommands, or if check is set, the included commands it finds dirty, as it
+    // finds them. In that case filteredCommands has to have room for every command, so
+    // commands can be added without moving the ones already running.
+    size_t scheduleCommands(std::vector<PendingCommand>& filteredCommands, Database& database, size_t maxConcurrentCommands, bool verbose, CommandExecutor& executor, DirtyCheck* check, const std::vector<bool>& included)
+    {
+        const auto& commandDefinitions = database.getCommands();
+        const auto& dependencies = database.getCommandDependencies();
+        auto& commandSignatures = database.getCommandSignatures();
+        auto& depFileSignatures = database.getDepFileSignatures();
+
+        DependencySignatures dependencySignatures;
+        auto& newInputSignatures = dependencySignatures.signatures;
+
+        // Not loving this, but since the dependency map are indices
+        // in the unfiltered commands we need the full list
+        // TODO: Test if a mapping table is faster or not
+        std::vector<bool> commandCompleted;
+        commandCompleted.resize(database.getCommands().size(), true);
+        for(auto& filteredCommands : filteredCommands)
         {
-            continue;
+            commandCompleted[filteredCommands.command] = false;
+        }
+
+        // Included commands are waited for until the check has decided them
+        size_t undecidedCommands = 0;
+        if(check)
+        {
+            assert(filteredCommands.empty() && filteredCommands.capacity() >= commandDefinitions.size());
+            for(size_t commandIndex = 0; commandIndex < commandDefinitions.size(); ++commandIndex)
+            {
+                if(included[commandIndex])
+                {
+                    commandCompleted[commandIndex] = false;
+                    ++undecidedCommands;
+                }
+            }
         }
 
-        bool skipped = false;
-        for(size_t i = firstPending; i < filteredCommands.size(); ++i)
+        bool rebuildDependencies = false;
+
+        // Commands using modules wait for every scan in the build, to know which commands
+        // provide the modules they import, and then for those commands.
+        ModuleGraph moduleGraph(commandDefinitions);
+        size_t scansLeft = 0;
+        if(!moduleGraph.empty())
         {
-            if(runningCommands.size() >= maxConcurrentCommands)
+            for(auto& command : filteredCommands)
             {
-                break;
+                scansLeft += moduleGraph.isScan(command.command) ? 1 : 0;
             }
+        }
+
+        // Dependencies found by this build, starting out as what earlier builds found
+        std::map<CommandId, DiscoveredDependencies> discovered;
+        auto discoveredFor = [&](CommandId command) -> DiscoveredDependencies&
+        {
+            return discovered.try_emplace(command, database.getDiscoveredDependencies()[command]).first->second;
+        };
+
+        size_t completed = 0;
+        size_t firstPending = 0;
+        std::vector<PendingCommand*> runningCommands;
+        bool halt = false;
+        std::mutex doneMutex;
+        std::condition_variable doneCondition;
+        std::vector<PendingCommand*> doneCommands;
+        std::vector<std::pair<uint32_t, bool>> decidedCommands;
+        bool checking = check != nullptr;
+        bool checkFinished = false;
 
-            auto& command = filteredCommands[i];
-            if(!commandCompleted[command.command] && !command.result.valid())
+        // Each running command occupies a pool thread while waiting for its process, so the
+        // check gets threads of its own on top of those.
+        auto& threadPool = ThreadPool::instance();
+        size_t checkThreads = check ? ThreadPool::defaultThreadCount() : 0;
+        threadPool.reserveThreads(maxConcurrentCommands + checkThreads);
+
+        auto buildOutput = std::make_unique<BuildOutput>(filteredCommands.size(), maxConcurrentCommands, verbose);
+
+        // Slot each running command occupies, for tracing. Slots are numbered from 1.
+        std::vector<uint32_t> commandSlots(check ? commandDefinitions.size() : filteredCommands.size());
+        std::vector<bool> slotBusy(maxConcurrentCommands + 1, false);
+
+        // Filled in by the pool thread that ran each command, before it's reported done
+        struct Completion
+        {
+            Signature commandSignature;
+            bool depFileChanged = false;
+            std::optional<DiscoveredDependencies> dyndepManifest;
+        };
+        std::vector<Completion> completions(commandSlots.size());
+
+        // Edges from dyndep manifests found during the build. Commands that haven't started
+        // wait for the commands writing their new inputs. Ones that have, or turn out not to
+        // need to run, went without those inputs and are made to run again next build.
+        std::unordered_map<std::filesystem::path, CommandId, PathHash> producers;
+        std::unordered_map<CommandId, std::vector<CommandId>> foundDependencies;
+        std::vector<CommandId> waitingConsumers;
+        std::vector<CommandId> staleConsumers;
+        auto addDyndepManifest = [&](CommandId command, DiscoveredDependencies&& manifest)
+        {
+            if(producers.empty())
             {
-                bool ready = true;
-                for(auto dependency : dependencies[command.command])
+                auto& previousDiscovered = database.getDiscoveredDependencies();
+                for(CommandId producer = 0; producer < commandDefinitions.size(); ++producer)
                 {
-                    if(!commandCompleted[dependency])
+                    for(auto* outputs : {&commandDefinitions[producer].outputs, &previousDiscovered[producer].outputs})
                     {
-                        ready = false;
-                        break;
+                        for(auto& output : *outputs)
+                        {
+                            producers.emplace(output, producer);
+                        }
                     }
                 }
+            }
+            for(auto& output : manifest.outputs)
+            {
+                producers.emplace(output, command);
+            }
 
-                if(!ready)
+            auto& previous = database.getDiscoveredDependencies()[command].dependentInputs;
+            for(auto& dependentInput : manifest.dependentInputs)
+            {
+                auto consumer = producers.find(dependentInput.first);
+                if(consumer == producers.end())
+                {
+                    buildOutput->print("No command has the output " + dependentInput.first.string() + " given in " + commandDefinitions[command].dyndepFile.string() + ".\n");
+                    continue;
+                }
+                if(std::find(previous.begin(), previous.end(), dependentInput) != previous.end())
                 {
-                    skipped = true;
                     continue;
                 }
 
-                auto& commandDefinition = commandDefinitions[command.command];
-                std::cout << "\n["/*"\33[2K\r["*/ << (++count) << "/" << filteredCommands.size() << "] " << commandDefinition.description << std::flush;
-                if(verbose)
+                bool started = commandCompleted[consumer->second] || std::any_of(runningCommands.begin(), runningCommands.end(), [&](auto running) { return running->command == consumer->second; });
+                if(started)
+                {
+                    staleConsumers.push_back(consumer->second);
+                    continue;
+                }
+                waitingConsumers.push_back(consumer->second);
+                auto producer = producers.find(dependentInput.second);
+                if(producer != producers.end() && producer->second != consumer->second)
                 {
-                    std::cout << "\n" << commandDefinition.command << "\n";
-                    if(!commandDefinition.rspFile.empty())
+                    foundDependencies[consumer->second].push_back(producer->second);
+                }
+            }
+
+            auto& found = discoveredFor(command);
+            found.outputs = std::move(manifest.outputs);
+            found.dependentInputs = std::move(manifest.dependentInputs);
+        };
+
+        // Spans from starting the check until it's done, which may be well into the build
+        std::optional<trace::Scope> checkScope;
+        if(check)
+        {
+            checkScope.emplace("Check signatures");
+            check->start(checkThreads, [&](uint32_t command, bool dirty)
+            {
+                std::scoped_lock doneLock(doneMutex);
+                decidedCommands.push_back({command, dirty});
+                doneCondition.notify_one();
+            }, [&]()
+            {
+                std::scoped_lock doneLock(doneMutex);
+                checkFinished = true;
+                doneCondition.notify_one();
+            });
+        }
+
+        while((!halt && (firstPending < filteredCommands.size() || checking)) || !runningCommands.empty())
+        {
+            {
+                // Anything that could be started has been, so wait for something to finish or to be found dirty
+                std::unique_lock doneLock(doneMutex);
+                doneCondition.wait(doneLock, [&]()
+                {
+                    return !doneCommands.empty() || !decidedCommands.empty() || (checking ? checkFinished : runningCommands.empty());
+                });
+
+                size_t foundCommands = 0;
+                for(auto [commandIndex, dirty] : decidedCommands)
+                {
+                    if(!included[commandIndex])
+                    {
+                        continue;
+                    }
+                    --undecidedCommands;
+                    if(dirty && !commandDefinitions[commandIndex].command.empty())
+                    {
+                        filteredCommands.push_back({commandIndex, true});
+                        ++foundCommands;
+                        scansLeft += moduleGraph.isScan(commandIndex) ? 1 : 0;
+                    }
+                    else
+                    {
+                        commandCompleted[commandIndex] = true;
+                    }
+                }
+                decidedCommands.clear();
+                if(foundCommands > 0)
+                {
+                    if(filteredCommands.size() == foundCommands)
                     {
-                        std::cout << "rsp:\n" << commandDefinition.rspContents << "\n";
+                        buildOutput->print("Building using " + std::to_string(maxConcurrentCommands) + " concurrent tasks.\n");
                     }
+                    buildOutput->addCommands(foundCommands);
                 }
 
-                command.result = std::async(std::launch::async, [&command, &commandDefinition, &doneMutex, &doneCommands]() -> process::ProcessResult
+                if(checking && checkFinished)
                 {
-                    process::ProcessResult result = {1, "Unknown error."};
-                    try
+                    checking = false;
+                    checkScope.reset();
+                    // Only happens if checking failed, which wait() below reports
+                    if(undecidedCommands > 0)
+                    {
+                        halt = true;
+                    }
+                }
+
+                for(auto it = doneCommands.begin(); it != doneCommands.end(); )
+                {
+                    auto command = *it;
+                    commandCompleted[command->command] = true;
+
+                    auto result = command->result.get();
+                    // Output has already been streamed while the command was running
+                    buildOutput->commandFinished(command - filteredCommands.data(), result.exitCode);
+                    slotBusy[commandSlots[command - filteredCommands.data()]] = false;
+
+                    if(interrupt::isInterrupted() || result.exitCode != 0)
                     {
-                        result = runCommand(commandDefinition);
+                        halt = true;
                     }
-                    catch(const std::exception& e)
+                    else
                     {
-                        result = {1, e.what()};
+                        auto& completion = completions[command - filteredCommands.data()];
+                        rebuildDependencies = rebuildDependencies || completion.depFileChanged;
+                        commandSignatures[command->command] = completion.commandSignature;
+                        if(completion.dyndepManifest)
+                        {
+                            addDyndepManifest(command->command, std::move(*completion.dyndepManifest));
+                        }
+                        ++completed;
+                        scansLeft -= moduleGraph.isScan(command->command) ? 1 : 0;
                     }
-                    catch(...)
+                    it = doneCommands.erase(it);
+
+                    auto runIt = std::find(runningCommands.begin(), runningCommands.end(), command);
+                    assert(runIt != runningCommands.end());
+                    if(runIt != runningCommands.end())
                     {
-                        result = {1, "Unknown error."};
+                        runningCommands.erase(runIt);
                     }
-                    
+                    else
                     {
-                        std::scoped_lock doneLock(doneMutex);
-                        doneCommands.push_back(&command);
+                        throw std::runtime_error("Internal error. (Completed command not found in running list.)");
                     }
+                }
+            }
 
-                    return result;
-                });
-                runningCommands.push_back(&command);
+            if(interrupt::isInterrupted())
+            {
+                halt = true;
+            }
+            if(halt)
+            {
+                continue;
+            }
+
+            bool skipped = false;
+            for(size_t i = firstPending; i < filteredCommands.size(); ++i)
+            {
+                if(runningCommands.size() >= maxConcurrentCommands)
+                {
+                    break;
+                }
+
+                auto& command = filteredCommands[i];
+                if(!commandCompleted[command.command] && !command.result.valid())
+                {
+                    // Edges to module providers found by earlier builds may be out of date, so
+                    // they're replaced by the ones found now
+                    bool usesModules = !moduleGraph.empty() && commandDefinitions[command.command].moduleScan;
+                    bool ready = true;
+                    for(auto dependency : dependencies[command.command])
+                    {
+                        if(!commandCompleted[dependency] && !(usesModules && !commandDefinitions[dependency].moduleScan.moduleOutput.empty()))
+                        {
+                            ready = false;
+                            break;
+                        }
+                    }
+                    if(ready && !foundDependencies.empty())
+                    {
+                        auto it = foundDependencies.find(command.command);
+                        if(it != foundDependencies.end())
+                        {
+                            ready = std::all_of(it->second.begin(), it->second.end(), [&commandCompleted](CommandId dependency) { return commandCompleted[dependency]; });
+                        }
+                    }
+
+                    std::vector<CommandId> moduleProviders;
+                    if(ready && usesModules)
+                    {
+                        ready = !checking && scansLeft == 0;
+                        if(ready && !moduleGraph.isLoaded())
+                        {
+                            moduleGraph.load();
+                        }
+                        if(ready)
+                        {
+                            moduleProviders = moduleGraph.getProviders(command.command);
+                            ready = std::all_of(moduleProviders.begin(), moduleProviders.end(), [&commandCompleted](CommandId provider) { return commandCompleted[provider]; });
+                        }
+                    }
+
+                    if(!ready)
+                    {
+                        skipped = true;
+                        continue;
+                    }
+
+                    auto& commandDefinition = commandDefinitions[command.command];
+                    buildOutput->commandStarted(i, commandDefinition);
+
+                    std::string moduleMap;
+                    if(usesModules)
+                    {
+                        moduleMap = moduleGraph.getMap(command.command);
+                        std::vector<std::filesystem::path> moduleInputs;
+                        for(auto provider : moduleProviders)
+                        {
+                            moduleInputs.push_back(commandDefinitions[provider].moduleScan.moduleOutput);
+                        }
+                        std::sort(moduleInputs.begin(), moduleInputs.end());
+                        moduleInputs.erase(std::unique(moduleInputs.begin(), moduleInputs.end()), moduleInputs.end());
+                        discoveredFor(command.command).inputs = std::move(moduleInputs);
+                    }
+
+                    uint32_t slot = 1;
+                    while(slotBusy[slot])
+                    {
+                        ++slot;
+                    }
+                    slotBusy[slot] = true;
+                    commandSlots[i] = slot;
+
+                    command.result = threadPool.async([&command, &commandDefinition, &executor, &doneMutex, &doneCondition, &doneCommands, &buildOutput = *buildOutput, &completion = completions[i], &depFileSignature = depFileSignatures[command.command], &dependencySignatures, moduleMap = std::move(moduleMap), usesModules, i, slot]() -> process::ProcessResult
+                    {
+                        auto startTime = trace::Clock::now();
+                        process::ProcessResult result = {1, "Unknown error."};
+                        try
+                        {
+                            if(usesModules)
+                            {
+                                writeFile(commandDefinition.moduleScan.mapFile, moduleMap);
+                            }
+                            result = executor.run(commandDefinition, [&buildOutput, i](std::string_view output)
+                            {
+                                buildOutput.commandOutput(i, output);
+                            });
+                            if(result.exitCode == 0)
+                            {
+                                completion.depFileChanged = finishCommand(commandDefinition, depFileSignature, dependencySignatures, completion.commandSignature);
+                                if(!commandDefinition.dyndepFile.empty())
+                                {
+                                    completion.dyndepManifest = readDyndepManifest(commandDefinition, dependencySignatures.pathCache);
+                                }
+                            }
+                        }
+                        catch(const std::exception& e)
+                        {
+                            result = {1, e.what()};
+                            buildOutput.commandOutput(i, result.output);
+                        }
+                        catch(...)
+                        {
+                            result = {1, "Unknown error."};
+                            buildOutput.commandOutput(i, result.output);
+                        }
+                        trace::record(commandDefinition.description, "command", startTime, trace::Clock::now(), slot);
+
+                        {
+                            std::scoped_lock doneLock(doneMutex);
+                            doneCommands.push_back(&command);
+                            doneCondition.notify_one();
+                        }
+
+                        return result;
+                    });
+                    runningCommands.push_back(&command);
+                }
+
+                if((commandCompleted[command.command] || command.result.valid()) && !skipped)
+                {
+                    firstPending = i+1;
+                }
             }
 
-            if((commandCompleted[command.command] || command.result.valid()) && !skipped)
+            // Declared dependencies always let something run, but ones found while building may not
+            if(runningCommands.empty() && !checking && firstPending < filteredCommands.size())
             {
-                firstPending = i+1;
+                buildOutput->print("Commands are waiting for each other through modules they import or dyndep manifests. These dependencies can't be cyclic.\n");
+                halt = true;
             }
         }
-    }
 
-    std::cout << "\n" << std::flush;
+        // Even after a failure, the check has to finish for the signatures of commands
+        // depending on what ran to be invalidated.
+        if(check)
+        {
+            trace::Scope traceScope("Wait for check");
+            check->wait();
+        }
+        checkScope.reset();
 
-    if(rebuildDependencies)
-    {
-        if(!newInputSignatures.empty())
+        // Flush everything and stop the output thread before printing anything else
+        buildOutput.reset();
+
+        if(rebuildDependencies && !newInputSignatures.empty())
         {
-            auto& fileDependencies = database.getFileDependencies();
-            for(auto& input : fileDependencies)
+            auto& filePaths = database.getFilePaths();
+            auto& fileSignatures = database.getFileSignatures();
+            for(size_t i = 0; i < filePaths.size(); ++i)
             {
-                auto it = newInputSignatures.find(input.path);
+                auto it = newInputSignatures.find(filePaths[i]);
                 if(it != newInputSignatures.end())
                 {
-                    input.signaturePair = it->second;
+                    fileSignatures[i] = it->second;
                     newInputSignatures.erase(it);
                 }
             }
 
             for(auto& signature : newInputSignatures)
             {
-                fileDependencies.push_back({signature.first, {}, signature.second});
+                database.addFileDependency(signature.first, signature.second);
             }
         }
 
-        std::cout << "Updating dependency graph." << std::endl;
-        database.rebuildFileDependencies(); 
-    }
-
-    return completed;
-}
-
-std::vector<PendingCommand> filterCommands(Database& database, std::filesystem::path invocationPath, std::vector<std::string> targets)
-{
-    bool allIncluded = targets.empty();
+        if(!staleConsumers.empty() || !waitingConsumers.empty())
+        {
+            std::unordered_set<CommandId> ran;
+            for(size_t i = 0; i < filteredCommands.size(); ++i)
+            {
+                if(completions[i].commandSignature != EMPTY_SIGNATURE)
+                {
+                    ran.insert(filteredCommands[i].command);
+                }
+            }
+            for(auto consumer : waitingConsumers)
+            {
+                if(ran.count(consumer) == 0)
+                {
+                    staleConsumers.push_back(consumer);
+                }
+            }
+            for(auto consumer : staleConsumers)
+            {
+                commandSignatures[consumer] = {};
+            }
+        }
 
-    auto& commands = database.getCommands();
-    auto& dependencies = database.getCommandDependencies();
-    auto& commandSignatures = database.getCommandSignatures();
-    auto& fileDependencies = database.getFileDependencies();
+        // Sets the whole graph up again if commands depend on other commands than before,
+        // which includes rebuilding the file dependencies
+        bool graphChanged = false;
+        if(!discovered.empty())
+        {
+            graphChanged = database.setDiscoveredDependencies(std::vector<std::pair<CommandId, DiscoveredDependencies>>(discovered.begin(), discovered.end()));
+        }
+        if(rebuildDependencies || graphChanged)
+        {
+            std::cout << "Updating dependency graph." << std::endl;
+            if(!graphChanged)
+            {
+                database.rebuildFileDependencies();
+            }
+        }
 
-    std::vector<PendingCommand> filteredCommands;
-    filteredCommands.reserve(commands.size());
-    for(uint32_t commandIndex = 0; commandIndex < commands.size(); ++commandIndex)
-    {
-        filteredCommands.push_back({commandIndex});
-        filteredCommands.back().included = allIncluded;
+        return completed;
     }
 
-    struct ExpandedTarget
+    // Marks the commands needed for targets, or all of them if there are none.
+    std::vector<bool> findIncludedCommands(const Database& database, const std::filesystem::path& invocationPath, const std::vector<std::string>& targets)
     {
-        std::string target;
-        std::string expanded;
-    };
+        auto& commands = database.getCommands();
+        auto& dependencies = database.getCommandDependencies();
 
-    std::vector<ExpandedTarget> expandedTargets;
-    expandedTargets.reserve(targets.size());
-    for(auto& target : targets)
-    {
-        expandedTargets.push_back({target, (invocationPath / target.c_str()).lexically_normal().string()});
-    }
+        std::vector<bool> included(commands.size(), targets.empty());
 
-    std::vector<size_t> stack;
-    stack.reserve(commands.size());
-    auto markIncluded = [&filteredCommands, &stack, &dependencies](size_t includeIndex){
-        stack.push_back(includeIndex);
-        while(!stack.empty())
+        struct ExpandedTarget
         {
-            auto commandIndex = stack.back();
-            stack.pop_back();
-            
-            filteredCommands[commandIndex].included = true;
-            stack.insert(stack.end(), dependencies[commandIndex].begin(), dependencies[commandIndex].end());
-        }
-    };
+            std::string target;
+            std::string expanded;
+        };
 
-    for(auto target : expandedTargets)
-    {
-        bool found = false;
-        for(uint32_t commandIndex = 0; commandIndex < commands.size(); ++commandIndex)
+        std::vector<ExpandedTarget> expandedTargets;
+        expandedTargets.reserve(targets.size());
+        for(auto& target : targets)
         {
-            if(target.target == commands[commandIndex].description)
+            expandedTargets.push_back({target, (invocationPath / target.c_str()).lexically_normal().string()});
+        }
+
+        std::vector<size_t> stack;
+        stack.reserve(commands.size());
+        auto markIncluded = [&included, &stack, &dependencies](size_t includeIndex){
+            stack.push_back(includeIndex);
+            while(!stack.empty())
             {
-                markIncluded(commandIndex);
-                found = true;
+                auto commandIndex = stack.back();
+                stack.pop_back();
+
+                included[commandIndex] = true;
+                stack.insert(stack.end(), dependencies[commandIndex].begin(), dependencies[commandIndex].end());
             }
-            for(auto& input : commands[commandIndex].inputs)
+        };
+
+        for(auto target : expandedTargets)
+        {
+            bool found = false;
+            for(uint32_t commandIndex = 0; commandIndex < commands.size(); ++commandIndex)
             {
-                if(target.expanded == input.string())
+                if(target.target == commands[commandIndex].description)
                 {
                     markIncluded(commandIndex);
                     found = true;
-                    break;
                 }
-            }
-            for(auto& output : commands[commandIndex].outputs)
-            {
-                if(target.expanded == output.string())
+                for(auto& input : commands[commandIndex].inputs)
+                {
+                    if(target.expanded == input.string())
+                    {
+                        markIncluded(commandIndex);
+                        found = true;
+                        break;
+                    }
+                }
+                for(auto& output : commands[commandIndex].outputs)
+                {
+                    if(target.expanded == output.string())
+                    {
+                        markIncluded(commandIndex);
+                        found = true;
+                        break;
+                    }
+                }
+                if(found)
                 {
-                    markIncluded(commandIndex);
-                    found = true;
                     break;
                 }
             }
-            if(found)
+            if(!found)
             {
-                break;
+                throw std::runtime_error("The specified target could not be found:\n  " + std::string(target.target) + " (" + target.expanded.c_str() + ")");
             }
         }
-        if(!found)
-        {
-            throw std::runtime_error("The specified target could not be found:\n  " + std::string(target.target) + " (" + target.expanded.c_str() + ")");
-        }
-    }
-    
-    // Split all file dependencies in N buckets and do an input signature check on them in parallel
-    {
-        size_t maxConcurrentCommands = std::max((size_t)1, (size_t)std::thread::hardware_concurrency());
-        std::vector<std::future<void>> futures;
-        size_t numEntries = fileDependencies.size();
-        for(size_t i = 0; i < maxConcurrentCommands; ++i)
-        {
-            int start = i * numEntries / maxConcurrentCommands;
-            int end = (i+1) * numEntries / maxConcurrentCommands;
-            futures.push_back(std::async(std::launch::async, [
-                start, 
-                end, 
-                &filteredCommands, 
-                &commandSignatures,
-                &fileDependencies]()
-            {
-                checkInputSignatures(commandSignatures, filteredCommands, fileDependencies.begin() + start, fileDependencies.begin() + end);
-            }));
-        }
-        for(auto& future : futures)
-        {
-            future.wait();
-        }
+
+        return included;
     }
+}
+
+size_t runCommands(std::vector<PendingCommand>& filteredCommands, Database& database, size_t maxConcurrentCommands, bool verbose, CommandExecutor& executor)
+{
+    return scheduleCommands(filteredCommands, database, maxConcurrentCommands, verbose, executor, nullptr, {});
+}
+
+std::vector<PendingCommand> filterCommands(Database& database, std::filesystem::path invocationPath, std::vector<std::string> targets, ChangeDetection changeDetection)
+{
+    trace::Scope traceScope("Filter commands");
 
-    // Split all commands in N buckets and do an output signature check on them in parallel
+    auto included = findIncludedCommands(database, invocationPath, targets);
     {
-        size_t maxConcurrentCommands = std::max((size_t)1, (size_t)std::thread::hardware_concurrency());
-        std::vector<std::future<void>> futures;
-        size_t numEntries = commands.size();
-        for(size_t i = 0; i < maxConcurrentCommands; ++i)
-        {
-            int start = i * numEntries / maxConcurrentCommands;
-            int end = (i+1) * numEntries / maxConcurrentCommands;
-            futures.push_back(std::async(std::launch::async, [
-                start, 
-                end, 
-                &commandSignatures,
-                &commands]()
-            {
-                checkOutputSignatures(commandSignatures, commands, start, end);
-            }));
-        }
-        for(auto& future : futures)
-        {
-            future.wait();
-        }
+        trace::Scope traceScope("Check signatures");
+        DirtyCheck check(database, included, changeDetection);
+        check.start(ThreadPool::defaultThreadCount());
+        check.wait();
     }
 
+    auto& commands = database.getCommands();
+    auto& commandSignatures = database.getCommandSignatures();
+    std::vector<PendingCommand> filteredCommands;
     for(uint32_t commandIndex = 0; commandIndex < commands.size(); ++commandIndex)
     {
-        // TODO: More descriptive names for the different concepts
-        const auto& command = commands[commandIndex];
-        const auto& commandDependencies = dependencies[commandIndex];
-        auto& filteredCommand = filteredCommands[commandIndex];
-        auto& commandSignature = commandSignatures[commandIndex];
-
-        if (commandSignature == EMPTY_SIGNATURE)
-        {
-#if LOG_DIRTY_REASON
-            std::cout << "dirty: Signature missing for " << command.description << std::endl;
-#endif
-            continue;
-        }
-        if(commandSignature != computeCommandSignature(command))
-        {
-#if LOG_DIRTY_REASON
-            std::cout << "dirty: Signature mismatching for " << command.description << std::endl;
-#endif
-            commandSignature = {};
-            continue;
-        }
-
-        for(auto dependency : dependencies[commandIndex])
+        // TODO: commands[command.command].command is clearly an indicator some stuff needs renaming...
+        if(included[commandIndex] && !commands[commandIndex].command.empty() && commandSignatures[commandIndex] == EMPTY_SIGNATURE)
         {
-            if(commandSignatures[dependency] == EMPTY_SIGNATURE)
-            {
-#if LOG_DIRTY_REASON
-                std::cout << "dirty: Transitive " << command.description << std::endl;
-#endif
-                commandSignature = {};
-                break;
-            }
+            filteredCommands.push_back({commandIndex, true});
         }
     }
 
-    filteredCommands.erase(std::remove_if(filteredCommands.begin(), filteredCommands.end(), [&commands, &commandSignatures](auto& command) { 
-            // TODO: commands[command.command].command is clearly an indicator some stuff needs renaming...
-            return commands[command.command].command.empty() || commandSignatures[command.command] != EMPTY_SIGNATURE || !command.included;
-        }), filteredCommands.end());
-
     return filteredCommands;
 }
 
+BuildResult buildCommands(Database& database, size_t maxConcurrentCommands, bool verbose, std::filesystem::path invocationPath, std::vector<std::string> targets, ChangeDetection changeDetection, CommandExecutor& executor)
+{
+    std::vector<bool> included;
+    std::optional<DirtyCheck> check;
+    {
+        trace::Scope traceScope("Prepare check");
+        included = findIncludedCommands(database, invocationPath, targets);
+        check.emplace(database, included, changeDetection);
+    }
+
+    trace::Scope traceScope("Check and run commands");
+    std::vector<PendingCommand> filteredCommands;
+    filteredCommands.reserve(database.getCommands().size());
+    BuildResult result;
+    result.completedCommands = scheduleCommands(filteredCommands, database, maxConcurrentCommands, verbose, executor, &*check, included);
+    result.dirtyCommands = filteredCommands.size();
+    return result;
+}
+
 bool commands::runCommands(std::vector<CommandEntry> commands, std::filesystem::path databasePath) {
     Database database;
     database.load(databasePath);
@@ -13,9 +13,53 @@ struct PendingCommand
     std::future<process::ProcessResult> result;
 };
 
+// Runs a single command on behalf of runCommands, which calls it from pool threads,
+// so implementations need to be thread safe. Output should be passed to the callback
+// as it's produced rather than returned in the result.
+class CommandExecutor
+{
+public:
+    virtual ~CommandExecutor() = default;
+
+    virtual process::ProcessResult run(const CommandEntry& command, const process::OutputCallback& outputCallback) = 0;
+};
+
+// Runs commands through the shell, in their working directory.
+class ProcessExecutor : public CommandExecutor
+{
+public:
+    static ProcessExecutor& instance();
+
+    process::ProcessResult run(const CommandEntry& command, const process::OutputCallback& outputCallback) override;
+};
+
+// Shortcuts filterCommands can take instead of checking every input file.
+struct ChangeDetection
+{
+    // Only check the files of directories whose modification time has changed since
+    // their files were last checked. Files are normally replaced rather than written
+    // in place by editors and tools, which updates the directory, but files modified
+    // in place are missed.
+    bool directoryTimes = false;
+    // Only check the files git reports as changed since the last check, along with
+    // files git doesn't track. Falls back to checking everything if git can't tell.
+    bool git = false;
+};
+
 bool updatePathSignature(SignaturePair& signaturePair, const std::filesystem::path& path);
-size_t runCommands(std::vector<PendingCommand>& filteredCommands, Database& database, size_t maxConcurrentCommands, bool verbose);
-std::vector<PendingCommand> filterCommands(Database& database, std::filesystem::path invocationPath = {}, std::vector<std::string> targets = {});
+size_t runCommands(std::vector<PendingCommand>& filteredCommands, Database& database, size_t maxConcurrentCommands, bool verbose, CommandExecutor& executor = ProcessExecutor::instance());
+std::vector<PendingCommand> filterCommands(Database& database, std::filesystem::path invocationPath = {}, std::vector<std::string> targets = {}, ChangeDetection changeDetection = {});
+
+struct BuildResult
+{
+    size_t dirtyCommands = 0;
+    size_t completedCommands = 0;
+};
+
+// Finds the commands that need to run and runs them, starting each one as soon as it
+// and everything it depends on has been checked, instead of after the whole graph has
+// been. Commands needed for targets are checked first.
+BuildResult buildCommands(Database& database, size_t maxConcurrentCommands, bool verbose, std::filesystem::path invocationPath = {}, std::vector<std::string> targets = {}, ChangeDetection changeDetection = {}, CommandExecutor& executor = ProcessExecutor::instance());
 
 // TODO: Need to clean up namespaces and code structure in general
 namespace commands
@@ -5,11 +5,17 @@
 #include <algorithm>
 #include <fstream>
 #include <iostream>
+#include <sstream>
+#include <type_traits>
 #include <filesystem>
 #include <vector>
 
 #include "util/hash.h"
+#include "util/path.h"
 #include "dependencyparser.h"
+#include "stringtable.h"
+#include "threadpool.h"
+#include "trace.h"
 
 namespace 
 {
@@ -28,7 +34,7 @@ namespace
 struct Header
 {
     uint32_t magic = 'bldh';
-    uint32_t version = 4;
+    uint32_t version = 10;
     char str[8] = {'b', 'u', 'i', 'l', 'd', 'd', 'b', '\0'};
 };
 #pragma pack()
@@ -43,44 +49,129 @@ static void writeUInt(std::ostream& stream, uint32_t value)
     stream.write(reinterpret_cast<const char*>(&value), sizeof(uint32_t));
 }
 
-static void writeSignature(std::ostream& stream, Signature signature)
+static void writeBlob(std::ostream& stream, std::string_view data)
 {
-    stream.write(reinterpret_cast<const char*>(&signature), sizeof(Signature));
+    writeUInt(stream, data.size());
+    stream.write(data.data(), data.size());
 }
 
-static void writeStringList(std::ostream& stream, const std::vector<std::string>& list)
+static void writeStringTable(std::ostream& stream, const StringTable& strings)
 {
-    writeUInt(stream, list.size());
-    for(auto& item : list)
+    writeUInt(stream, strings.size());
+    for(StringTable::Id id = 0; id < strings.size(); ++id)
+    {
+        auto str = strings.get(id);
+        stream.write(str.data(), str.size());
+        stream.put('\0');
+    }
+}
+
+// The table only refers to strings owned by the database, which stays unchanged while saving
+static void writeStringId(std::ostream& stream, StringTable& strings, const std::string& str)
+{
+    writeUInt(stream, strings.addView(str));
+}
+
+static void writePathId(std::ostream& stream, StringTable& strings, const std::filesystem::path& path)
+{
+    if constexpr(std::is_same_v<std::filesystem::path::value_type, char>)
+    {
+        writeUInt(stream, strings.addView(path.native()));
+    }
+    else
     {
-        writeString(stream, item);
+        writeUInt(stream, strings.add(path.string()));
     }
 }
 
-static void writePathList(std::ostream& stream, const std::vector<std::filesystem::path>& list)
+static void writePathIdList(std::ostream& stream, StringTable& strings, const std::vector<std::filesystem::path>& list)
 {
     writeUInt(stream, list.size());
     for(auto& item : list)
     {
-        writeString(stream, item.string());
+        writePathId(stream, strings, item);
     }
 }
 
-static void writeIdList(std::ostream& stream, const std::vector<CommandId>& list)
+// Columns are written as raw arrays, aligned so they could be used in place
+static constexpr size_t COLUMN_ALIGNMENT = 8;
+
+static void writeColumnPadding(std::ostream& stream)
 {
-    writeUInt(stream, list.size());
-    stream.write(reinterpret_cast<const char*>(list.data()), sizeof(CommandId) * list.size());
+    static const char zeros[COLUMN_ALIGNMENT] = {};
+    auto position = (size_t)stream.tellp();
+    stream.write(zeros, (COLUMN_ALIGNMENT - position % COLUMN_ALIGNMENT) % COLUMN_ALIGNMENT);
 }
 
-static void writeDepFile(std::ostream& stream, const DepFile& depFile)
+template<typename T>
+static void writeColumn(std::ostream& stream, const std::vector<T>& column)
 {
-    writeString(stream, depFile.path.string());
+    writeColumnPadding(stream);
+    stream.write(reinterpret_cast<const char*>(column.data()), sizeof(T) * column.size());
+}
+
+// The number of nodes is known from elsewhere, so only the edge count is stored
+static void writeAdjacencyList(std::ostream& stream, const AdjacencyList& list)
+{
+    writeUInt(stream, list.ids().size());
+    writeColumn(stream, list.offsets());
+    writeColumn(stream, list.ids());
+}
+
+static void writeDepFile(std::ostream& stream, StringTable& strings, const DepFile& depFile)
+{
+    writePathId(stream, strings, depFile.path);
     if(!depFile.path.empty())
     {
         writeUInt(stream, depFile.format);
     }
 }
 
+static void writeModuleScan(std::ostream& stream, StringTable& strings, const ModuleScan& moduleScan)
+{
+    writePathId(stream, strings, moduleScan.path);
+    if(moduleScan)
+    {
+        writePathId(stream, strings, moduleScan.moduleOutput);
+        writePathId(stream, strings, moduleScan.mapFile);
+        writeUInt(stream, moduleScan.format);
+    }
+}
+
+static void writeDiscoveredDependencies(std::ostream& stream, StringTable& strings, const DiscoveredDependencies& discovered)
+{
+    writePathIdList(stream, strings, discovered.inputs);
+    writePathIdList(stream, strings, discovered.outputs);
+    writeUInt(stream, (uint32_t)discovered.dependentInputs.size());
+    for(auto& [command, input] : discovered.dependentInputs)
+    {
+        writePathId(stream, strings, command);
+        writePathId(stream, strings, input);
+    }
+}
+
+// Compile commands of a project are stored next to each other and only differ in
+// their last few arguments. To store the shared block of flags only once, each
+// command line is split where it stops matching the previous one, at an argument
+// boundary, and the prefix goes into the string table.
+static constexpr size_t MIN_SHARED_COMMAND_PREFIX = 64;
+
+static size_t getSharedCommandPrefix(std::string_view command, std::string_view previousCommand, std::string_view previousPrefix)
+{
+    if(!previousPrefix.empty() && command.substr(0, previousPrefix.size()) == previousPrefix)
+    {
+        return previousPrefix.size();
+    }
+
+    size_t length = std::mismatch(command.begin(), command.end(), previousCommand.begin(), previousCommand.end()).first - command.begin();
+    if(length < MIN_SHARED_COMMAND_PREFIX)
+    {
+        return 0;
+    }
+    length = command.rfind(' ', length - 1);
+    return length != std::string_view::npos && length >= MIN_SHARED_COMMAND_PREFIX ? length : 0;
+}
+
 static void readData(std::string_view data, size_t& pos, char* output, size_t amount)
 {
     if(data.size() < amount || data.size()-amount < pos)
@@ -112,50 +203,88 @@ static uint32_t readUInt(std::string_view data, size_t& pos)
     return result;
 }
 
-static Signature readSignature(std::string_view data, size_t& pos)
+static std::string_view readBlob(std::string_view data, size_t& pos)
 {
-    Signature result = {};
-    readData(data, pos, reinterpret_cast<char*>(&result), sizeof(result));
-    return result;
+    uint32_t size = readUInt(data, pos);
+    if(data.size() - pos < size)
+    {
+        throw std::runtime_error("Reading past the end of input.");
+    }
+    pos += size;
+    return data.substr(pos - size, size);
 }
 
-static std::vector<std::string> readStringList(std::string_view data, size_t& pos)
+static std::vector<std::string_view> readStringTable(std::string_view data, size_t& pos)
 {
     uint32_t size = readUInt(data, pos);
-    std::vector<std::string> result;
-    result.reserve(size);
+    std::vector<std::string_view> result;
+    result.reserve(std::min<size_t>(size, data.size()));
     for(uint32_t i=0; i < size; ++i)
     {
-        result.push_back(std::string(readString(data, pos)));
+        result.push_back(readString(data, pos));
     }
     return result;
 }
 
-static std::vector<std::filesystem::path> readPathList(std::string_view data, size_t& pos)
+static std::string_view readStringId(std::string_view data, size_t& pos, const std::vector<std::string_view>& strings)
+{
+    uint32_t id = readUInt(data, pos);
+    if(id >= strings.size())
+    {
+        throw std::runtime_error("String index out of bounds.");
+    }
+    return strings[id];
+}
+
+static std::vector<std::filesystem::path> readPathIdList(std::string_view data, size_t& pos, const std::vector<std::string_view>& strings)
 {
     uint32_t size = readUInt(data, pos);
     std::vector<std::filesystem::path> result;
-    result.reserve(size);
+    result.reserve(std::min<size_t>(size, data.size()));
     for(uint32_t i=0; i < size; ++i)
     {
-        result.push_back(std::filesystem::path(readString(data, pos)));
+        result.push_back(std::filesystem::path(readStringId(data, pos, strings)));
     }
     return result;
 }
 
-static std::vector<CommandId> readIdList(std::string_view data, size_t& pos)
+template<typename T>
+static void readColumn(std::string_view data, size_t& pos, std::vector<T>& column, size_t size)
 {
-    uint32_t size = readUInt(data, pos);
-    std::vector<CommandId> result;
-    result.resize(size);
-    readData(data, pos, (char*)result.data(), sizeof(CommandId) * size);
-    return result;
+    size_t padding = (COLUMN_ALIGNMENT - pos % COLUMN_ALIGNMENT) % COLUMN_ALIGNMENT;
+    if(data.size() < pos + padding || (data.size() - pos - padding) / sizeof(T) < size)
+    {
+        throw std::runtime_error("Reading past the end of input.");
+    }
+    pos += padding;
+    column.resize(size);
+    readData(data, pos, reinterpret_cast<char*>(column.data()), sizeof(T) * size);
 }
 
-static DepFile readDepFile(std::string_view data, size_t& pos)
+static void readAdjacencyList(std::string_view data, size_t& pos, AdjacencyList& list, size_t nodes, size_t idLimit)
+{
+    uint32_t edges = readUInt(data, pos);
+    readColumn(data, pos, list.offsets(), nodes + 1);
+    readColumn(data, pos, list.ids(), edges);
+
+    auto& offsets = list.offsets();
+    if(offsets.front() != 0 || offsets.back() != edges || !std::is_sorted(offsets.begin(), offsets.end()))
+    {
+        throw std::runtime_error("Invalid edge offsets.");
+    }
+    for(auto id : list.ids())
+    {
+        if(id >= idLimit)
+        {
+            throw std::runtime_error("Dependency index out of bounds.");
+        }
+    }
+}
+
+static DepFile readDepFile(std::string_view data, size_t& pos, const std::vector<std::string_view>& strings)
 {
     DepFile result;
-    result.path = readString(data, pos);
+    result.path = readStringId(data, pos, strings);
     if(!result.path.empty())
     {
         uint32_t format = readUInt(data, pos);
@@ -174,6 +303,45 @@ static DepFile readDepFile(std::string_view data, size_t& pos)
     return result;
 }
 
+static ModuleScan readModuleScan(std::string_view data, size_t& pos, const std::vector<std::string_view>& strings)
+{
+    ModuleScan result;
+    result.path = readStringId(data, pos, strings);
+    if(result)
+    {
+        result.moduleOutput = readStringId(data, pos, strings);
+        result.mapFile = readStringId(data, pos, strings);
+        uint32_t format = readUInt(data, pos);
+        switch (format)
+        {
+        case ModuleScan::Format::Clang:
+            result.format = ModuleScan::Format::Clang;
+            break;
+        case ModuleScan::Format::GCC:
+            result.format = ModuleScan::Format::GCC;
+            break;
+        default:
+            throw std::runtime_error("Unknown module scan format for " + result.path.string() + ".");
+        }
+    }
+    return result;
+}
+
+static DiscoveredDependencies readDiscoveredDependencies(std::string_view data, size_t& pos, const std::vector<std::string_view>& strings)
+{
+    DiscoveredDependencies result;
+    result.inputs = readPathIdList(data, pos, strings);
+    result.outputs = readPathIdList(data, pos, strings);
+    uint32_t count = readUInt(data, pos);
+    result.dependentInputs.reserve(count);
+    for(uint32_t i = 0; i < count; ++i)
+    {
+        std::filesystem::path command = readStringId(data, pos, strings);
+        result.dependentInputs.emplace_back(std::move(command), readStringId(data, pos, strings));
+    }
+    return result;
+}
+
 Signature computeCommandSignature(const CommandEntry& command)
 {
     hash::Md5 hasher;
@@ -188,6 +356,16 @@ Signature computeCommandSignature(const CommandEntry& command)
     {
         hasher.digest(reinterpret_cast<const char*>(output.native().data()), output.native().size() * sizeof(std::filesystem::path::string_type::value_type));
     }
+    if(command.moduleScan)
+    {
+        hasher.digest(command.moduleScan.path.string());
+        hasher.digest(command.moduleScan.moduleOutput.string());
+        hasher.digest(command.moduleScan.mapFile.string());
+    }
+    if(!command.dyndepFile.empty())
+    {
+        hasher.digest(command.dyndepFile.string());
+    }
     return hasher.finalize();
 }
 
@@ -196,28 +374,37 @@ Database::Database()
 
 bool Database::load(std::filesystem::path path)
 {
+    trace::Scope traceScope("Load database");
+
     try
     {
         _commands.clear();
         _commandDependencies.clear();
         _commandSignatures.clear();
-        _fileDependencies.clear();
+        _discovered.clear();
+        _filePaths.clear();
+        _fileSignatures.clear();
+        _fileDependents.clear();
+        _directoryPaths.clear();
+        _directorySignatures.clear();
+        _directoryFiles.clear();
+        _changeDetectionState.clear();
 
         if(!std::filesystem::exists(path.string() + ".commands"))
         {
             return false;
         }
 
-        // TODO: Memory map the inputs?
-        _commandData = readFile(path.string() + ".commands");
-        if(_commandData.size() == 0)
+        // Only parsed here, since every command copies its strings out of the string table
+        std::string commandData = readFile(path.string() + ".commands");
+        if(commandData.size() == 0)
         {
             return false;
         }
 
         size_t pos = 0;
         Header loadedHeader = {};
-        readData(_commandData, pos, (char*)(&loadedHeader), sizeof(Header));
+        readData(commandData, pos, (char*)(&loadedHeader), sizeof(Header));
         Header referenceHeader = {};
         if(std::memcmp(&referenceHeader, &loadedHeader, sizeof(Header)) != 0)
         {
@@ -225,31 +412,36 @@ bool Database::load(std::filesystem::path path)
         }
 
 
-        uint32_t numCommands = readUInt(_commandData, pos);
+        auto strings = readStringTable(commandData, pos);
+
+        uint32_t numCommands = readUInt(commandData, pos);
         _commands.reserve(numCommands);
-        _commandDependencies.resize(numCommands);
-        _commandSignatures.reserve(numCommands);
-        _depFileSignatures.reserve(numCommands);
         for(uint32_t index = 0; index < numCommands; ++index)
         {
             CommandEntry command;
-            // TODO: Reference into the loaded command data instead of copying
-            command.command = readString(_commandData, pos);
-            command.description = readString(_commandData, pos);
-            command.workingDirectory = readString(_commandData, pos);
-            command.depFile = readDepFile(_commandData, pos);
-            command.rspFile = readString(_commandData, pos);
-            command.rspContents = readString(_commandData, pos);
-            command.inputs = readPathList(_commandData, pos);
-            command.outputs = readPathList(_commandData, pos);
-            _commandSignatures.push_back(readSignature(_commandData, pos));
-            _depFileSignatures.push_back(readSignature(_commandData, pos));
-
-            _commandDependencies[index] = readIdList(_commandData, pos);
-            if(_commandDependencies[index].size() > numCommands)
-            {
-                throw std::runtime_error("Dependency count out of bounds.");
-            }
+            auto commandPrefix = readStringId(commandData, pos, strings);
+            auto commandSuffix = readStringId(commandData, pos, strings);
+            command.command.reserve(commandPrefix.size() + commandSuffix.size());
+            command.command += commandPrefix;
+            command.command += commandSuffix;
+            command.description = readStringId(commandData, pos, strings);
+            command.workingDirectory = readStringId(commandData, pos, strings);
+            command.depFile = readDepFile(commandData, pos, strings);
+            command.rspFile = readStringId(commandData, pos, strings);
+            command.rspContents = readStringId(commandData, pos, strings);
+            command.inputs = readPathIdList(commandData, pos, strings);
+            command.outputs = readPathIdList(commandData, pos, strings);
+            command.moduleScan = readModuleScan(commandData, pos, strings);
+            command.dyndepFile = readStringId(commandData, pos, strings);
+            _commands.push_back(std::move(command));
+            _discovered.push_back(readDiscoveredDependencies(commandData, pos, strings));
+        }
+
+        readColumn(commandData, pos, _commandSignatures, numCommands);
+        readColumn(commandData, pos, _depFileSignatures, numCommands);
+        readAdjacencyList(commandData, pos, _commandDependencies, numCommands, numCommands);
+        for(uint32_t index = 0; index < numCommands; ++index)
+        {
             for(auto dep : _commandDependencies[index])
             {
                 if(dep >= index)
@@ -257,17 +449,16 @@ bool Database::load(std::filesystem::path path)
                     throw std::runtime_error("Dependency index out of bounds.");
                 }
             }
-
-            _commands.push_back(std::move(command));
         }
     }
     catch(const std::exception& e)
     {
         std::cout << "Existing build database incompatible or corrupted. (" << e.what() << ")" << std::endl;
-        _commandData.clear();
         _commands.clear();
+        _discovered.clear();
         _commandDependencies.clear();
-        _fileDependencies.clear();
+        _commandSignatures.clear();
+        _depFileSignatures.clear();
         return false;
     }
 
@@ -290,29 +481,47 @@ bool Database::load(std::filesystem::path path)
             throw std::runtime_error("Mismatching header.");
         }
 
-        uint32_t numDependencies = readUInt(_dependencyData, pos);
-        _fileDependencies.reserve(numDependencies);
-        for(uint32_t index = 0; index < numDependencies; ++index)
+        uint32_t numFiles = readUInt(_dependencyData, pos);
+        _filePaths.reserve(std::min<size_t>(numFiles, _dependencyData.size()));
+        for(uint32_t index = 0; index < numFiles; ++index)
         {
-            FileDependencies fileDeps;
-            // TODO: Reference into the loaded command data instead of copying
-            fileDeps.path = readString(_dependencyData, pos);
-            fileDeps.dependentCommands = readIdList(_dependencyData, pos);
-            for(auto dep : fileDeps.dependentCommands)
-            {
-                if(dep >= _commands.size())
-                {
-                    throw std::runtime_error("Dependency index out of bounds.");
-                }
-            }
-            fileDeps.signaturePair.first = readSignature(_dependencyData, pos);
-            fileDeps.signaturePair.second = readSignature(_dependencyData, pos);
-            _fileDependencies.push_back(std::move(fileDeps));
+            _filePaths.push_back(std::filesystem::path(readString(_dependencyData, pos)));
+        }
+        readColumn(_dependencyData, pos, _fileSignatures, numFiles);
+        readAdjacencyList(_dependencyData, pos, _fileDependents, numFiles, _commands.size());
+
+        uint32_t numDirectories = readUInt(_dependencyData, pos);
+        _directoryPaths.reserve(std::min<size_t>(numDirectories, _dependencyData.size()));
+        for(uint32_t index = 0; index < numDirectories; ++index)
+        {
+            _directoryPaths.push_back(std::filesystem::path(readString(_dependencyData, pos)));
+        }
+        readColumn(_dependencyData, pos, _directorySignatures, numDirectories);
+        readAdjacencyList(_dependencyData, pos, _directoryFiles, numDirectories, numFiles);
+
+        // A file outside of every directory would never be checked
+        std::vector<bool> covered(numFiles, false);
+        for(auto file : _directoryFiles.ids())
+        {
+            covered[file] = true;
         }
+        if(_directoryFiles.ids().size() != numFiles || std::find(covered.begin(), covered.end(), false) != covered.end())
+        {
+            throw std::runtime_error("Files missing from directories.");
+        }
+
+        _changeDetectionState = readBlob(_dependencyData, pos);
     }
     catch(const std::exception& e)
     {
         std::cout << "Existing dependency database incompatible or corrupted. (" << e.what() << ")" << std::endl;
+        _filePaths.clear();
+        _fileSignatures.clear();
+        _fileDependents.clear();
+        _directoryPaths.clear();
+        _directorySignatures.clear();
+        _directoryFiles.clear();
+        _changeDetectionState.clear();
         rebuildFileDependencies();
     }
     
@@ -321,27 +530,53 @@ bool Database::load(std::filesystem::path path)
 
 void Database::save(std::filesystem::path path)
 {
-    {
-        std::ofstream commandFile(path.string() + ".commands", std::ios::binary);
-        Header header;
-        commandFile.write(reinterpret_cast<const char*>(&header), sizeof(Header));
+    trace::Scope traceScope("Save database");
 
-        writeUInt(commandFile, _commands.size());
+    {
+        // Commands refer to strings by index, so the table has to be complete before it's
+        // written out ahead of them.
+        StringTable strings;
+        // Roughly the number of distinct strings in a compile command
+        strings.reserve(_commands.size() * 6);
+        std::ostringstream commandStream;
+        writeUInt(commandStream, _commands.size());
+        std::string_view previousCommand;
+        std::string_view previousPrefix;
+        StringTable::Id previousPrefixId = strings.addView({});
         for(uint32_t index = 0; index < _commands.size(); ++index)
         {
             auto& command = _commands[index];
-            writeString(commandFile, command.command);
-            writeString(commandFile, command.description);
-            writeString(commandFile, command.workingDirectory.string());
-            writeDepFile(commandFile, command.depFile);
-            writeString(commandFile, command.rspFile.string());
-            writeString(commandFile, command.rspContents);
-            writePathList(commandFile, command.inputs);
-            writePathList(commandFile, command.outputs);
-            writeSignature(commandFile, _commandSignatures[index]);
-            writeSignature(commandFile, _depFileSignatures[index]);
-            writeIdList(commandFile, _commandDependencies[index]);
+            std::string_view commandString = command.command;
+            auto prefixLength = getSharedCommandPrefix(commandString, previousCommand, previousPrefix);
+            previousCommand = commandString;
+            if(prefixLength != previousPrefix.size())
+            {
+                previousPrefix = commandString.substr(0, prefixLength);
+                previousPrefixId = strings.addView(previousPrefix);
+            }
+            writeUInt(commandStream, previousPrefixId);
+            writeUInt(commandStream, strings.addView(commandString.substr(prefixLength)));
+            writeStringId(commandStream, strings, command.description);
+            writePathId(commandStream, strings, command.workingDirectory);
+            writeDepFile(commandStream, strings, command.depFile);
+            writePathId(commandStream, strings, command.rspFile);
+            writeStringId(commandStream, strings, command.rspContents);
+            writePathIdList(commandStream, strings, command.inputs);
+            writePathIdList(commandStream, strings, command.outputs);
+            writeModuleScan(commandStream, strings, command.moduleScan);
+            writePathId(commandStream, strings, command.dyndepFile);
+            writeDiscoveredDependencies(commandStream, strings, _discovered[index]);
         }
+
+        std::ofstream commandFile(path.string() + ".commands", std::ios::binary);
+        Header header;
+        commandFile.write(reinterpret_cast<const char*>(&header), sizeof(Header));
+        writeStringTable(commandFile, strings);
+        auto commandData = commandStream.str();
+        commandFile.write(commandData.data(), commandData.size());
+        writeColumn(commandFile, _commandSignatures);
+        writeColumn(commandFile, _depFileSignatures);
+        writeAdjacencyList(commandFile, _commandDependencies);
     }
 
     {
@@ -349,26 +584,71 @@ void Database::save(std::filesystem::path path)
         Header header;
         dependencyFile.write(reinterpret_cast<const char*>(&header), sizeof(Header));
 
-        writeUInt(dependencyFile, _fileDependencies.size());
-        for(uint32_t index = 0; index < _fileDependencies.size(); ++index)
+        writeUInt(dependencyFile, _filePaths.size());
+        for(auto& path : _filePaths)
+        {
+            writeString(dependencyFile, path.string());
+        }
+        writeColumn(dependencyFile, _fileSignatures);
+        writeAdjacencyList(dependencyFile, _fileDependents);
+
+        writeUInt(dependencyFile, _directoryPaths.size());
+        for(auto& path : _directoryPaths)
         {
-            auto& fileDeps = _fileDependencies[index];
-            writeString(dependencyFile, fileDeps.path.string());
-            writeIdList(dependencyFile, fileDeps.dependentCommands);
-            writeSignature(dependencyFile, fileDeps.signaturePair.first);
-            writeSignature(dependencyFile, fileDeps.signaturePair.second);
+            writeString(dependencyFile, path.string());
         }
+        writeColumn(dependencyFile, _directorySignatures);
+        writeAdjacencyList(dependencyFile, _directoryFiles);
+
+        writeBlob(dependencyFile, _changeDetectionState);
     }
 }
 
-const std::vector<CommandDependencies>& Database::getCommandDependencies() const
+const AdjacencyList& Database::getCommandDependencies() const
 {
     return _commandDependencies;
 }
 
-std::vector<FileDependencies>& Database::getFileDependencies()
+const std::vector<std::filesystem::path>& Database::getFilePaths() const
+{
+    return _filePaths;
+}
+
+std::vector<SignaturePair>& Database::getFileSignatures()
 {
-    return _fileDependencies;
+    return _fileSignatures;
+}
+
+const AdjacencyList& Database::getFileDependents() const
+{
+    return _fileDependents;
+}
+
+const std::vector<std::filesystem::path>& Database::getDirectoryPaths() const
+{
+    return _directoryPaths;
+}
+
+std::vector<Signature>& Database::getDirectorySignatures()
+{
+    return _directorySignatures;
+}
+
+const AdjacencyList& Database::getDirectoryFiles() const
+{
+    return _directoryFiles;
+}
+
+std::string& Database::getChangeDetectionState()
+{
+    return _changeDetectionState;
+}
+
+void Database::addFileDependency(std::filesystem::path path, SignaturePair signaturePair)
+{
+    _filePaths.push_back(std::move(path));
+    _fileSignatures.push_back(signaturePair);
+    _fileDependents.addNode((const CommandId*)nullptr, (const CommandId*)nullptr);
 }
 
 const std::vector<CommandEntry>& Database::getCommands() const
@@ -386,8 +666,37 @@ std::vector<Signature>& Database::getDepFileSignatures()
     return _depFileSignatures;
 }
 
+const std::vector<DiscoveredDependencies>& Database::getDiscoveredDependencies() const
+{
+    return _discovered;
+}
+
+bool Database::setDiscoveredDependencies(const std::vector<std::pair<CommandId, DiscoveredDependencies>>& discovered)
+{
+    bool changed = false;
+    for(auto& [command, dependencies] : discovered)
+    {
+        if(_discovered[command] != dependencies)
+        {
+            _discovered[command] = dependencies;
+            changed = true;
+        }
+    }
+    if(!changed)
+    {
+        return false;
+    }
+
+    // New edges can change the order commands have to be in, so the graph is set up from
+    // scratch. Signatures and discovered inputs are carried over as the commands are the same.
+    setCommands(_commands);
+    return true;
+}
+
 void Database::setCommands(std::vector<CommandEntry> commands)
 {
+    trace::Scope traceScope("Set commands");
+
     if(commands.size() >= UINT32_MAX)
     {
         throw std::runtime_error(std::to_string(commands.size()) + " is a lot of commands.");
@@ -399,12 +708,24 @@ void Database::setCommands(std::vector<CommandEntry> commands)
         bool dirty = false;
         bool included = false;
         int depth = 0;
-        CommandDependencies dependencies;
+        std::vector<CommandId> dependencies;
     };
 
     std::vector<CommandSortProxy> sortProxies;
     sortProxies.reserve(commands.size());
 
+    // Dependencies discovered by earlier builds stay with the commands that haven't changed
+    std::unordered_map<Signature, DiscoveredDependencies> previousDiscovered;
+    for(size_t index = 0; index < _discovered.size(); ++index)
+    {
+        if(!_discovered[index].empty())
+        {
+            previousDiscovered.emplace(computeCommandSignature(_commands[index]), std::move(_discovered[index]));
+        }
+    }
+    std::vector<DiscoveredDependencies> discovered(commands.size());
+
+    paths::NormalizationCache pathCache;
     std::unordered_map<std::filesystem::path, CommandId, PathHash> commandMap;
     for(uint32_t i=0; i<commands.size(); ++i)
     {
@@ -413,13 +734,46 @@ void Database::setCommands(std::vector<CommandEntry> commands)
 
         for(auto& output : command.outputs)
         {
-            output = std::filesystem::absolute(output).lexically_normal().string();
+            output = pathCache.absoluteNormal(output);
             commandMap[output] = i;
         }
 
         for(auto& input : command.inputs)
         {
-            input = std::filesystem::absolute(input).lexically_normal().string();
+            input = pathCache.absoluteNormal(input);
+        }
+
+        if(command.moduleScan)
+        {
+            command.moduleScan.path = pathCache.absoluteNormal(command.moduleScan.path);
+            if(!command.moduleScan.moduleOutput.empty())
+            {
+                command.moduleScan.moduleOutput = pathCache.absoluteNormal(command.moduleScan.moduleOutput);
+            }
+            command.moduleScan.mapFile = pathCache.absoluteNormal(command.moduleScan.mapFile);
+        }
+
+        if(!command.dyndepFile.empty())
+        {
+            command.dyndepFile = pathCache.absoluteNormal(command.dyndepFile);
+        }
+
+        if(!previousDiscovered.empty())
+        {
+            auto it = previousDiscovered.find(computeCommandSignature(command));
+            if(it != previousDiscovered.end())
+            {
+                discovered[i] = std::move(it->second);
+            }
+        }
+    }
+
+    // Outputs from dyndep manifests come after the declared ones, which win any clashes
+    for(uint32_t i=0; i<commands.size(); ++i)
+    {
+        for(auto& output : discovered[i].outputs)
+        {
+            commandMap.emplace(output, i);
         }
     }
 
@@ -427,12 +781,29 @@ void Database::setCommands(std::vector<CommandEntry> commands)
     {
         auto& command = commands[sortProxy.id];
         sortProxy.dependencies.reserve(command.inputs.size());
-        for(auto& input : command.inputs)
+        for(auto* inputs : {&command.inputs, &discovered[sortProxy.id].inputs})
         {
-            auto it = commandMap.find(input);
-            if(it != commandMap.end())
+            for(auto& input : *inputs)
             {
-                sortProxy.dependencies.push_back(it->second);
+                auto it = commandMap.find(input);
+                if(it != commandMap.end())
+                {
+                    sortProxy.dependencies.push_back(it->second);
+                }
+            }
+        }
+    }
+
+    // Proxies are still in command order here
+    for(uint32_t i=0; i<commands.size(); ++i)
+    {
+        for(auto& [command, input] : discovered[i].dependentInputs)
+        {
+            auto consumer = commandMap.find(command);
+            auto producer = commandMap.find(input);
+            if(consumer != commandMap.end() && producer != commandMap.end() && consumer->second != producer->second)
+            {
+                sortProxies[consumer->second].dependencies.push_back(producer->second);
             }
         }
     }
@@ -474,16 +845,25 @@ void Database::setCommands(std::vector<CommandEntry> commands)
         }
     }
 
-    std::sort(sortProxies.begin(), sortProxies.end(), [](const auto& a, const auto& b) { return a.depth > b.depth; });
+    // Stable, so commands of a project stay together (which the string table in save relies on)
+    std::stable_sort(sortProxies.begin(), sortProxies.end(), [](const auto& a, const auto& b) { return a.depth > b.depth; });
 
     std::vector<CommandId> idRemap;
     idRemap.resize(commands.size());
 
+    size_t edgeCount = 0;
+    for(auto& sortProxy : sortProxies)
+    {
+        edgeCount += sortProxy.dependencies.size();
+    }
+
     _commands.clear();
+    _discovered.clear();
     _depFileSignatures.clear();
     _commands.reserve(commands.size());
+    _discovered.reserve(commands.size());
     _commandDependencies.clear();
-    _commandDependencies.reserve(commands.size());
+    _commandDependencies.reserve(commands.size(), edgeCount);
     
     {
         CommandId id = 0;
@@ -492,11 +872,12 @@ void Database::setCommands(std::vector<CommandEntry> commands)
             idRemap[sortProxy.id] = id;
             ++id;
             _commands.push_back(std::move(commands[sortProxy.id]));
-            _commandDependencies.push_back(std::move(sortProxy.dependencies));
-            for(auto& dependency : _commandDependencies.back())
+            _discovered.push_back(std::move(discovered[sortProxy.id]));
+            for(auto& dependency : sortProxy.dependencies)
             {
                 dependency = idRemap[dependency];
             }
+            _commandDependencies.addNode(sortProxy.dependencies.begin(), sortProxy.dependencies.end());
         }
     }
 
@@ -519,89 +900,199 @@ void Database::setCommands(std::vector<CommandEntry> commands)
     std::unordered_set<Signature> existingSignatures;
     existingSignatures.insert(_commandSignatures.begin(), _commandSignatures.end());
     _commandSignatures.clear();
-    _commandSignatures.reserve(_commands.size());
-    for(auto& command : _commands)
+    _commandSignatures.resize(_commands.size());
+    parallelFor(_commands.size(), 0, [this, &existingSignatures](size_t begin, size_t end)
     {
-        auto signature = computeCommandSignature(command);
-        if(existingSignatures.find(signature) != existingSignatures.end())
+        for(size_t index = begin; index < end; ++index)
         {
-            _commandSignatures.push_back(signature);
-        }
-        else
-        {
-            _commandSignatures.push_back(Signature{});
+            auto signature = computeCommandSignature(_commands[index]);
+            if(existingSignatures.find(signature) != existingSignatures.end())
+            {
+                _commandSignatures[index] = signature;
+            }
         }
-    }
+    });
 
     rebuildFileDependencies();
 }
 
 void Database::rebuildFileDependencies()
 {
-    std::unordered_set<std::filesystem::path, PathHash> outputs;
-    for(size_t index = 0; index < _commands.size(); ++index)
-    {
-        for(auto& output : _commands[index].outputs)
-        {
-            outputs.insert(output);
-        }
-    }
+    trace::Scope traceScope("Rebuild file dependencies");
 
+    // Reading and parsing the dep files is the expensive part, and independent per command,
+    // so that is done in parallel. The results are merged serially in command order to keep
+    // the resulting dependency lists deterministic.
+    std::vector<std::vector<std::filesystem::path>> depFilePaths;
+    depFilePaths.resize(_commands.size());
     _depFileSignatures.clear();
-    _depFileSignatures.reserve(_commands.size());
-
-    std::unordered_map<std::filesystem::path, std::vector<uint32_t>, PathHash> depCommands;
-    for(size_t index = 0; index < _commands.size(); ++index)
+    _depFileSignatures.resize(_commands.size());
+    paths::NormalizationCache pathCache;
+    parallelFor(_commands.size(), 0, [this, &depFilePaths, &pathCache](size_t begin, size_t end)
     {
-        auto& command = _commands[index];
-        Signature depFileSignature = {};
-        if(command.depFile)
+        for(size_t index = begin; index < end; ++index)
         {
+            auto& command = _commands[index];
+            if(!command.depFile)
+            {
+                continue;
+            }
+
             std::string depContents;
             if(std::filesystem::exists(command.depFile))
             {
                 depContents = readFile(command.depFile);                
             }
-            depFileSignature = hash::md5(depContents);
-            // parseDependencyData is destructive, so do the hash first
-            parseDependencyData(depContents, [&outputs, &depCommands, index](std::string_view pathStr) {
-                auto path = std::filesystem::absolute(pathStr).lexically_normal();
-                if(outputs.find(path) == outputs.end())
-                {
-                    depCommands[path].push_back(index);
-                }
+            _depFileSignatures[index] = hash::md5(depContents);
+            parseDependencyData(depContents, [&paths = depFilePaths[index], &pathCache](std::string_view pathStr) {
+                paths.push_back(pathCache.absoluteNormal(pathStr));
                 return false;
             });
         }
-        _depFileSignatures.push_back(depFileSignature);
+    });
 
-        for(auto& input : command.inputs)
+    std::unordered_map<std::filesystem::path, SignaturePair, PathHash> existingSignatures;
+    existingSignatures.reserve(_filePaths.size());
+    for(size_t index = 0; index < _filePaths.size(); ++index)
+    {
+        existingSignatures.emplace(std::move(_filePaths[index]), _fileSignatures[index]);
+    }
+    _filePaths.clear();
+    _fileSignatures.clear();
+
+    // Files are numbered in order of first use, and the edges collected as (file, command)
+    // pairs, which are then bucketed by file into the flat edge list. Outputs of other
+    // commands aren't file dependencies, and are in the same map so each path is only
+    // looked up once.
+    static constexpr uint32_t OUTPUT_INDEX = UINT32_MAX;
+    std::unordered_map<std::filesystem::path, uint32_t, PathHash> fileIndices;
+    bool anyDependentInputs = false;
+    for(CommandId index = 0; index < _commands.size(); ++index)
+    {
+        for(auto* outputs : {&_commands[index].outputs, &_discovered[index].outputs})
         {
-            if(outputs.find(input) == outputs.end())
+            for(auto& output : *outputs)
             {
-                depCommands[input].push_back(index);
+                fileIndices.emplace(output, OUTPUT_INDEX);
             }
         }
+        anyDependentInputs = anyDependentInputs || !_discovered[index].dependentInputs.empty();
     }
 
-    std::unordered_map<std::filesystem::path, SignaturePair, PathHash> existingSignatures;
-    for(auto& dep : _fileDependencies)
+    std::vector<std::pair<uint32_t, CommandId>> edges;
+    auto addEdge = [&](const std::filesystem::path& path, CommandId command)
+    {
+        auto [it, inserted] = fileIndices.try_emplace(path, (uint32_t)_filePaths.size());
+        if(inserted)
+        {
+            _filePaths.push_back(path);
+        }
+        else if(it->second == OUTPUT_INDEX)
+        {
+            return;
+        }
+        edges.push_back({it->second, command});
+    };
+    for(CommandId index = 0; index < _commands.size(); ++index)
+    {
+        for(auto& path : depFilePaths[index])
+        {
+            addEdge(path, index);
+        }
+        for(auto* inputs : {&_commands[index].inputs, &_discovered[index].inputs})
+        {
+            for(auto& input : *inputs)
+            {
+                addEdge(input, index);
+            }
+        }
+    }
+
+    // Inputs dyndep manifests give other commands are file dependencies of those commands
+    if(anyDependentInputs)
+    {
+        std::unordered_map<std::filesystem::path, CommandId, PathHash> producers;
+        for(CommandId index = 0; index < _commands.size(); ++index)
+        {
+            for(auto& output : _commands[index].outputs)
+            {
+                producers.emplace(output, index);
+            }
+        }
+        for(auto& discovered : _discovered)
+        {
+            for(auto& [command, input] : discovered.dependentInputs)
+            {
+                auto it = producers.find(command);
+                if(it != producers.end())
+                {
+                    addEdge(input, it->second);
+                }
+            }
+        }
+        std::stable_sort(edges.begin(), edges.end(), [](auto& a, auto& b) { return a.second < b.second; });
+    }
+
+    _fileSignatures.resize(_filePaths.size());
+    for(size_t index = 0; index < _filePaths.size(); ++index)
     {
-        existingSignatures[dep.path] = dep.signaturePair;
+        auto it = existingSignatures.find(_filePaths[index]);
+        if(it != existingSignatures.end())
+        {
+            _fileSignatures[index] = it->second;
+        }
     }
 
-    _fileDependencies.clear();
-    _fileDependencies.reserve(depCommands.size());
+    // Edges are in command order, which keeps each file's dependents sorted
+    _fileDependents.assign(_filePaths.size(), edges);
 
-    for(auto& entry : depCommands)
+    rebuildDirectories();
+}
+
+void Database::rebuildDirectories()
+{
+    std::unordered_map<std::filesystem::path, Signature, PathHash> existingSignatures;
+    existingSignatures.reserve(_directoryPaths.size());
+    for(size_t index = 0; index < _directoryPaths.size(); ++index)
+    {
+        existingSignatures.emplace(std::move(_directoryPaths[index]), _directorySignatures[index]);
+    }
+    _directoryPaths.clear();
+    _directorySignatures.clear();
+
+    // Files mostly come directory by directory, so comparing with the previous file's
+    // directory first avoids most lookups.
+    std::unordered_map<std::filesystem::path, uint32_t, PathHash> directoryIndices;
+    std::vector<std::pair<uint32_t, uint32_t>> edges;
+    edges.reserve(_filePaths.size());
+    std::filesystem::path previousDirectory;
+    uint32_t previousIndex = 0;
+    for(uint32_t file = 0; file < _filePaths.size(); ++file)
     {
-        SignaturePair signaturePair = {};
-        auto it = existingSignatures.find(entry.first);
+        auto directory = _filePaths[file].parent_path();
+        if(_directoryPaths.empty() || directory != previousDirectory)
+        {
+            auto [it, inserted] = directoryIndices.try_emplace(directory, (uint32_t)_directoryPaths.size());
+            if(inserted)
+            {
+                _directoryPaths.push_back(directory);
+            }
+            previousIndex = it->second;
+            previousDirectory = std::move(directory);
+        }
+        edges.push_back({previousIndex, file});
+    }
+
+    _directorySignatures.resize(_directoryPaths.size());
+    for(size_t index = 0; index < _directoryPaths.size(); ++index)
+    {
+        auto it = existingSignatures.find(_directoryPaths[index]);
         if(it != existingSignatures.end())
         {
-            signaturePair = it->second;
+            _directorySignatures[index] = it->second;
         }
-        _fileDependencies.push_back({std::move(entry.first), std::move(entry.second), signaturePair});
     }
+
+    _directoryFiles.assign(_directoryPaths.size(), edges);
 }
 
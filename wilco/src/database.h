@@ -23,18 +23,127 @@ struct std::hash<Signature>
     }
 };
 
-// TODO: Better data structure for this
-struct FileDependencies
+// Edges of a graph in compressed sparse row form. The edges of node i are stored
+// contiguously in ids, from offsets[i] up to offsets[i+1], so walking the graph
+// touches two flat arrays instead of a separate allocation per node.
+class AdjacencyList
 {
-    std::filesystem::path path;
-    std::vector<CommandId> dependentCommands;
-    SignaturePair signaturePair;
-};
+public:
+    struct Range
+    {
+        const CommandId* first;
+        const CommandId* last;
+
+        const CommandId* begin() const { return first; }
+        const CommandId* end() const { return last; }
+        size_t size() const { return last - first; }
+        bool empty() const { return first == last; }
+    };
+
+    AdjacencyList()
+        : _offsets{0}
+    { }
+
+    Range operator[](size_t node) const
+    {
+        return { _ids.data() + _offsets[node], _ids.data() + _offsets[node + 1] };
+    }
+
+    // Number of nodes
+    size_t size() const
+    {
+        return _offsets.size() - 1;
+    }
+
+    void clear()
+    {
+        _offsets.assign(1, 0);
+        _ids.clear();
+    }
+
+    void reserve(size_t nodes, size_t edges)
+    {
+        _offsets.reserve(nodes + 1);
+        _ids.reserve(edges);
+    }
+
+    // Adds a node with the given edges, returning its index.
+    template<typename Iterator>
+    size_t addNode(Iterator begin, Iterator end)
+    {
+        _ids.insert(_ids.end(), begin, end);
+        _offsets.push_back((uint32_t)_ids.size());
+        return _offsets.size() - 2;
+    }
+
+    // Replaces all nodes, from (node, id) pairs. Each node keeps its ids in the order given.
+    void assign(size_t nodes, const std::vector<std::pair<uint32_t, CommandId>>& edges)
+    {
+        _offsets.assign(nodes + 1, 0);
+        for(auto& edge : edges)
+        {
+            ++_offsets[edge.first + 1];
+        }
+        for(size_t node = 1; node < _offsets.size(); ++node)
+        {
+            _offsets[node] += _offsets[node - 1];
+        }
+
+        _ids.resize(edges.size());
+        std::vector<uint32_t> fill(_offsets.begin(), _offsets.end() - 1);
+        for(auto& edge : edges)
+        {
+            _ids[fill[edge.first]++] = edge.second;
+        }
+    }
 
-using CommandDependencies = std::vector<CommandId>;
+    // Direct access to the columns, for serialization.
+    std::vector<uint32_t>& offsets() { return _offsets; }
+    const std::vector<uint32_t>& offsets() const { return _offsets; }
+    std::vector<CommandId>& ids() { return _ids; }
+    const std::vector<CommandId>& ids() const { return _ids; }
+
+    bool operator ==(const AdjacencyList& other) const
+    {
+        return _offsets == other._offsets && _ids == other._ids;
+    }
+
+private:
+    std::vector<uint32_t> _offsets;
+    std::vector<CommandId> _ids;
+};
 
 Signature computeCommandSignature(const CommandEntry& command);
 
+// Edges of a command only known once it has run. They order commands like declared inputs
+// and outputs do.
+struct DiscoveredDependencies
+{
+    // Inputs the command found for itself, such as the modules it imports
+    std::vector<std::filesystem::path> inputs;
+    // From the command's dyndep manifest: outputs besides the declared ones, and inputs
+    // of other commands, each identified by one of its outputs
+    std::vector<std::filesystem::path> outputs;
+    std::vector<std::pair<std::filesystem::path, std::filesystem::path>> dependentInputs;
+
+    bool empty() const
+    {
+        return inputs.empty() && outputs.empty() && dependentInputs.empty();
+    }
+
+    bool operator ==(const DiscoveredDependencies& other) const
+    {
+        return inputs == other.inputs && outputs == other.outputs && dependentInputs == other.dependentInputs;
+    }
+
+    bool operator !=(const DiscoveredDependencies& other) const
+    {
+        return !(*this == other);
+    }
+};
+
+// Commands, the files they depend on and the edges between them. Per command and
+// per file data is kept in separate columns indexed by CommandId and file index.
 class Database
 {
 public:
@@ -46,19 +155,53 @@ public:
     void setCommands(std::vector<CommandEntry> commands);
 
     void rebuildFileDependencies();
+    // Adds a file no command depends on yet, to carry its signature over to the
+    // next rebuildFileDependencies. Until then it isn't part of any directory.
+    void addFileDependency(std::filesystem::path path, SignaturePair signaturePair);
 
-    const std::vector<CommandDependencies>& getCommandDependencies() const;
     const std::vector<CommandEntry>& getCommands() const;
+    // Commands each command depends on, which always have lower ids.
+    const AdjacencyList& getCommandDependencies() const;
     std::vector<Signature>& getCommandSignatures();
     std::vector<Signature>& getDepFileSignatures();
-    std::vector<FileDependencies>& getFileDependencies();
+
+    // Dependencies of each command found while building. They stay with commands that are
+    // unchanged when commands are set again.
+    const std::vector<DiscoveredDependencies>& getDiscoveredDependencies() const;
+    // Replaces the discovered dependencies of the given commands. If any changed, the graph
+    // is set up again, which changes command ids. Returns true in that case.
+    bool setDiscoveredDependencies(const std::vector<std::pair<CommandId, DiscoveredDependencies>>& discovered);
+
+    const std::vector<std::filesystem::path>& getFilePaths() const;
+    std::vector<SignaturePair>& getFileSignatures();
+    // Commands depending on each file.
+    const AdjacencyList& getFileDependents() const;
+
+    // Every file belongs to the directory containing it. A directory's signature is
+    // its own modification time, as of the last time all its files were checked.
+    const std::vector<std::filesystem::path>& getDirectoryPaths() const;
+    std::vector<Signature>& getDirectorySignatures();
+    // Files in each directory.
+    const AdjacencyList& getDirectoryFiles() const;
+
+    // Whatever a change detection source needs to remember about the state files were
+    // last checked in, saved along with their signatures.
+    std::string& getChangeDetectionState();
 
 private:
+    void rebuildDirectories();
+
     std::vector<CommandEntry> _commands;
-    std::vector<CommandDependencies> _commandDependencies;
-    std::vector<FileDependencies> _fileDependencies;
+    AdjacencyList _commandDependencies;
     std::vector<Signature> _commandSignatures;
     std::vector<Signature> _depFileSignatures;
-    std::string _commandData;
+    std::vector<DiscoveredDependencies> _discovered;
+    std::vector<std::filesystem::path> _filePaths;
+    std::vector<SignaturePair> _fileSignatures;
+    AdjacencyList _fileDependents;
+    std::vector<std::filesystem::path> _directoryPaths;
+    std::vector<Signature> _directorySignatures;
+    AdjacencyList _directoryFiles;
+    std::string _changeDetectionState;
     std::string _dependencyData;
-};
\ No newline at end of file
+};
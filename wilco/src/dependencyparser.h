@@ -1,9 +1,93 @@
 #pragma once
 
+#include <algorithm>
 #include <cstring>
+#include <stdexcept>
+#include <string>
+#include <string_view>
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define WILCO_DEPENDENCY_SCAN_AVX2 1
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define WILCO_DEPENDENCY_SCAN_SSE2 1
+#endif
+
+#if _MSC_VER
+#include <intrin.h>
+#endif
+
+namespace dependencyparser
+{
+    inline unsigned countTrailingZeros(unsigned mask)
+    {
+#if _MSC_VER
+        unsigned long index;
+        _BitScanForward(&index, mask);
+        return (unsigned)index;
+#else
+        return (unsigned)__builtin_ctz(mask);
+#endif
+    }
+
+    // Finds the first occurrence of any of the needle bytes in [begin, end), returning end if none is found.
+    template<char... Needles>
+    inline const char* findFirstOfScalar(const char* begin, const char* end)
+    {
+        for(; begin != end; ++begin)
+        {
+            char c = *begin;
+            if(((c == Needles) || ...))
+            {
+                break;
+            }
+        }
+        return begin;
+    }
+
+    // Same as findFirstOfScalar, but compares a full vector register of input at a time.
+    template<char... Needles>
+    inline const char* findFirstOf(const char* begin, const char* end)
+    {
+#if WILCO_DEPENDENCY_SCAN_AVX2
+        while(end - begin >= 32)
+        {
+            __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(begin));
+            __m256i matches = _mm256_setzero_si256();
+            ((matches = _mm256_or_si256(matches, _mm256_cmpeq_epi8(chunk, _mm256_set1_epi8(Needles)))), ...);
+            unsigned mask = (unsigned)_mm256_movemask_epi8(matches);
+            if(mask)
+            {
+                return begin + countTrailingZeros(mask);
+            }
+            begin += 32;
+        }
+#elif WILCO_DEPENDENCY_SCAN_SSE2
+        while(end - begin >= 16)
+        {
+            __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(begin));
+            __m128i matches = _mm_setzero_si128();
+            ((matches = _mm_or_si128(matches, _mm_cmpeq_epi8(chunk, _mm_set1_epi8(Needles)))), ...);
+            unsigned mask = (unsigned)_mm_movemask_epi8(matches);
+            if(mask)
+            {
+                return begin + countTrailingZeros(mask);
+            }
+            begin += 16;
+        }
+#endif
+        return findFirstOfScalar<Needles...>(begin, end);
+    }
+}
+
+// Parses a gcc style make rule or an msvc /sourceDependencies json file, calling
+// callable with each dependency path. Parsing stops early if callable returns true.
+// The input is left untouched, and paths without escape sequences are passed on as
+// views directly into it. Escaped paths are unescaped into a scratch buffer, so the
+// views passed to callable are only valid for the duration of the call.
 template<typename Callable>
-bool parseDependencyData(std::string& data, Callable callable)
+bool parseDependencyData(std::string_view data, Callable callable)
 {
     auto isspace = [](char c){
         return c == ' ' || c == '\n' || c == '\r';
@@ -12,8 +96,7 @@ bool parseDependencyData(std::string& data, Callable callable)
     auto skipWhitespace = [&](){
         while(pos < data.size())
         {
-            char c = data[pos];
-            if(!isspace(data[pos]) && 
+            if(!isspace(data[pos]) &&
                 (data[pos] != '\\' || pos == data.size()-1 || !isspace(data[pos+1])))
             {
                 break;
@@ -22,86 +105,79 @@ bool parseDependencyData(std::string& data, Callable callable)
         }
     };
 
-    std::string_view spaces(" \n\r");
+    const char* const dataEnd = data.data() + data.size();
+    std::string unescaped;
+
+    // A path ends at the first whitespace not escaped by a backslash. Escaped
+    // whitespace is kept in the path, without the backslash.
     auto readGccPath = [&](){
+        if(pos >= data.size())
+        {
+            return std::string_view();
+        }
+
         size_t start = pos;
         size_t lastBreak = pos;
-        size_t offset = 0;
-        bool stop = false;
-        while(!stop)
+        bool escaped = false;
+        while(true)
         {
-            bool space = false;
-            pos = data.find_first_of(spaces, pos+1);
-            if(pos == std::string::npos)
-            {
-                pos = data.size();
-                stop = true;
-            }
-            else
-            {
-                if(data[pos-1] != '\\')
-                {
-                    stop = true;
-                }
-                else
-                {
-                    space = true;
-                }
-            }
-            if(offset > 0)
+            const char* found = dependencyparser::findFirstOf<' ', '\n', '\r'>(data.data() + pos + 1, dataEnd);
+            pos = found - data.data();
+            if(found == dataEnd || data[pos-1] != '\\')
             {
-                memmove(data.data()+lastBreak-offset, data.data()+lastBreak, pos-lastBreak);
+                break;
             }
-            if(space)
+
+            if(!escaped)
             {
-                ++offset;
+                unescaped.clear();
+                escaped = true;
             }
+            unescaped.append(data.data() + lastBreak, pos - 1 - lastBreak);
             lastBreak = pos;
         }
 
-        return std::string_view(data.data() + start, pos-offset-start);
+        if(!escaped)
+        {
+            return data.substr(start, pos - start);
+        }
+
+        unescaped.append(data.data() + lastBreak, pos - lastBreak);
+        return std::string_view(unescaped);
     };
 
     // This is a quick and ugly parser that will do the wrong thing on all escape sequences but \\ and \"
-    std::string_view escapeOrQuote("\\\"");
     auto readClPath = [&](){
         size_t start = pos;
         size_t lastBreak = pos;
-        size_t offset = 0;
-        bool stop = false;
-        while(!stop)
+        bool escaped = false;
+        while(true)
         {
-            bool escape = false;
-            pos = data.find_first_of(escapeOrQuote, pos+1);
-            if(pos == std::string::npos)
-            {
-                pos = data.size();
-                stop = true;
-            }
-            else
-            {
-                if(data[pos] == '\"')
-                {
-                    stop = true;
-                }
-                else
-                {
-                    ++pos;
-                    escape = true;
-                }
-            }
-            if(offset > 0)
+            const char* found = dependencyparser::findFirstOf<'\\', '"'>(data.data() + pos, dataEnd);
+            pos = found - data.data();
+            if(found == dataEnd || *found == '"')
             {
-                std::memmove(data.data()+lastBreak-offset, data.data()+lastBreak, pos-lastBreak);
+                break;
             }
-            if(escape)
+
+            if(!escaped)
             {
-                ++offset;
+                unescaped.clear();
+                escaped = true;
             }
-            lastBreak = pos;
+            unescaped.append(data.data() + lastBreak, pos - lastBreak);
+            // Drop the backslash and keep whatever it escaped, even if it's a quote
+            lastBreak = pos + 1;
+            pos = std::min(pos + 2, data.size());
+        }
+
+        if(!escaped)
+        {
+            return data.substr(start, pos - start);
         }
 
-        return std::string_view(data.data() + start, pos-offset-start);
+        unescaped.append(data.data() + lastBreak, pos - lastBreak);
+        return std::string_view(unescaped);
     };
 
     auto consume = [&](char expected)
@@ -114,19 +190,6 @@ bool parseDependencyData(std::string& data, Callable callable)
         return false;
     };
 
-    auto readString = [&]()
-    {
-        size_t endPos = data.find((char)0, pos);
-        if(endPos == std::string::npos)
-        {
-            throw std::runtime_error("Failed to find end of string in input.");
-        }
-
-        std::string_view result = std::string_view(data).substr(pos, endPos-pos);
-        pos = endPos + 1;
-        return result;
-    };
-
     skipWhitespace();
     if(pos < data.size() && data[pos] != '{')
     {
@@ -176,11 +239,11 @@ bool parseDependencyData(std::string& data, Callable callable)
         {
             return true;
         }
-        
+
         while(pos < data.size())
         {
             skipWhitespace();
-            
+
             if(consume(']'))
             {
                 break;
@@ -198,12 +261,7 @@ bool parseDependencyData(std::string& data, Callable callable)
                 return true;
             }
 
-            if(pathString.empty())
-            {
-                continue;
-            }
-
-            if(callable(pathString))
+            if(!pathString.empty() && callable(pathString))
             {
                 return true;
             }
@@ -221,4 +279,136 @@ bool parseDependencyData(std::string& data, Callable callable)
     }
 
     return false;
-}
\ No newline at end of file
+}
+
+// Parses a P1689 scan result, as written by clang-scan-deps and gcc, calling provide and
+// require with the name of each module the scanned source provides and imports. Only
+// the parts of json needed for that are looked at, so malformed input is mostly ignored.
+template<typename Provide, typename Require>
+void parseModuleDependencies(std::string_view data, Provide provide, Require require)
+{
+    size_t pos = 0;
+    std::string unescaped;
+    auto readString = [&]()
+    {
+        unescaped.clear();
+        ++pos;
+        while(pos < data.size() && data[pos] != '"')
+        {
+            if(data[pos] == '\\' && pos + 1 < data.size())
+            {
+                ++pos;
+            }
+            unescaped += data[pos];
+            ++pos;
+        }
+        ++pos;
+        return std::string_view(unescaped);
+    };
+
+    // Depth of open arrays and objects, and the depth at which the provides or requires array was opened
+    size_t depth = 0;
+    size_t sectionDepth = 0;
+    bool provides = false;
+    std::string key;
+    while(pos < data.size())
+    {
+        char c = data[pos];
+        if(c == '"')
+        {
+            auto string = readString();
+            while(pos < data.size() && (data[pos] == ' ' || data[pos] == '\n' || data[pos] == '\r' || data[pos] == '\t'))
+            {
+                ++pos;
+            }
+            if(pos < data.size() && data[pos] == ':')
+            {
+                key = string;
+                ++pos;
+            }
+            else if(sectionDepth > 0 && depth == sectionDepth + 1 && key == "logical-name")
+            {
+                if(provides)
+                {
+                    provide(string);
+                }
+                else
+                {
+                    require(string);
+                }
+            }
+            continue;
+        }
+
+        if(c == '[' || c == '{')
+        {
+            ++depth;
+            if(c == '[' && sectionDepth == 0 && (key == "provides" || key == "requires"))
+            {
+                sectionDepth = depth;
+                provides = key == "provides";
+            }
+            key.clear();
+        }
+        else if(c == ']' || c == '}')
+        {
+            if(depth == sectionDepth)
+            {
+                sectionDepth = 0;
+            }
+            depth = depth > 0 ? depth - 1 : 0;
+        }
+        ++pos;
+    }
+}
+
+// Parses a dyndep manifest, which a command writes to add edges to the graph. Each line is a
+// keyword and a path taking up the rest of the line:
+//   output <path>    an output of the command besides the declared ones
+//   command <path>   the command with this output gets the inputs on the lines that follow
+//   input <path>     an input of that command
+// Empty lines and lines starting with # are skipped. Returns false if a line is anything else.
+template<typename Output, typename Input>
+bool parseDyndepManifest(std::string_view data, Output output, Input input)
+{
+    std::string_view command;
+    while(!data.empty())
+    {
+        auto lineEnd = data.find('\n');
+        auto line = data.substr(0, lineEnd);
+        data.remove_prefix(lineEnd == std::string_view::npos ? data.size() : lineEnd + 1);
+        if(!line.empty() && line.back() == '\r')
+        {
+            line.remove_suffix(1);
+        }
+        if(line.empty() || line.front() == '#')
+        {
+            continue;
+        }
+
+        auto space = line.find(' ');
+        if(space == std::string_view::npos || space + 1 == line.size())
+        {
+            return false;
+        }
+        auto keyword = line.substr(0, space);
+        auto path = line.substr(space + 1);
+        if(keyword == "output")
+        {
+            output(path);
+        }
+        else if(keyword == "command")
+        {
+            command = path;
+        }
+        else if(keyword == "input" && !command.empty())
+        {
+            input(command, path);
+        }
+        else
+        {
+            return false;
+        }
+    }
+    return true;
+}
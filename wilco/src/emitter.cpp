@@ -19,6 +19,7 @@ static std::filesystem::path getWilcoCachePath()
 cli::PathArgument wilcoFilesPath{"wilco-cache-path", "Target path for build files related to the build configuration itself.", getWilcoCachePath()};
 cli::PathArgument targetPath{"build-path", "Target path for build files.", "buildfiles"};
 cli::BoolArgument noRebuild{"no-self-update", "Don't rebuild the builder itself even if it has changed."};
+cli::BoolArgument profilePhases{"profile-phases", "Print wall time, kernel time and (if counted) allocations spent in each of wilco's own phases."};
 
 static std::vector<Action*>& getActions()
 {
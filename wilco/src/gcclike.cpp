@@ -3,7 +3,422 @@
 #include "core/project.h"
 #include "modules/toolchain.h"
 #include "util/commands.h"
+#include "util/path.h"
+#include "autopch.h"
+#include "fileutil.h"
+#include "git.h"
+#include <algorithm>
+#include <charconv>
 #include <filesystem>
+#include <optional>
+#include <string_view>
+#include <unordered_map>
+
+cli::StringArgument pgoMode{"pgo", "Profile guided optimization with gcc and clang: \"generate\" builds binaries recording profiles when run, \"use\" optimizes with the recorded profiles."};
+cli::StringArgument ltoJobs{"lto-jobs", "Threads each LTO link generates code on. By default gcc uses the make jobserver or all cores, and clang all cores."};
+
+namespace
+{
+    // Feature flags are looked up for every settings block, so the tables are only built once
+    const std::unordered_map<Feature, std::string_view>& getCompilerFeatureFlags(Language language)
+    {
+        static const std::unordered_map<Feature, std::string_view> commonFlags = {
+            { feature::Optimize, " -O3"},
+            { feature::DebugSymbols, " -g"},
+            { feature::WarningsAsErrors, " -Werror"},
+            { feature::FastMath, " -ffast-math"},
+            { feature::Exceptions, " -fexceptions"},
+            { feature::SplitDebugInfo, OperatingSystem::current() == MacOS ? " -g" : " -g -gsplit-dwarf"},
+            { feature::RemoveUnusedCode, " -ffunction-sections -fdata-sections"},
+            { feature::IdenticalCodeFolding, " -ffunction-sections"},
+            { feature::LTO, " -flto"},
+        };
+
+        static const std::unordered_map<Feature, std::string_view> cppFlags = [](){
+            auto flags = commonFlags;
+            flags.insert({
+                { feature::Cpp11, " -std=c++11"},
+                { feature::Cpp14, " -std=c++14"},
+                { feature::Cpp17, " -std=c++17"},
+                { feature::Cpp20, " -std=c++20"},
+                { feature::Cpp23, " -std=c++23"}
+            });
+            return flags;
+        }();
+
+        return language == lang::Cpp || language == lang::CppModule || language == lang::ObjectiveCpp ? cppFlags : commonFlags;
+    }
+
+    const std::unordered_map<Feature, std::string_view>& getLinkerFeatureFlags()
+    {
+        static const std::unordered_map<Feature, std::string_view> flags = {
+            { feature::DebugSymbols, " -g"},
+            { feature::RemoveUnusedCode, OperatingSystem::current() == MacOS ? " -Wl,-dead_strip" : " -Wl,--gc-sections"},
+            { feature::UseLld, " -fuse-ld=lld"},
+            { feature::UseMold, " -fuse-ld=mold"},
+        };
+        return flags;
+    }
+
+    // gcc and clang mostly take the same flags, for the rest it's told by the name of the driver
+    bool isClang(const std::string& driver)
+    {
+        return std::filesystem::path(driver).filename().string().find("clang") != std::string::npos;
+    }
+
+    std::optional<size_t> getLtoJobs()
+    {
+        if(!ltoJobs)
+        {
+            return {};
+        }
+
+        size_t jobs = 0;
+        auto [end, ec] = std::from_chars(ltoJobs.value->data(), ltoJobs.value->data() + ltoJobs.value->size(), jobs);
+        if(ec != std::errc() || end != ltoJobs.value->data() + ltoJobs.value->size() || jobs == 0)
+        {
+            throw cli::argument_error("Expected a positive number for --lto-jobs, got '" + *ltoJobs.value + "'.");
+        }
+        return jobs;
+    }
+
+    // Each linker has flags of its own for the ThinLTO cache
+    std::string getThinLtoCacheFlags(const extensions::Gcc::ThinLtoCache& cache, const std::string& directory, bool lld)
+    {
+        if(OperatingSystem::current() == MacOS)
+        {
+            std::string flags = " -Wl,-cache_path_lto," + str::quote(directory);
+            if(cache.pruneAfterHours > 0)
+            {
+                flags += " -Wl,-prune_after_lto," + std::to_string(cache.pruneAfterHours * 3600);
+            }
+            return flags;
+        }
+
+        std::string policy;
+        if(cache.maxSizeMB > 0)
+        {
+            policy += "cache_size_bytes=" + std::to_string(cache.maxSizeMB) + "m";
+        }
+        if(cache.pruneAfterHours > 0)
+        {
+            policy += (policy.empty() ? "prune_after=" : ":prune_after=") + std::to_string(cache.pruneAfterHours) + "h";
+        }
+
+        // Linkers other than lld pass them on to the LLVM plugin
+        std::string prefix = lld ? " -Wl,--thinlto-cache-" : " -Wl,-plugin-opt,cache-";
+        std::string flags = prefix + "dir=" + str::quote(directory);
+        if(!policy.empty())
+        {
+            flags += prefix + "policy=" + policy;
+        }
+        return flags;
+    }
+
+    // Commands turning the linked executable into the output optimized by BOLT. Everything in
+    // between is kept in directory.
+    void addBoltCommands(Project& project, const extensions::Gcc::Bolt& bolt, const std::filesystem::path& executable, const std::filesystem::path& output,
+                         const std::filesystem::path& directory, const std::filesystem::path& workingDir, const std::filesystem::path& pathOffset, const std::string& archMessage)
+    {
+        const auto executableStr = str::quote((pathOffset / executable).string());
+        std::filesystem::path profile;
+        std::string profileFlag;
+
+        CommandEntry training;
+        if (bolt.profile == extensions::Gcc::Bolt::Perf)
+        {
+            profile = directory / "perf.data";
+            profileFlag = " -p " + str::quote((pathOffset / profile).string()) + (bolt.branchSampling ? "" : " -nl");
+            training.command = str::quote(bolt.perf) + " record -e cycles:u" + (bolt.branchSampling ? " -j any,u" : "") +
+                               " -o " + str::quote((pathOffset / profile).string()) + " -- " + executableStr;
+            training.inputs = {executable};
+        }
+        else
+        {
+            profile = directory / "profile.fdata";
+            profileFlag = " -data=" + str::quote((pathOffset / profile).string());
+            auto instrumented = directory / "instrumented";
+            auto instrumentedStr = str::quote((pathOffset / instrumented).string());
+
+            CommandEntry instrument;
+            instrument.command = str::quote(bolt.llvmBolt) + " " + executableStr + " -instrument" +
+                                 " -instrumentation-file=" + str::quote(std::filesystem::absolute(profile).lexically_normal().string()) + " -o " + instrumentedStr;
+            instrument.inputs = {executable};
+            instrument.outputs = {instrumented};
+            instrument.workingDirectory = workingDir;
+            instrument.description = "Instrumenting " + project.name + archMessage + ": " + instrumented.string();
+            project.commands += std::move(instrument);
+
+            training.command = instrumentedStr;
+            training.inputs = {instrumented};
+        }
+        if (!bolt.trainingArguments.empty())
+        {
+            training.command += " " + bolt.trainingArguments;
+        }
+        training.inputs.insert(training.inputs.end(), bolt.trainingInputs.begin(), bolt.trainingInputs.end());
+        training.outputs = {profile};
+        training.workingDirectory = workingDir;
+        training.description = "Training " + project.name + archMessage + ": " + profile.string();
+        project.commands += std::move(training);
+
+        CommandEntry optimize;
+        optimize.command = str::quote(bolt.llvmBolt) + " " + executableStr + " -o " + str::quote((pathOffset / output).string()) + profileFlag;
+        if (!bolt.optimizations.empty())
+        {
+            optimize.command += " " + bolt.optimizations;
+        }
+        optimize.inputs = {executable, profile};
+        optimize.outputs = {output};
+        optimize.workingDirectory = workingDir;
+        optimize.description = "Optimizing " + project.name + archMessage + ": " + output.string();
+        project.commands += std::move(optimize);
+    }
+
+    bool hasFeature(Project& project, Architecture arch, Feature feature)
+    {
+        auto has = [feature](BuildSettings& settings)
+        {
+            return std::find(settings.features.begin(), settings.features.end(), feature) != settings.features.end();
+        };
+        auto it = project.archSettings.find(arch);
+        return has(project) || (it != project.archSettings.end() && has(it->second));
+    }
+
+    // Appends a path made safe to nest under an output directory, mapping ':' to '_'
+    // and ".." to "__" in a single pass.
+    void appendFlattenedPath(std::string& result, std::string_view path)
+    {
+        for(size_t i = 0; i < path.size(); ++i)
+        {
+            if(path[i] == ':')
+            {
+                result += '_';
+            }
+            else if(path[i] == '.' && i + 1 < path.size() && path[i + 1] == '.')
+            {
+                result += "__";
+                ++i;
+            }
+            else
+            {
+                result += path[i];
+            }
+        }
+    }
+
+    std::string flattenPath(std::string_view path)
+    {
+        std::string result;
+        result.reserve(path.size());
+        appendFlattenedPath(result, path);
+        return result;
+    }
+
+    // Appends text with backslashes escaped, as the compiler reads rsp files with escape sequences.
+    void appendRspEscaped(std::string& result, std::string_view text)
+    {
+        size_t start = 0;
+        while(true)
+        {
+            size_t backslash = text.find('\\', start);
+            if(backslash == std::string_view::npos)
+            {
+                result.append(text.data() + start, text.size() - start);
+                return;
+            }
+            result.append(text.data() + start, backslash + 1 - start);
+            result += '\\';
+            start = backslash + 1;
+        }
+    }
+
+    void appendCompilerFlags(std::string& flags, std::string_view input, std::string_view output)
+    {
+        flags += " -MMD -MF ";
+        flags += output;
+        flags += ".d  -c -o ";
+        flags += output;
+        flags += ' ';
+        flags += input;
+    }
+
+    Language getSourceLanguage(const SourceFile& file)
+    {
+        return file.language != lang::Auto ? file.language : Language::getByPath(file.path);
+    }
+
+    struct UnityBatch
+    {
+        std::filesystem::path file;
+        // Where the object goes, relative to the object directory
+        std::string objectName;
+        Language language;
+        bool usePch;
+        // Indices into the project's files
+        std::vector<size_t> sources;
+    };
+
+    // Splits the project's sources into unity batches and writes the file including each batch's
+    // sources. Returns the batch each of the project's files ended up in, or -1 if it's compiled
+    // on its own. When isolating changed files, the sources left in batches are added to
+    // watchedFiles, as editing one has to take it out of its batch.
+    std::vector<size_t> planUnityBatches(const Project& project, const std::filesystem::path& dataDir, const std::unordered_set<std::string>& ignorePch, std::vector<UnityBatch>& batches, std::vector<std::filesystem::path>& watchedFiles)
+    {
+        const auto& unity = project.ext<extensions::Gcc>().unity;
+        bool modules = project.ext<extensions::Gcc>().modules.enabled;
+        const auto& files = project.files.vector();
+        std::vector<size_t> batchOf(files.size(), (size_t)-1);
+
+        std::unordered_set<std::string> ignored;
+        ignored.reserve(unity.ignoredFiles.size());
+        for(auto& file : unity.ignoredFiles)
+        {
+            ignored.insert(file.lexically_normal().string());
+        }
+
+        struct Candidate
+        {
+            size_t index;
+            std::filesystem::path path;
+            Language language;
+            bool usePch;
+        };
+        std::vector<Candidate> candidates;
+        for(size_t i = 0; i < files.size(); ++i)
+        {
+            auto language = getSourceLanguage(files[i]);
+            // Module units can't be included in other sources, and any C++ source can be one
+            if((language != lang::C && language != lang::Cpp && language != lang::ObjectiveC && language != lang::ObjectiveCpp) || (modules && language == lang::Cpp))
+            {
+                continue;
+            }
+            auto path = files[i].path.lexically_normal();
+            if(ignored.find(path.string()) != ignored.end())
+            {
+                continue;
+            }
+            bool usePch = ignorePch.find(path.string()) == ignorePch.end();
+            candidates.push_back({i, std::move(path), language, usePch});
+        }
+
+        bool isolating = false;
+        if(unity.isolateChangedFiles && !candidates.empty())
+        {
+            std::vector<std::filesystem::path> absolutePaths;
+            absolutePaths.reserve(candidates.size());
+            for(auto& candidate : candidates)
+            {
+                absolutePaths.push_back(std::filesystem::absolute(candidate.path).lexically_normal());
+            }
+            std::vector<bool> changed;
+            if(git::findChangedFiles(absolutePaths, changed))
+            {
+                isolating = true;
+                size_t kept = 0;
+                for(size_t i = 0; i < candidates.size(); ++i)
+                {
+                    if(!changed[i])
+                    {
+                        if(kept != i)
+                        {
+                            candidates[kept] = std::move(candidates[i]);
+                        }
+                        ++kept;
+                    }
+                }
+                candidates.resize(kept);
+            }
+        }
+
+        // Sorting by directory first and path within it keeps the batches the same no matter
+        // what order the files were added in.
+        std::sort(candidates.begin(), candidates.end(), [](const Candidate& a, const Candidate& b)
+        {
+            if(a.path.parent_path() != b.path.parent_path())
+            {
+                return a.path.parent_path() < b.path.parent_path();
+            }
+            if(a.language != b.language)
+            {
+                return a.language < b.language;
+            }
+            if(a.usePch != b.usePch)
+            {
+                return a.usePch;
+            }
+            return a.path < b.path;
+        });
+
+        const auto unityDir = dataDir / std::filesystem::path("unity") / project.name;
+        size_t maxFiles = std::max((size_t)1, unity.maxFiles);
+        size_t directoryBatches = 0;
+        size_t begin = 0;
+        while(begin < candidates.size())
+        {
+            auto& first = candidates[begin];
+            size_t end = begin + 1;
+            size_t bytes = 0;
+            auto addBytes = [&](const Candidate& candidate)
+            {
+                std::error_code ec;
+                auto size = std::filesystem::file_size(candidate.path, ec);
+                bytes += ec ? 0 : (size_t)size;
+            };
+            if(unity.maxBytes > 0)
+            {
+                addBytes(first);
+            }
+            while(end < candidates.size() && end - begin < maxFiles &&
+                candidates[end].path.parent_path() == first.path.parent_path() &&
+                candidates[end].language == first.language &&
+                candidates[end].usePch == first.usePch)
+            {
+                if(unity.maxBytes > 0)
+                {
+                    addBytes(candidates[end]);
+                    if(bytes > unity.maxBytes)
+                    {
+                        break;
+                    }
+                }
+                ++end;
+            }
+
+            bool newDirectory = begin == 0 || candidates[begin - 1].path.parent_path() != first.path.parent_path();
+            directoryBatches = newDirectory ? 0 : directoryBatches + 1;
+
+            if(end - begin > 1)
+            {
+                auto extension = first.language == lang::C ? ".c" : first.language == lang::Cpp ? ".cpp" : first.language == lang::ObjectiveC ? ".m" : ".mm";
+                auto name = flattenPath(first.path.parent_path().relative_path().generic_string()) + "/unity_" + std::to_string(directoryBatches) + extension;
+                UnityBatch batch;
+                batch.file = unityDir / name;
+                batch.objectName = "unity/" + name;
+                batch.language = first.language;
+                batch.usePch = first.usePch;
+
+                std::string contents;
+                for(size_t i = begin; i < end; ++i)
+                {
+                    batch.sources.push_back(candidates[i].index);
+                    batchOf[candidates[i].index] = batches.size();
+                    auto absolutePath = std::filesystem::absolute(candidates[i].path).lexically_normal();
+                    contents += "#include \"" + absolutePath.generic_string() + "\"\n";
+                    if(isolating)
+                    {
+                        watchedFiles.push_back(std::move(absolutePath));
+                    }
+                }
+                writeFile(batch.file, contents);
+                batches.push_back(std::move(batch));
+            }
+            begin = end;
+        }
+
+        return batchOf;
+    }
+}
 
 GccLikeToolchainProvider::GccLikeToolchainProvider(std::string name, std::string compiler, std::string resourceCompiler, std::string linker, std::string archiver)
     : ToolchainProvider(name) 
@@ -14,9 +429,38 @@ GccLikeToolchainProvider::GccLikeToolchainProvider(std::string name, std::string
 {
 }
 
+bool GccLikeToolchainProvider::digest(const Project& project, hash::Md5& hasher) const
+{
+    // Automatic PCHs and unity batches are picked and written from what's on disk, and so are
+    // the profiles used with --pgo=use
+    const auto& gccExt = project.ext<extensions::Gcc>();
+    if(gccExt.pch.automatic.enabled || gccExt.unity.enabled || pgoMode.value == "use")
+    {
+        return false;
+    }
+
+    hash::digestValue(hasher, compiler);
+    hash::digestValue(hasher, resourceCompiler);
+    hash::digestValue(hasher, linker);
+    hash::digestValue(hasher, archiver);
+    hash::digestValue(hasher, pgoMode.value.value_or(""));
+    hash::digestValue(hasher, ltoJobs.value.value_or(""));
+
+    for(auto& dependency : project.dependencies)
+    {
+        hash::digestList(hasher, dependency->ext<extensions::internal::ToolchainOutputs>().libraryFiles);
+        for(auto& [arch, settings] : dependency->archSettings)
+        {
+            hash::digestValue(hasher, arch);
+            hash::digestList(hasher, settings.ext<extensions::internal::ToolchainOutputs>().libraryFiles);
+        }
+    }
+    return true;
+}
+
 std::string GccLikeToolchainProvider::getCompiler(Project& project, std::filesystem::path pathOffset, Language language) const
 {
-    if(language == lang::Cpp || language == lang::C || language == lang::ObjectiveC || language == lang::ObjectiveCpp)
+    if(language == lang::Cpp || language == lang::CppModule || language == lang::C || language == lang::ObjectiveC || language == lang::ObjectiveCpp)
     {
         return compiler;
     }
@@ -57,6 +501,11 @@ std::string GccLikeToolchainProvider::getCommonCompilerFlags(Project& project, A
         {
             flags += pch ? " -x c++-header -Xclang -emit-pch " : " -x c++ ";
         }
+        else if(language == lang::CppModule)
+        {
+            // gcc has no language for module interfaces, it finds them in the source
+            flags += project.ext<extensions::Gcc>().modules.scanner.empty() ? " -x c++ " : " -x c++-module ";
+        }
         else if(language == lang::ObjectiveC)
         {
             flags += pch ? " -x objective-c-header -Xclang -emit-pch " : " -x objective-c ";
@@ -75,11 +524,14 @@ std::string GccLikeToolchainProvider::getCommonCompilerFlags(Project& project, A
     {
         for(auto& define : settings.defines)
         {
-            flags += " -D" + str::quote(define);
+            flags += " -D";
+            flags += str::quote(define);
         }
         for(auto& path : settings.includePaths)
         {
-            flags += " -I\"" + (pathOffset / path).string() + "\"";
+            flags += " -I\"";
+            flags += (pathOffset / path).string();
+            flags += "\"";
         }
 
         if(language == lang::Rc)
@@ -87,27 +539,14 @@ std::string GccLikeToolchainProvider::getCommonCompilerFlags(Project& project, A
             return;
         }
 
-        std::unordered_map<Feature, std::string> featureMap = {
-            { feature::Optimize, " -O3"},
-            { feature::DebugSymbols, " -g"},
-            { feature::WarningsAsErrors, " -Werror"},
-            { feature::FastMath, " -ffast-math"},
-            { feature::Exceptions, " -fexceptions"},
-        };
-
-        if(language == lang::Cpp || language == lang::ObjectiveCpp)
-        {
-            featureMap.insert({
-                {feature::Cpp11, " -std=c++11"},
-                { feature::Cpp14, " -std=c++14"},
-                { feature::Cpp17, " -std=c++17"},
-                { feature::Cpp20, " -std=c++20"},
-                { feature::Cpp23, " -std=c++23"}
-            });
-        }
-
+        auto& featureMap = getCompilerFeatureFlags(language);
         for(auto& feature : settings.features)
         {
+            if(feature == feature::ThinLTO)
+            {
+                flags += isClang(compiler) ? " -flto=thin" : " -flto";
+                continue;
+            }
             auto it = featureMap.find(feature);
             if(it != featureMap.end())
             {
@@ -117,7 +556,8 @@ std::string GccLikeToolchainProvider::getCommonCompilerFlags(Project& project, A
 
         for(auto& flag : settings.ext<extensions::Gcc>().compilerFlags)
         {
-            flags += " " + std::string(flag);
+            flags += ' ';
+            flags += flag;
         }
     };
 
@@ -138,7 +578,10 @@ std::string GccLikeToolchainProvider::getCompilerFlags(Project& project, Archite
     }
     else
     {
-        return " -MMD -MF " + output + ".d " + " -c -o " + output + " " + input;
+        std::string flags;
+        flags.reserve(32 + output.size() * 2 + input.size());
+        appendCompilerFlags(flags, input, output);
+        return flags;
     }
 }
 
@@ -176,6 +619,12 @@ std::string GccLikeToolchainProvider::getCommonLinkerFlags(Project& project, Arc
     }
 
     bool sawBundleFeature = false;
+    // Some flags are only understood by the faster linkers, so they're added once all features are known
+    bool fastLinker = false;
+    bool splitDebugInfo = false;
+    bool identicalCodeFolding = false;
+    bool lto = false;
+    bool thinLto = false;
 
     auto getFlags = [&](BuildSettings& settings)
     {
@@ -207,16 +656,18 @@ std::string GccLikeToolchainProvider::getCommonLinkerFlags(Project& project, Arc
                 flags += " -framework " + framework;
             }
 
-            std::unordered_map<Feature, std::string> featureMap = {
-                { feature::DebugSymbols, " -g"},
-            };
-
+            auto& featureMap = getLinkerFeatureFlags();
             for(auto& feature : settings.features)
             {
                 if(feature == feature::macos::Bundle)
                 {
                     sawBundleFeature = true;
                 }
+                fastLinker = fastLinker || feature == feature::UseLld || feature == feature::UseMold;
+                splitDebugInfo = splitDebugInfo || feature == feature::SplitDebugInfo;
+                identicalCodeFolding = identicalCodeFolding || feature == feature::IdenticalCodeFolding;
+                lto = lto || feature == feature::LTO;
+                thinLto = thinLto || feature == feature::ThinLTO;
 
                 auto it = featureMap.find(feature);
                 if(it != featureMap.end())
@@ -240,6 +691,34 @@ std::string GccLikeToolchainProvider::getCommonLinkerFlags(Project& project, Arc
         getFlags(it->second);
     }
 
+    if(fastLinker && splitDebugInfo && OperatingSystem::current() != MacOS)
+    {
+        flags += " -Wl,--gdb-index";
+    }
+    if(fastLinker && identicalCodeFolding)
+    {
+        flags += " -Wl,--icf=all";
+    }
+
+    // Code is generated when linking. wilco runs a command per core and has no jobserver to
+    // share them with, so links that run alongside others can be held to --lto-jobs threads.
+    if(lto || thinLto)
+    {
+        auto jobs = getLtoJobs();
+        if(isClang(linker))
+        {
+            flags += thinLto ? " -flto=thin" : " -flto";
+            if(jobs)
+            {
+                flags += " -flto-jobs=" + std::to_string(*jobs);
+            }
+        }
+        else
+        {
+            flags += jobs ? " -flto=" + std::to_string(*jobs) : std::string(" -flto=auto");
+        }
+    }
+
     if(project.type == SharedLib)
     {
         if(sawBundleFeature)
@@ -308,23 +787,98 @@ void GccLikeToolchainProvider::process(Project& project, const std::filesystem::
 
 	std::vector<std::filesystem::path> archOutputs;
 
+	const bool pgoGenerate = pgoMode.value == "generate";
+	const bool pgoUse = pgoMode.value == "use";
+	if (pgoMode && !pgoGenerate && !pgoUse)
+	{
+		throw cli::argument_error("Unknown --pgo mode '" + *pgoMode.value + "', expected generate or use.");
+	}
+	const bool clangPgo = isClang(compiler);
+
+	const auto& gccExt = project.ext<extensions::Gcc>();
+	auto buildPch = gccExt.pch.build;
+	auto importPch = gccExt.pch.use;
+	if (gccExt.pch.automatic.enabled && buildPch.empty() && importPch.empty())
+	{
+		autopch::Settings settings;
+		settings.minShare = gccExt.pch.automatic.minShare;
+		settings.maxHeaders = gccExt.pch.automatic.maxHeaders;
+		settings.projectHeaders = gccExt.pch.automatic.projectHeaders;
+		settings.root = std::filesystem::absolute(std::filesystem::current_path()).lexically_normal();
+		buildPch = importPch = autopch::headerPath(dataDir, project.name);
+		autopch::configureHeader(buildPch, settings);
+	}
+
+	std::unordered_set<std::string> ignorePch;
+	ignorePch.reserve(gccExt.pch.ignoredFiles.size());
+	for (auto& file : gccExt.pch.ignoredFiles)
+	{
+		ignorePch.insert(file.lexically_normal().string());
+	}
+
+	// Sources are the same for every architecture, so they're batched once
+	std::vector<UnityBatch> unityBatches;
+	std::vector<size_t> unityBatchOf;
+	if (gccExt.unity.enabled)
+	{
+		std::vector<std::filesystem::path> watchedFiles;
+		unityBatchOf = planUnityBatches(project, dataDir, ignorePch, unityBatches, watchedFiles);
+		project.ext<extensions::internal::ToolchainOutputs>().configurationDependencies += watchedFiles;
+	}
+
 	for (auto arch : archs)
 	{
 		auto archMessage = archs.size() > 1 ? " (" + arch.id + ")" : "";
-		const auto& gccExt = project.ext<extensions::Gcc>();
-		const auto& buildPch = gccExt.pch.build;
-		const auto& importPch = gccExt.pch.use;
 		auto& toolchainOutputs = project.archSettings[arch].ext<extensions::internal::ToolchainOutputs>();
 
+		// Binaries built with clang write raw profiles to a directory of the project's own, which
+		// a merge command turns into the profile to optimize with. gcc keeps the profile of each
+		// object next to it, where runs of the binaries add to it.
+		std::string pgoFlags;
+		std::vector<std::filesystem::path> pgoInputs;
+		const auto profileDir = dataDir / arch.id / std::filesystem::path("pgo") / project.name;
+		if (pgoGenerate)
+		{
+			// Binaries are run from anywhere, so the directory they write to is absolute
+			pgoFlags = clangPgo ? " -fprofile-generate=" + str::quote(std::filesystem::absolute(profileDir).lexically_normal().string()) : " -fprofile-generate";
+		}
+		else if (pgoUse && clangPgo)
+		{
+			auto profile = profileDir;
+			profile += ".profdata";
+			auto profileStr = (pathOffset / profile).string();
+			pgoFlags = " -fprofile-use=" + str::quote(profileStr);
+			pgoInputs.push_back(profile);
+
+			// Runs adding profiles change the directory, runs updating them change the files
+			CommandEntry merge;
+			merge.command = str::quote(gccExt.pgo.profdata) + " merge -output=" + str::quote(profileStr) + " " + str::quote((pathOffset / profileDir).string());
+			merge.inputs = {profileDir};
+			std::error_code ec;
+			for (auto& entry : std::filesystem::directory_iterator(profileDir, ec))
+			{
+				if (entry.path().extension() == ".profraw")
+				{
+					merge.inputs.push_back(entry.path());
+				}
+			}
+			merge.outputs = {profile};
+			merge.workingDirectory = workingDir;
+			merge.description = "Merging " + project.name + " profiles" + archMessage;
+			project.commands += std::move(merge);
+		}
+		else if (pgoUse)
+		{
+			pgoFlags = " -fprofile-use";
+		}
+
 		// TODO: Do PCH management less hard coded, and only build PCHs for different languages if needed
 		if (!buildPch.empty())
 		{
 			auto input = buildPch;
 			auto inputStr = (pathOffset / input).string();
 
-			auto pchPath = input.relative_path().string();
-			str::replaceAllInPlace(pchPath, ":", "_");
-			str::replaceAllInPlace(pchPath, "..", "__");
+			auto pchPath = flattenPath(input.relative_path().string());
 
 			auto output = dataDir / arch.id / std::filesystem::path("pch") / (pchPath + ".pch");
 			auto outputStr = (pathOffset / output).string();
@@ -335,9 +889,10 @@ void GccLikeToolchainProvider::process(Project& project, const std::filesystem::
 			{
 				CommandEntry command;
 				command.command = str::quote(getCompiler(project, pathOffset, lang::Cpp)) +
-				                  getCommonCompilerFlags(project, arch, pathOffset, lang::Cpp, true) +
+				                  getCommonCompilerFlags(project, arch, pathOffset, lang::Cpp, true) + pgoFlags +
 				                  getCompilerFlags(project, arch, pathOffset, lang::Cpp, inputStr, outputStr);
 				command.inputs = {input};
+				command.inputs.insert(command.inputs.end(), pgoInputs.begin(), pgoInputs.end());
 				command.outputs = {output};
 				command.workingDirectory = workingDir;
 				command.depFile = output.string() + ".d";
@@ -350,9 +905,10 @@ void GccLikeToolchainProvider::process(Project& project, const std::filesystem::
 			{
 				CommandEntry command;
 				command.command = str::quote(getCompiler(project, pathOffset, lang::ObjectiveCpp)) +
-				                  getCommonCompilerFlags(project, arch, pathOffset, lang::ObjectiveCpp, true) +
+				                  getCommonCompilerFlags(project, arch, pathOffset, lang::ObjectiveCpp, true) + pgoFlags +
 				                  getCompilerFlags(project, arch, pathOffset, lang::ObjectiveCpp, inputStr, outputObjCStr);
 				command.inputs = {input};
+				command.inputs.insert(command.inputs.end(), pgoInputs.begin(), pgoInputs.end());
 				command.outputs = {outputObjC};
 				command.workingDirectory = workingDir;
 				command.depFile = outputObjC.string() + ".d";
@@ -366,9 +922,7 @@ void GccLikeToolchainProvider::process(Project& project, const std::filesystem::
 		std::vector<std::filesystem::path> pchInputs;
 		if (!importPch.empty())
 		{
-			auto pchPath = importPch.relative_path().string();
-			str::replaceAllInPlace(pchPath, ":", "_");
-			str::replaceAllInPlace(pchPath, "..", "__");
+			auto pchPath = flattenPath(importPch.relative_path().string());
 
 			auto input = dataDir / arch.id / std::filesystem::path("pch") / (pchPath + ".pch");
 			auto inputStr = (pathOffset / input).string();
@@ -395,73 +949,248 @@ void GccLikeToolchainProvider::process(Project& project, const std::filesystem::
 
 			auto flags = str::quote(getCompiler(project, pathOffset, language)) +
 			             getCommonCompilerFlags(project, arch, pathOffset, language, false);
+			if (language != lang::Rc)
+			{
+				flags += pgoFlags;
+			}
 
 			return commonCompilerFlags[language] = flags;
 		};
 
 		auto linkerCommand = str::quote(getLinker(project, pathOffset)) + getCommonLinkerFlags(project, arch, pathOffset);
-
-		std::unordered_set<std::string> ignorePch;
-		ignorePch.reserve(gccExt.pch.ignoredFiles.size());
-		for (auto& file : gccExt.pch.ignoredFiles)
+		if (project.type != StaticLib && gccExt.thinLtoCache.enabled && isClang(linker) && hasFeature(project, arch, feature::ThinLTO))
 		{
-			ignorePch.insert(file.lexically_normal().string());
+			auto cacheDir = dataDir / arch.id / std::filesystem::path("lto") / project.name;
+			linkerCommand += getThinLtoCacheFlags(gccExt.thinLtoCache, (pathOffset / cacheDir).string(), hasFeature(project, arch, feature::UseLld));
+		}
+		// Instrumented code needs the profiling runtime
+		if (project.type != StaticLib && pgoGenerate)
+		{
+			linkerCommand += pgoFlags;
 		}
 
+		// Everything below runs once per source file, so it's written to keep allocations
+		// down: paths that are the same for every file are computed up front, and strings
+		// are assembled in builders that keep their capacity between files.
+		const auto objDir = dataDir / arch.id / std::filesystem::path("obj") / project.name;
+		const auto currentPath = std::filesystem::current_path();
+		const std::string descriptionPrefix = "Compiling " + project.name + archMessage + ": ";
+		const auto& modules = gccExt.modules;
+		const bool gccModules = modules.scanner.empty();
+		const bool splitDebugInfo = OperatingSystem::current() != MacOS && hasFeature(project, arch, feature::SplitDebugInfo);
+		std::string objPath;
+		std::string flags;
+
+		const auto& files = project.files.vector();
 		std::vector<std::filesystem::path> linkerInputs;
-		for (auto& input : project.files)
+		// batch is set when compiling a unity file
+		auto addCompileCommand = [&](const std::filesystem::path& inputPath, Language language, bool usePch, const UnityBatch* batch)
 		{
-			auto language = input.language != lang::Auto ? input.language : Language::getByPath(input.path);
-			if (language == lang::None)
+			auto inputStr = (pathOffset / inputPath).string();
+			objPath.clear();
+			if (batch)
 			{
-				continue;
+				objPath += batch->objectName;
 			}
-
-			auto inputStr = (pathOffset / input.path).string();
-			auto objPath = input.path.relative_path().string();
-			str::replaceAllInPlace(objPath, ":", "_");
-            str::replaceAllInPlace(objPath, "..", "__");
-            auto output = dataDir / arch.id / std::filesystem::path("obj") / project.name / (objPath + (language == lang::Rc ? ".res" : ".o"));
-            auto outputStr = (pathOffset / output).string();
+			else
+			{
+				appendFlattenedPath(objPath, inputPath.relative_path().string());
+			}
+			objPath += language == lang::Rc ? ".res" : ".o";
+			auto output = objDir / objPath;
+			auto outputStr = (pathOffset / output).string();
 
             CommandEntry command;
             // TODO: These rsp & escaping rules needs something less hardcoded probably.
             if(language != lang::Rc)
             {
-                command.command = getCommonCompilerCommand(language);
-                command.rspContents = getCompilerFlags(project, arch, pathOffset, language, inputStr, outputStr);
+                flags.clear();
+                appendCompilerFlags(flags, inputStr, outputStr);
 
-                if(ignorePch.find(input.path.lexically_normal().string()) == ignorePch.end())
+                // The source is scanned for the modules it provides and imports by a command of
+                // its own, and the scheduler writes the map of where the imported modules are
+                if(modules.enabled && (language == lang::Cpp || language == lang::CppModule))
                 {
-                    // TODO: Do PCH management less hard coded, and only build PCHs for different languages if needed
-                    if(language == lang::Cpp)
+                    auto scanOutput = output;
+                    scanOutput += ".ddi";
+                    auto scanOutputStr = (pathOffset / scanOutput).string();
+                    auto scanDepFile = scanOutput;
+                    scanDepFile += ".d";
+
+                    CommandEntry scan;
+                    std::string scanFlags;
+                    if(gccModules)
+                    {
+                        auto preprocessed = scanOutput;
+                        preprocessed += ".i";
+                        scanFlags = " -fmodules-ts -E " + inputStr + " -MT " + scanOutputStr + " -MD -MF " + scanOutputStr + ".d" +
+                                    " -fdeps-format=p1689r5 -fdeps-file=" + scanOutputStr + " -fdeps-target=" + outputStr +
+                                    " -o " + (pathOffset / preprocessed).string();
+                        scan.outputs = {scanOutput, preprocessed};
+                    }
+                    else
+                    {
+                        scanFlags = " -c -o " + outputStr + " " + inputStr + " -MT " + scanOutputStr + " -MD -MF " + scanOutputStr + ".d";
+                        scan.outputs = {scanOutput};
+                    }
+                    appendRspEscaped(scan.rspContents, scanFlags);
+                    auto scanRspPath = scanOutput;
+                    scanRspPath += ".rsp";
+                    scan.rspFile = (currentPath / scanRspPath).lexically_normal();
+
+                    auto scanRspFlag = " @" + str::quote(scan.rspFile.string(), '"', "\"");
+                    if(gccModules)
                     {
-                        command.rspContents += cppPchFlags;
+                        scan.command = getCommonCompilerCommand(language) + scanRspFlag;
                     }
-                    else if(language == lang::ObjectiveCpp)
+                    else
                     {
-                        command.rspContents += objCppPchFlags;
+                        scan.command = str::quote(modules.scanner) + " -format=p1689 -o " + str::quote(scanOutputStr) + " -- " + getCommonCompilerCommand(language) + scanRspFlag;
+                    }
+                    scan.depFile = std::move(scanDepFile);
+                    scan.inputs = {inputPath};
+                    scan.workingDirectory = workingDir;
+                    scan.description = "Scanning " + project.name + archMessage + ": " + inputPath.string();
+                    project.commands += std::move(scan);
+
+                    command.moduleScan.path = scanOutput;
+                    command.moduleScan.mapFile = output;
+                    command.moduleScan.mapFile += ".modmap";
+                    command.moduleScan.format = gccModules ? ModuleScan::Format::GCC : ModuleScan::Format::Clang;
+                    auto mapFileStr = (pathOffset / command.moduleScan.mapFile).string();
+                    if(language == lang::CppModule)
+                    {
+                        command.moduleScan.moduleOutput = output;
+                        command.moduleScan.moduleOutput.replace_extension(gccModules ? ".gcm" : ".pcm");
+                    }
+
+                    if(gccModules)
+                    {
+                        flags += " -fmodules-ts -fmodule-mapper=" + mapFileStr;
+                    }
+                    else
+                    {
+                        if(language == lang::CppModule)
+                        {
+                            flags += " -fmodule-output=" + (pathOffset / command.moduleScan.moduleOutput).string();
+                        }
+                        flags += " @" + str::quote(mapFileStr, '"', "\"");
                     }
                 }
 
-                str::replaceAllInPlace(command.rspContents, "\\", "\\\\");
-				command.rspFile = std::filesystem::absolute(output.string() + ".rsp").lexically_normal();
-				command.command += " @" + str::quote(command.rspFile.string(), '"', "\"");
-				command.depFile = output.string() + ".d";
+                // TODO: Do PCH management less hard coded, and only build PCHs for different languages if needed
+                const std::string* pchFlags = language == lang::Cpp ? &cppPchFlags : language == lang::ObjectiveCpp ? &objCppPchFlags : nullptr;
+                if(pchFlags && !pchFlags->empty() && usePch)
+                {
+                    flags += *pchFlags;
+                }
+
+                command.rspContents.reserve(flags.size() + 16);
+                appendRspEscaped(command.rspContents, flags);
+
+                // Normalizing is costly, and the path is usually normal already
+                auto rspPath = output;
+                rspPath += ".rsp";
+                command.rspFile = currentPath / rspPath;
+                if(!paths::isAbsoluteNormal(command.rspFile.string()))
+                {
+                    command.rspFile = command.rspFile.lexically_normal();
+                }
+
+                auto& commonCommand = getCommonCompilerCommand(language);
+                auto rspFlag = str::quote(command.rspFile.string(), '"', "\"");
+                command.command.reserve(commonCommand.size() + 2 + rspFlag.size());
+                command.command += commonCommand;
+                command.command += " @";
+                command.command += rspFlag;
+
+                auto depFile = output;
+                depFile += ".d";
+				command.depFile = std::move(depFile);
 			}
             else
             {
                 command.command = getCommonCompilerCommand(language) + getCompilerFlags(project, arch, pathOffset, language, inputStr, outputStr);
             }
-            command.inputs = { input.path };
+            command.inputs.reserve(2 + (batch ? batch->sources.size() : 0) + pchInputs.size());
+            command.inputs.push_back(inputPath);
+            if(batch)
+            {
+                for(auto index : batch->sources)
+                {
+                    command.inputs.push_back(files[index].path);
+                }
+            }
             command.inputs.insert(command.inputs.end(), pchInputs.begin(), pchInputs.end());
+            if(language != lang::Rc)
+            {
+                command.inputs.insert(command.inputs.end(), pgoInputs.begin(), pgoInputs.end());
+            }
+            // gcc reads the profile named after the object. Objects whose code never ran have
+            // none, and a missing input would rebuild them every time.
+            if(pgoUse && !clangPgo && language != lang::Rc)
+            {
+                auto profile = output;
+                profile.replace_extension(".gcda");
+                std::error_code ec;
+                if(std::filesystem::exists(profile, ec))
+                {
+                    command.inputs.push_back(std::move(profile));
+                }
+            }
             command.outputs = { output };
+            // The compiler names the file after the object
+            if(splitDebugInfo && language != lang::Rc)
+            {
+                command.outputs.push_back(output);
+                command.outputs.back().replace_extension(".dwo");
+            }
+            if(command.moduleScan)
+            {
+                command.inputs.push_back(command.moduleScan.path);
+                if(!command.moduleScan.moduleOutput.empty())
+                {
+                    command.outputs.push_back(command.moduleScan.moduleOutput);
+                }
+            }
             command.workingDirectory = workingDir;
-            command.description = "Compiling " + project.name + archMessage + ": " + input.path.string();
+            command.description.reserve(descriptionPrefix.size() + inputPath.native().size());
+            command.description += descriptionPrefix;
+            command.description += inputPath.string();
+            if(batch)
+            {
+                command.description += " (" + std::to_string(batch->sources.size()) + " files)";
+            }
             project.commands += std::move(command);
 
 			toolchainOutputs.objectFiles += output;
 			linkerInputs.push_back(output);
+		};
+
+		// A unity batch is compiled where its first source is reached, keeping object order stable
+		std::vector<bool> batchAdded(unityBatches.size(), false);
+		for (size_t i = 0; i < files.size(); ++i)
+		{
+			auto& input = files[i];
+			if (!unityBatchOf.empty() && unityBatchOf[i] != (size_t)-1)
+			{
+				auto batch = unityBatchOf[i];
+				if (!batchAdded[batch])
+				{
+					batchAdded[batch] = true;
+					auto& unityBatch = unityBatches[batch];
+					addCompileCommand(unityBatch.file, unityBatch.language, unityBatch.usePch, &unityBatch);
+				}
+				continue;
+			}
+
+			auto language = getSourceLanguage(input);
+			if (language == lang::None)
+			{
+				continue;
+			}
+			bool usePch = ignorePch.empty() || ignorePch.find(input.path.lexically_normal().string()) == ignorePch.end();
+			addCompileCommand(input.path, language, usePch, nullptr);
 		}
 
 		if (!linker.empty())
@@ -522,14 +1251,17 @@ void GccLikeToolchainProvider::process(Project& project, const std::filesystem::
 			}
 			else
 			{
-				auto tmpPath = finalOutput.relative_path().string();
-				str::replaceAllInPlace(tmpPath, ":", "_");
-				str::replaceAllInPlace(tmpPath, "..", "__");
-				output = dataDir / arch.id / std::filesystem::path("link") / project.name / tmpPath;
+				output = dataDir / arch.id / std::filesystem::path("link") / project.name / flattenPath(finalOutput.relative_path().string());
 			}
 
+			// BOLT rewrites the linked executable into the output. It only handles ELF, and ld64
+			// doesn't take --emit-relocs, so elsewhere the executable is linked as usual.
+			const bool bolt = gccExt.bolt.enabled && project.type == Executable && OperatingSystem::current() != MacOS && OperatingSystem::current() != Windows;
+			const auto boltDir = dataDir / arch.id / std::filesystem::path("bolt") / project.name;
+			auto linkOutput = bolt ? boltDir / output.filename() : output;
+
 			std::string outputStr;
-			outputStr = (pathOffset / output).string();
+			outputStr = (pathOffset / linkOutput).string();
 			archOutputs.push_back(output);
 
 			if (archs.size() == 1)
@@ -539,13 +1271,18 @@ void GccLikeToolchainProvider::process(Project& project, const std::filesystem::
 
 			CommandEntry command;
 			command.command = linkerCommand;
+			// BOLT needs the relocations to move code around
+			if (bolt)
+			{
+				command.command += " -Wl,--emit-relocs";
+			}
 			// TODO: ar on macOS doesn't support rsp files. This should not be hardcoded,
 			// the capabilities of the toolchain should be queried one way or another.
 			if (OperatingSystem::current() != MacOS)
 			{
 				command.rspContents = getLinkerFlags(project, arch, pathOffset, linkerInputStrs, outputStr);
 				str::replaceAllInPlace(command.rspContents, "\\", "\\\\");
-				command.rspFile = std::filesystem::absolute(output.string() + ".rsp").lexically_normal();
+				command.rspFile = std::filesystem::absolute(linkOutput.string() + ".rsp").lexically_normal();
 				command.command += " @" + str::quote(command.rspFile.string(), '"', "\"");
 			}
 			else
@@ -553,9 +1290,9 @@ void GccLikeToolchainProvider::process(Project& project, const std::filesystem::
 				command.command += getLinkerFlags(project, arch, pathOffset, linkerInputStrs, outputStr);
 			}
 			command.inputs = std::move(linkerInputs);
-			command.outputs = {output};
+			command.outputs = {linkOutput};
 			command.workingDirectory = workingDir;
-			command.description = "Linking " + project.name + archMessage + ": " + output.string();
+			command.description = "Linking " + project.name + archMessage + ": " + linkOutput.string();
 			// ar just adds stuff to existing files, so we need to clean it ourselves first.
 			if (project.type == StaticLib)
 			{
@@ -564,6 +1301,11 @@ void GccLikeToolchainProvider::process(Project& project, const std::filesystem::
 				command = commands::chain({removeCommand, command}, command.description);
 			}
 			project.commands += std::move(command);
+
+			if (bolt)
+			{
+				addBoltCommands(project, gccExt.bolt, linkOutput, output, boltDir, workingDir, pathOffset, archMessage);
+			}
 		}
 	}
 
@@ -0,0 +1,245 @@
+#include "git.h"
+
+#include "util/process.h"
+#include "util/string.h"
+
+#include <algorithm>
+#include <cctype>
+#include <optional>
+#include <unordered_set>
+
+namespace
+{
+#if _WIN32
+    const char* const DISCARD_ERRORS = " 2>NUL";
+#else
+    const char* const DISCARD_ERRORS = " 2>/dev/null";
+#endif
+
+    bool runGit(const std::string& arguments, std::string& output)
+    {
+        // Errors go to the null device rather than the output, since warnings would
+        // otherwise end up among the paths.
+        auto result = process::run("git " + arguments + DISCARD_ERRORS);
+        if(result.exitCode != 0)
+        {
+            return false;
+        }
+        output = std::move(result.output);
+        return true;
+    }
+
+    std::vector<std::string_view> splitAt(std::string_view data, char delimiter)
+    {
+        std::vector<std::string_view> result;
+        while(!data.empty())
+        {
+            auto [token, rest] = str::split(data, delimiter);
+            if(!token.empty())
+            {
+                result.push_back(token);
+            }
+            data = rest;
+        }
+        return result;
+    }
+
+    // Paths are compared the way git prints them, relative to the top level with forward slashes
+    std::string comparablePath(std::string_view path)
+    {
+        std::string result(path);
+        while(!result.empty() && result.back() == '/')
+        {
+            result.pop_back();
+        }
+#if _WIN32 || __APPLE__
+        // Case insensitive file systems, where git may print a different case than the build uses
+        std::transform(result.begin(), result.end(), result.begin(), [](unsigned char c) { return (char)std::tolower(c); });
+#endif
+        return result;
+    }
+
+    struct ChangedPaths
+    {
+        // Paths git reported, which may be files or whole directories
+        std::unordered_set<std::string> paths;
+        // Directories containing any of the above
+        std::unordered_set<std::string> parents;
+
+        void add(std::string_view path)
+        {
+            auto [it, inserted] = paths.insert(comparablePath(path));
+            if(!inserted)
+            {
+                return;
+            }
+
+            std::string_view parent = *it;
+            for(auto pos = parent.rfind('/'); pos != std::string_view::npos && pos > 0; pos = parent.rfind('/'))
+            {
+                parent = parent.substr(0, pos);
+                if(!parents.insert(std::string(parent)).second)
+                {
+                    break;
+                }
+            }
+        }
+
+        bool contains(const std::string& path) const
+        {
+            if(paths.count(path) || parents.count(path))
+            {
+                return true;
+            }
+            for(auto pos = path.rfind('/'); pos != std::string::npos && pos > 0; pos = path.rfind('/', pos - 1))
+            {
+                if(paths.count(path.substr(0, pos)))
+                {
+                    return true;
+                }
+            }
+            return false;
+        }
+    };
+
+    // Adds the paths of "git status --porcelain -z" entries, which are "XY path", with
+    // renames and copies followed by their original path.
+    bool addStatusEntries(std::string_view status, ChangedPaths& changed)
+    {
+        auto entries = splitAt(status, '\0');
+        for(size_t i = 0; i < entries.size(); ++i)
+        {
+            auto entry = entries[i];
+            if(entry.size() < 4 || entry[2] != ' ')
+            {
+                return false;
+            }
+            changed.add(entry.substr(3));
+            if(entry[0] == 'R' || entry[0] == 'C')
+            {
+                if(++i >= entries.size())
+                {
+                    return false;
+                }
+                changed.add(entries[i]);
+            }
+        }
+        return true;
+    }
+
+    // Reads the repository's top level and HEAD, and what git status reports as differing from HEAD.
+    bool readStatus(std::string& topLevel, std::string& head, std::string& status, ChangedPaths& changed)
+    {
+        std::string revisions;
+        if(!runGit("rev-parse --show-toplevel HEAD", revisions))
+        {
+            return false;
+        }
+        auto lines = splitAt(revisions, '\n');
+        if(lines.size() != 2)
+        {
+            return false;
+        }
+        topLevel = comparablePath(str::trim(lines[0]));
+        head = std::string(str::trim(lines[1]));
+
+        if(!runGit("-C " + str::quote(topLevel) + " status --porcelain=v1 -z --untracked-files=normal --ignored", status))
+        {
+            return false;
+        }
+        return addStatusEntries(status, changed);
+    }
+
+    // Returns path relative to topLevel, or nothing if it's outside the repository or
+    // one of git's own files, which git doesn't report anything about.
+    std::optional<std::string> repositoryPath(const std::filesystem::path& path, const std::string& topLevel)
+    {
+        auto result = comparablePath(path.generic_string());
+        if(result.size() <= topLevel.size() || !str::startsWith(result, topLevel) || result[topLevel.size()] != '/')
+        {
+            return {};
+        }
+        result.erase(0, topLevel.size() + 1);
+        if(result == ".git" || str::startsWith(result, ".git/") || result.find("/.git/") != std::string::npos)
+        {
+            return {};
+        }
+        return result;
+    }
+}
+
+namespace git
+{
+
+bool findUnchangedFiles(const std::vector<std::filesystem::path>& paths, std::string& state, std::vector<bool>& unchanged)
+{
+    unchanged.assign(paths.size(), false);
+    std::string previousState;
+    std::swap(previousState, state);
+
+    std::string topLevel;
+    std::string head;
+    std::string status;
+    ChangedPaths changed;
+    if(!readStatus(topLevel, head, status, changed))
+    {
+        return false;
+    }
+
+    // The state is the top level, HEAD and everything that differed from it
+    state = topLevel + '\0' + head + '\0' + status;
+
+    // Changes since the previous state are anything that differed from the previous
+    // HEAD then, differs from the current HEAD now, or differs between the two.
+    auto previousEntries = str::split(std::string_view(previousState), '\0');
+    auto previousTopLevel = previousEntries.first;
+    auto [previousHead, previousStatus] = str::split(previousEntries.second, '\0');
+    if(previousTopLevel.empty() || previousTopLevel != topLevel || previousHead.empty() || !addStatusEntries(previousStatus, changed))
+    {
+        return false;
+    }
+    if(previousHead != head)
+    {
+        std::string diff;
+        if(!runGit("-C " + str::quote(topLevel) + " diff --name-only --no-renames -z " + std::string(previousHead) + " " + head, diff))
+        {
+            return false;
+        }
+        for(auto path : splitAt(diff, '\0'))
+        {
+            changed.add(path);
+        }
+    }
+
+    for(size_t i = 0; i < paths.size(); ++i)
+    {
+        if(auto path = repositoryPath(paths[i], topLevel))
+        {
+            unchanged[i] = !changed.contains(*path);
+        }
+    }
+    return true;
+}
+
+bool findChangedFiles(const std::vector<std::filesystem::path>& paths, std::vector<bool>& changed)
+{
+    changed.assign(paths.size(), false);
+
+    std::string topLevel;
+    std::string head;
+    std::string status;
+    ChangedPaths changedPaths;
+    if(!readStatus(topLevel, head, status, changedPaths))
+    {
+        return false;
+    }
+
+    for(size_t i = 0; i < paths.size(); ++i)
+    {
+        auto path = repositoryPath(paths[i], topLevel);
+        changed[i] = path && changedPaths.contains(*path);
+    }
+    return true;
+}
+
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <filesystem>
+#include <string>
+#include <vector>
+
+// Asks the local git repository which files have changed, so dirty checking can
+// skip the ones git knows are untouched. Only runs git locally, never contacting
+// a remote. Any fsmonitor configured for the repository is used by git itself.
+namespace git
+{
+    // Sets unchanged[i] for each of paths that is tracked and has the same contents
+    // as when state was recorded. state is replaced with the current state, to be
+    // passed in next time. Returns false if git can't tell (not a repository, git
+    // missing, no usable previous state), in which case nothing is marked unchanged.
+    bool findUnchangedFiles(const std::vector<std::filesystem::path>& paths, std::string& state, std::vector<bool>& unchanged);
+
+    // Sets changed[i] for each of paths (absolute) that git status reports as modified,
+    // untracked or ignored. Returns false if git can't tell, in which case nothing is set.
+    bool findChangedFiles(const std::vector<std::filesystem::path>& paths, std::vector<bool>& changed);
+}
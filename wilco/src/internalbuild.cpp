@@ -1,4 +1,5 @@
 #include "actions/direct.h"
+#include "autopch.h"
 #include "dependencyparser.h"
 #include "fileutil.h"
 #include "util/commands.h"
@@ -6,11 +7,13 @@
 #include "buildconfigurator.h"
 #include <iostream>
 #include <chrono>
+#include <optional>
 #include <stdexcept>
 #include "util/hash.h"
 #include "util/interrupt.h"
 #include "commandprocessor.h"
 #include "toolchains/cl.h"
+#include "trace.h"
 
 static const int EXIT_RESTART = 10;
 
@@ -65,30 +68,43 @@ void DirectBuilder::run(cli::Context cliContext)
 			std::cout << "--- " << msDuration << "ms ---" << std::endl;
 		}
 	};
+	auto writeTrace = [this] {
+		if (trace)
+		{
+			trace::write(*trace);
+		}
+	};
 	try
 	{
 		cliContext.extractArguments(arguments);
+		if (trace)
+		{
+			trace::enable();
+		}
 
 		BuildConfigurator configurator(cliContext);
 
-		auto filteredCommands = filterCommands(configurator.database, cliContext.startPath, targets.values);
+		ChangeDetection changeDetection;
+		changeDetection.directoryTimes = trustDirectoryTimes.value;
+		changeDetection.git = gitStatus.value;
+		// Picked from what was included last build, so changes are built right away
+		autopch::update(configurator.database);
+
+		size_t maxConcurrentCommands = std::max((size_t)1, (size_t)std::thread::hardware_concurrency());
+		auto result = buildCommands(configurator.database, maxConcurrentCommands, verbose.value, cliContext.startPath, targets.values, changeDetection);
 
-		if (filteredCommands.empty())
+		if (result.dirtyCommands == 0)
 		{
 			std::cout << "Nothing to do. (Everything up to date.)\n"
 					  << std::flush;
 		}
 		else
 		{
-			size_t maxConcurrentCommands = std::max((size_t)1, (size_t)std::thread::hardware_concurrency());
-			std::cout << "Building using " << maxConcurrentCommands << " concurrent tasks.";
-			size_t completedCommands = runCommands(filteredCommands, configurator.database, maxConcurrentCommands, verbose.value);
-
 			std::cout << "\n"
-					  << std::to_string(completedCommands) << " of " << filteredCommands.size() << " targets rebuilt.\n"
+					  << std::to_string(result.completedCommands) << " of " << result.dirtyCommands << " targets rebuilt.\n"
 					  << std::flush;
 
-			if (completedCommands < filteredCommands.size())
+			if (result.completedCommands < result.dirtyCommands)
 			{
 				throw std::runtime_error("Some targets were not properly rebuilt.");
 			}
@@ -96,6 +112,7 @@ void DirectBuilder::run(cli::Context cliContext)
 	}
 	catch (...)
 	{
+		writeTrace();
 		if (displayTime)
 		{
 			outputBuildTime();
@@ -103,6 +120,7 @@ void DirectBuilder::run(cli::Context cliContext)
 		throw;
 	}
 	
+	writeTrace();
     if (displayTime)
 	{
 		outputBuildTime();
@@ -111,6 +129,9 @@ void DirectBuilder::run(cli::Context cliContext)
 
 void DirectBuilder::buildSelf(cli::Context cliContext)
 {
+    std::optional<trace::Scope> traceScope;
+    traceScope.emplace("Self-update check");
+
     Environment env(cliContext);
 
     auto isSubProcess = false;
@@ -166,6 +187,7 @@ void DirectBuilder::buildSelf(cli::Context cliContext)
     }
 
     auto filteredCommands = filterCommands(database, cliContext.startPath, {});
+    traceScope.reset();
 
     // If nothing is to be done...
     if(filteredCommands.empty())
@@ -180,7 +202,7 @@ void DirectBuilder::buildSelf(cli::Context cliContext)
     }
 
     // Something has changed, so we rebuild
-    std::cout << "\nRebuilding Wilco." << std::flush;
+    std::cout << "\nRebuilding Wilco." << std::endl;
 
     // ...but first we need to move ourselves out of the way.
     std::filesystem::rename(buildOutput, tempPath);
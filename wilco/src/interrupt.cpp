@@ -4,6 +4,7 @@
 #if _WIN32
 
 #include <windows.h>
+#include <atomic>
 #include <mutex>
 #include <io.h>
 #include <signal.h>
@@ -40,7 +41,7 @@ void logSignal(int signal)
     }
 }
 
-static bool interrupted = false;
+static std::atomic<bool> interrupted = false;
 
 static std::mutex runLock;
 
@@ -108,13 +109,22 @@ bool isInterrupted()
     return interrupted;
 }
 
+void setInterrupted(bool value)
+{
+    interrupted = value;
+}
+
 }
 
 #else
 
+#include <atomic>
+
 namespace interrupt
 {
 
+static std::atomic<bool> interrupted = false;
+
 void installHandlers()
 {
     // TODO
@@ -122,8 +132,13 @@ void installHandlers()
 
 bool isInterrupted()
 {
-    // TODO
-    return false;
+    // TODO: Nothing but setInterrupted sets this yet
+    return interrupted;
+}
+
+void setInterrupted(bool value)
+{
+    interrupted = value;
 }
 
 }
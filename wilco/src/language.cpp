@@ -22,6 +22,9 @@ std::unordered_map<std::string, Language>& Language::getExtensionMap()
         { ".c", lang::C },
         { ".cpp", lang::Cpp },
         { ".cxx", lang::Cpp },
+        { ".cppm", lang::CppModule },
+        { ".ixx", lang::CppModule },
+        { ".mpp", lang::CppModule },
         { ".m", lang::ObjectiveC },
         { ".mm", lang::ObjectiveCpp },
         { ".rc", lang::Rc},
@@ -6,6 +6,7 @@
 #include "util/interrupt.h"
 #include "dependencyparser.h"
 #include "fileutil.h"
+#include "trace.h"
 
 #include <sstream>
 #include <chrono>
@@ -62,6 +63,10 @@ int defaultMain(int argc, const char** argv) {
     try
     {
         cliContext.extractArguments(cli::Argument::globalList());
+        if(profilePhases)
+        {
+            trace::enableProfiling();
+        }
         if(!noRebuild)
         {
             DirectBuilder::buildSelf(cliContext);
@@ -102,8 +107,17 @@ int defaultMain(int argc, const char** argv) {
     catch(const std::exception& e)
     {
         std::cerr << "ERROR: " << e.what() << '\n';
+        if(trace::isProfilingEnabled())
+        {
+            trace::printProfile(std::cout);
+        }
         return -1;
     }
 
+    // Not checking the argument itself, since configuring resets global arguments
+    if(trace::isProfilingEnabled())
+    {
+        trace::printProfile(std::cout);
+    }
     return 0;
 }
@@ -135,6 +135,7 @@ static std::string emitProject(Environment& env, const std::filesystem::path& pr
     }
 
 	toolchain->process(project, projectDir, dataDir);
+	BuildConfigurator::addToolchainConfigurationDependencies(env, project);
 
 	std::vector<std::string> projectOutputs;
 	const auto& toolchainOutputs = project.ext<extensions::internal::ToolchainOutputs>();
@@ -0,0 +1,105 @@
+#include "util/path.h"
+
+#include <mutex>
+
+namespace paths
+{
+
+bool isAbsoluteNormal(std::string_view path)
+{
+#if _WIN32
+    // Only plain drive letter paths are handled, anything else takes the slow path
+    if(path.size() < 3 || path[1] != ':' || path[2] != '\\' ||
+       !((path[0] >= 'a' && path[0] <= 'z') || (path[0] >= 'A' && path[0] <= 'Z')))
+    {
+        return false;
+    }
+    if(path.find('/') != std::string_view::npos)
+    {
+        return false;
+    }
+    const char separator = '\\';
+    path.remove_prefix(2);
+#else
+    if(path.empty() || path[0] != '/')
+    {
+        return false;
+    }
+    const char separator = '/';
+#endif
+
+    // Every element between separators must be non-empty and not "." or ".."
+    size_t pos = 1;
+    while(pos < path.size())
+    {
+        size_t end = path.find(separator, pos);
+        if(end == std::string_view::npos)
+        {
+            end = path.size();
+        }
+        auto element = path.substr(pos, end - pos);
+        if(element == "." || element == "..")
+        {
+            return false;
+        }
+        // An empty element means a doubled separator, but a single trailing one is kept by lexically_normal
+        if(element.empty() && end != path.size())
+        {
+            return false;
+        }
+        pos = end + 1;
+    }
+
+    return true;
+}
+
+NormalizationCache::NormalizationCache()
+    : NormalizationCache(std::filesystem::current_path())
+{ }
+
+NormalizationCache::NormalizationCache(std::filesystem::path workingDirectory)
+    : _workingDirectory(std::move(workingDirectory))
+{ }
+
+const std::filesystem::path& NormalizationCache::absoluteNormal(std::string_view path)
+{
+    {
+        std::shared_lock lock(_mutex);
+        auto it = _entries.find(path);
+        if(it != _entries.end())
+        {
+            return it->second;
+        }
+    }
+
+    std::filesystem::path normalized;
+    if(isAbsoluteNormal(path))
+    {
+        normalized = path;
+    }
+    else
+    {
+        std::filesystem::path rawPath(path);
+        normalized = (rawPath.is_absolute() ? rawPath : _workingDirectory / rawPath).lexically_normal();
+    }
+
+    std::unique_lock lock(_mutex);
+    auto it = _entries.find(path);
+    if(it != _entries.end())
+    {
+        return it->second;
+    }
+    auto& key = _keys.emplace_back(path);
+    return _entries.emplace(key, std::move(normalized)).first->second;
+}
+
+const std::filesystem::path& NormalizationCache::absoluteNormal(const std::filesystem::path& path)
+{
+#if _WIN32
+    return absoluteNormal(path.string());
+#else
+    return absoluteNormal(std::string_view(path.native()));
+#endif
+}
+
+}
@@ -72,6 +72,20 @@ std::filesystem::path findCurrentModulePath()
 #endif
 
 ProcessResult run(std::string command, bool echoOutput)
+{
+    if(!echoOutput)
+    {
+        return run(std::move(command), OutputCallback());
+    }
+
+    return run(std::move(command), OutputCallback([](std::string_view output)
+    {
+        std::cout.write(output.data(), output.size());
+        std::cout.flush();
+    }));
+}
+
+ProcessResult run(std::string command, const OutputCallback& outputCallback)
 {
     ProcessResult result;
     {
@@ -87,10 +101,9 @@ ProcessResult run(std::string command, bool echoOutput)
                     break;
                 }
                 result.output.append(buffer.data(), bytesRead);
-                if(echoOutput)
+                if(outputCallback)
                 {
-                    std::cout.write(buffer.data(), bytesRead);
-                    std::cout.flush();
+                    outputCallback(std::string_view(buffer.data(), bytesRead));
                 }
             }
         }
@@ -1,6 +1,7 @@
 #include <assert.h>
 
 #include "core/project.h"
+#include "util/hash.h"
 
 Project::Project(std::string name, ProjectType type)
     : name(name)
@@ -29,6 +30,27 @@ void BuildSettings::importExtensions(const BuildSettings& other)
     }
 }
 
+bool BuildSettings::digest(hash::Md5& hasher) const
+{
+    hash::digestList(hasher, includePaths);
+    hash::digestList(hasher, libPaths);
+    hash::digestList(hasher, libs);
+    hash::digestList(hasher, systemLibs);
+    hash::digestList(hasher, defines);
+    hash::digestList(hasher, features);
+    hash::digestList(hasher, frameworks);
+
+    for(auto& extension : _extensions)
+    {
+        hash::digestValue(hasher, std::to_string(extension.first));
+        if(!extension.second->digest(hasher))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
 void Project::import(const Project& other, bool reexport)
 {
     dependencies += &other;
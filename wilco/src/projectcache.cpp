@@ -0,0 +1,313 @@
+#include "projectcache.h"
+#include "core/project.h"
+#include "modules/toolchain.h"
+#include "toolchains/detected.h"
+#include "util/hash.h"
+#include "fileutil.h"
+
+#include <stdexcept>
+
+namespace
+{
+    #pragma pack(1)
+    struct Header
+    {
+        uint32_t magic = 0x70726a63; // "prjc"
+        uint32_t version = 2;
+        Signature key = {};
+    };
+    #pragma pack()
+
+    void writeUInt(std::string& data, uint32_t value)
+    {
+        data.append(reinterpret_cast<const char*>(&value), sizeof(value));
+    }
+
+    void writeString(std::string& data, std::string_view value)
+    {
+        writeUInt(data, value.size());
+        data.append(value);
+    }
+
+    void writePaths(std::string& data, const std::vector<std::filesystem::path>& paths)
+    {
+        writeUInt(data, paths.size());
+        for(auto& path : paths)
+        {
+            writeString(data, path.string());
+        }
+    }
+
+    void writeCommand(std::string& data, const CommandEntry& command)
+    {
+        writeString(data, command.command);
+        writePaths(data, command.inputs);
+        writePaths(data, command.outputs);
+        writeString(data, command.workingDirectory.string());
+        writeString(data, command.depFile.path.string());
+        writeUInt(data, command.depFile.format);
+        writeString(data, command.description);
+        writeString(data, command.rspFile.string());
+        writeString(data, command.rspContents);
+        writeString(data, command.moduleScan.path.string());
+        writeString(data, command.moduleScan.moduleOutput.string());
+        writeString(data, command.moduleScan.mapFile.string());
+        writeUInt(data, command.moduleScan.format);
+        writeString(data, command.dyndepFile.string());
+    }
+
+    void readData(std::string_view data, size_t& pos, void* output, size_t size)
+    {
+        if(data.size() - pos < size)
+        {
+            throw std::runtime_error("Reading past the end of input.");
+        }
+        std::memcpy(output, data.data() + pos, size);
+        pos += size;
+    }
+
+    uint32_t readUInt(std::string_view data, size_t& pos)
+    {
+        uint32_t value = 0;
+        readData(data, pos, &value, sizeof(value));
+        return value;
+    }
+
+    std::string_view readString(std::string_view data, size_t& pos)
+    {
+        auto size = readUInt(data, pos);
+        if(data.size() - pos < size)
+        {
+            throw std::runtime_error("Reading past the end of input.");
+        }
+        pos += size;
+        return data.substr(pos - size, size);
+    }
+
+    std::vector<std::filesystem::path> readPaths(std::string_view data, size_t& pos)
+    {
+        auto count = readUInt(data, pos);
+        std::vector<std::filesystem::path> paths;
+        paths.reserve(std::min<size_t>(count, data.size() - pos));
+        for(uint32_t i = 0; i < count; ++i)
+        {
+            paths.emplace_back(readString(data, pos));
+        }
+        return paths;
+    }
+
+    CommandEntry readCommand(std::string_view data, size_t& pos)
+    {
+        CommandEntry command;
+        command.command = readString(data, pos);
+        command.inputs = readPaths(data, pos);
+        command.outputs = readPaths(data, pos);
+        command.workingDirectory = readString(data, pos);
+        command.depFile.path = readString(data, pos);
+        command.depFile.format = (DepFile::Format)readUInt(data, pos);
+        command.description = readString(data, pos);
+        command.rspFile = readString(data, pos);
+        command.rspContents = readString(data, pos);
+        command.moduleScan.path = readString(data, pos);
+        command.moduleScan.moduleOutput = readString(data, pos);
+        command.moduleScan.mapFile = readString(data, pos);
+        command.moduleScan.format = (ModuleScan::Format)readUInt(data, pos);
+        command.dyndepFile = readString(data, pos);
+        return command;
+    }
+}
+
+bool ProjectCache::load(const std::filesystem::path& path, const Signature& key)
+{
+    _entries.clear();
+
+    std::error_code ec;
+    if(!std::filesystem::exists(path, ec))
+    {
+        return false;
+    }
+
+    try
+    {
+        auto data = readFile(path);
+        size_t pos = 0;
+
+        Header header;
+        Header expectedHeader;
+        readData(data, pos, &header, sizeof(header));
+        if(header.magic != expectedHeader.magic || header.version != expectedHeader.version || header.key != key)
+        {
+            return false;
+        }
+
+        auto count = readUInt(data, pos);
+        for(uint32_t i = 0; i < count; ++i)
+        {
+            auto& entry = _entries[std::string(readString(data, pos))];
+            readData(data, pos, entry.settings.data(), entry.settings.size());
+
+            auto commandCount = readUInt(data, pos);
+            entry.commands.reserve(std::min<size_t>(commandCount, data.size() - pos));
+            for(uint32_t j = 0; j < commandCount; ++j)
+            {
+                entry.commands.push_back(readCommand(data, pos));
+            }
+
+            auto outputCount = readUInt(data, pos);
+            for(uint32_t j = 0; j < outputCount; ++j)
+            {
+                auto& outputs = entry.outputs[std::string(readString(data, pos))];
+                outputs.objectFiles = readPaths(data, pos);
+                outputs.libraryFiles = readPaths(data, pos);
+                outputs.configurationDependencies = readPaths(data, pos);
+            }
+        }
+    }
+    catch(const std::exception&)
+    {
+        _entries.clear();
+        return false;
+    }
+
+    return true;
+}
+
+void ProjectCache::save(const std::filesystem::path& path, const Signature& key) const
+{
+    std::string data;
+    Header header;
+    header.key = key;
+    data.append(reinterpret_cast<const char*>(&header), sizeof(header));
+
+    writeUInt(data, _entries.size());
+    for(auto& [name, entry] : _entries)
+    {
+        writeString(data, name);
+        data.append(reinterpret_cast<const char*>(entry.settings.data()), entry.settings.size());
+
+        writeUInt(data, entry.commands.size());
+        for(auto& command : entry.commands)
+        {
+            writeCommand(data, command);
+        }
+
+        writeUInt(data, entry.outputs.size());
+        for(auto& [arch, outputs] : entry.outputs)
+        {
+            writeString(data, arch);
+            writePaths(data, outputs.objectFiles);
+            writePaths(data, outputs.libraryFiles);
+            writePaths(data, outputs.configurationDependencies);
+        }
+    }
+
+    writeFile(path, data, false);
+}
+
+std::optional<Signature> ProjectCache::digestProject(const Project& project, const std::filesystem::path& projectDir)
+{
+    const ToolchainProvider* toolchain = project.toolchain ? project.toolchain : defaultToolchain;
+
+    hash::Md5 hasher;
+    hash::digestValue(hasher, project.name);
+    hash::digestValue(hasher, std::to_string(project.type));
+    hash::digestValue(hasher, projectDir);
+    hash::digestValue(hasher, std::filesystem::current_path());
+    hash::digestValue(hasher, toolchain->name);
+    if(!toolchain->digest(project, hasher) || !project.digest(hasher))
+    {
+        return {};
+    }
+
+    hash::digestValue(hasher, std::to_string(project.commands.size()));
+    for(auto& command : project.commands)
+    {
+        auto signature = computeCommandSignature(command);
+        hasher.digest(reinterpret_cast<const char*>(signature.data()), signature.size());
+        hash::digestValue(hasher, command.description);
+        hash::digestValue(hasher, command.depFile.path);
+        hash::digestValue(hasher, std::to_string(command.depFile.format));
+        hash::digestValue(hasher, command.rspFile);
+    }
+
+    hash::digestValue(hasher, std::to_string(project.files.size()));
+    for(auto& file : project.files)
+    {
+        hash::digestValue(hasher, file.path);
+        hash::digestValue(hasher, file.language);
+    }
+
+    hash::digestValue(hasher, project.dataDir);
+    hash::digestList(hasher, project.architectures);
+    for(auto& [arch, settings] : project.archSettings)
+    {
+        hash::digestValue(hasher, arch);
+        if(!settings.digest(hasher))
+        {
+            return {};
+        }
+    }
+    hash::digestValue(hasher, project.output.fullPath());
+
+    hash::digestValue(hasher, std::to_string(project.dependencies.size()));
+    for(auto dependency : project.dependencies)
+    {
+        hash::digestValue(hasher, dependency->name);
+    }
+
+    return hasher.finalize();
+}
+
+bool ProjectCache::restore(Project& project, const Signature& settings, std::vector<CommandEntry>& commands) const
+{
+    auto it = _entries.find(project.name);
+    if(it == _entries.end() || it->second.settings != settings)
+    {
+        return false;
+    }
+
+    auto& entry = it->second;
+    commands.insert(commands.end(), entry.commands.begin(), entry.commands.end());
+    for(auto& [archId, outputs] : entry.outputs)
+    {
+        Architecture arch;
+        arch.id = archId;
+        auto& toolchainOutputs = archId.empty() ? project.ext<extensions::internal::ToolchainOutputs>() : project.archSettings[arch].ext<extensions::internal::ToolchainOutputs>();
+        toolchainOutputs.objectFiles = outputs.objectFiles;
+        toolchainOutputs.libraryFiles = outputs.libraryFiles;
+        toolchainOutputs.configurationDependencies = outputs.configurationDependencies;
+    }
+    return true;
+}
+
+void ProjectCache::store(const Project& project, const Signature& settings, std::vector<CommandEntry> commands)
+{
+    auto& entry = _entries[project.name];
+    entry.settings = settings;
+    entry.commands = std::move(commands);
+    entry.outputs.clear();
+
+    auto storeOutputs = [&entry](const std::string& arch, const extensions::internal::ToolchainOutputs& toolchainOutputs)
+    {
+        auto& outputs = entry.outputs[arch];
+        outputs.objectFiles = toolchainOutputs.objectFiles.vector();
+        outputs.libraryFiles = toolchainOutputs.libraryFiles.vector();
+        outputs.configurationDependencies = toolchainOutputs.configurationDependencies.vector();
+    };
+    if(project.hasExt<extensions::internal::ToolchainOutputs>())
+    {
+        storeOutputs({}, project.ext<extensions::internal::ToolchainOutputs>());
+    }
+    for(auto& [arch, archSettings] : project.archSettings)
+    {
+        if(archSettings.hasExt<extensions::internal::ToolchainOutputs>())
+        {
+            storeOutputs(arch.id, archSettings.ext<extensions::internal::ToolchainOutputs>());
+        }
+    }
+}
+
+size_t ProjectCache::size() const
+{
+    return _entries.size();
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <filesystem>
+#include <map>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "database.h"
+
+struct Project;
+
+// Commands and toolchain outputs of each project from the last time the configuration ran,
+// reused for projects whose settings hash the same, so reconfiguring only processes the
+// projects that changed. The cache as a whole is dropped when key changes, which covers
+// what all projects depend on, like the configuration binary itself.
+class ProjectCache
+{
+public:
+    bool load(const std::filesystem::path& path, const Signature& key);
+    void save(const std::filesystem::path& path, const Signature& key) const;
+
+    // Hashes everything the project's commands are made from: its settings, its dependencies'
+    // toolchain outputs, what its toolchain reads, and where it's built. Nothing is returned if
+    // some of that can't be hashed, and then the project can't be cached.
+    static std::optional<Signature> digestProject(const Project& project, const std::filesystem::path& projectDir);
+
+    // Adds the project's commands as last collected, and restores its toolchain outputs,
+    // if the cached commands were made from the same settings.
+    bool restore(Project& project, const Signature& settings, std::vector<CommandEntry>& commands) const;
+    void store(const Project& project, const Signature& settings, std::vector<CommandEntry> commands);
+
+    size_t size() const;
+
+private:
+    struct Outputs
+    {
+        std::vector<std::filesystem::path> objectFiles;
+        std::vector<std::filesystem::path> libraryFiles;
+        std::vector<std::filesystem::path> configurationDependencies;
+    };
+
+    struct Entry
+    {
+        Signature settings;
+        std::vector<CommandEntry> commands;
+        // By architecture, with the project's own under ""
+        std::map<std::string, Outputs> outputs;
+    };
+
+    std::map<std::string, Entry> _entries;
+};
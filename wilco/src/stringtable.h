@@ -0,0 +1,69 @@
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// Stores each distinct string once and hands out a stable index for it. Used by the
+// build database, where the same flags, directories and paths show up in thousands
+// of commands.
+class StringTable
+{
+public:
+    using Id = uint32_t;
+
+    Id add(std::string_view str)
+    {
+        auto it = _ids.find(str);
+        if(it != _ids.end())
+        {
+            return it->second;
+        }
+
+        // Deque elements never move, so views into them stay valid as the table grows
+        return insert(_storage.emplace_back(str));
+    }
+
+    // Same as add, but without copying str, which has to outlive the table.
+    Id addView(std::string_view str)
+    {
+        auto it = _ids.find(str);
+        if(it != _ids.end())
+        {
+            return it->second;
+        }
+        return insert(str);
+    }
+
+    void reserve(size_t size)
+    {
+        _strings.reserve(size);
+        _ids.reserve(size);
+    }
+
+    std::string_view get(Id id) const
+    {
+        return _strings[id];
+    }
+
+    size_t size() const
+    {
+        return _strings.size();
+    }
+
+private:
+    Id insert(std::string_view str)
+    {
+        Id id = (Id)_strings.size();
+        _strings.push_back(str);
+        _ids.emplace(str, id);
+        return id;
+    }
+
+    std::deque<std::string> _storage;
+    std::vector<std::string_view> _strings;
+    std::unordered_map<std::string_view, Id> _ids;
+};
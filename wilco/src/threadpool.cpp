@@ -0,0 +1,223 @@
+#include "threadpool.h"
+
+namespace
+{
+    // Lets tasks submitted from a worker go to that worker's own queue
+    thread_local const ThreadPool* currentPool = nullptr;
+    thread_local size_t currentWorkerIndex = 0;
+}
+
+ThreadPool::ThreadPool(size_t threadCount)
+{
+    addWorkers(std::max((size_t)1, threadCount));
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::scoped_lock lock(_wakeMutex);
+        _stopping = true;
+    }
+    _wakeCondition.notify_all();
+
+    std::shared_lock workersLock(_workersMutex);
+    for(auto& worker : _workers)
+    {
+        worker->thread.join();
+    }
+}
+
+ThreadPool& ThreadPool::instance()
+{
+    static ThreadPool pool(defaultThreadCount());
+    return pool;
+}
+
+size_t ThreadPool::defaultThreadCount()
+{
+    return std::max((size_t)1, (size_t)std::thread::hardware_concurrency());
+}
+
+size_t ThreadPool::threadCount() const
+{
+    std::shared_lock workersLock(_workersMutex);
+    return _workers.size();
+}
+
+void ThreadPool::reserveThreads(size_t threadCount)
+{
+    size_t current = this->threadCount();
+    if(current < threadCount)
+    {
+        addWorkers(threadCount - current);
+    }
+}
+
+void ThreadPool::addWorkers(size_t count)
+{
+    std::unique_lock workersLock(_workersMutex);
+    for(size_t i = 0; i < count; ++i)
+    {
+        size_t index = _workers.size();
+        _workers.push_back(std::make_unique<Worker>());
+        _workers.back()->thread = std::thread([this, index]() { workerLoop(index); });
+    }
+}
+
+void ThreadPool::submit(Task task)
+{
+    {
+        std::shared_lock workersLock(_workersMutex);
+        size_t index = currentPool == this ? currentWorkerIndex : _nextWorker++ % _workers.size();
+        auto& worker = *_workers[index];
+        std::scoped_lock lock(worker.mutex);
+        worker.tasks.push_back(std::move(task));
+    }
+
+    ++_pendingTasks;
+    {
+        // Taking the lock makes sure a worker that just found the queues empty
+        // has gone to sleep before we notify it.
+        std::scoped_lock lock(_wakeMutex);
+    }
+    _wakeCondition.notify_one();
+}
+
+bool ThreadPool::popTask(size_t preferredIndex, Task& task)
+{
+    std::shared_lock workersLock(_workersMutex);
+    size_t numWorkers = _workers.size();
+    if(preferredIndex < numWorkers)
+    {
+        // Own queue is used as a stack for better locality...
+        auto& worker = *_workers[preferredIndex];
+        std::scoped_lock lock(worker.mutex);
+        if(!worker.tasks.empty())
+        {
+            task = std::move(worker.tasks.back());
+            worker.tasks.pop_back();
+            --_pendingTasks;
+            return true;
+        }
+    }
+
+    // ...while stealing takes the oldest task of someone else
+    for(size_t offset = 1; offset <= numWorkers; ++offset)
+    {
+        auto& worker = *_workers[(preferredIndex + offset) % numWorkers];
+        std::scoped_lock lock(worker.mutex);
+        if(!worker.tasks.empty())
+        {
+            task = std::move(worker.tasks.front());
+            worker.tasks.pop_front();
+            --_pendingTasks;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void ThreadPool::workerLoop(size_t index)
+{
+    currentPool = this;
+    currentWorkerIndex = index;
+
+    while(true)
+    {
+        Task task;
+        if(popTask(index, task))
+        {
+            task();
+            continue;
+        }
+
+        std::unique_lock lock(_wakeMutex);
+        _wakeCondition.wait(lock, [this]() { return _stopping || _pendingTasks > 0; });
+        if(_stopping && _pendingTasks == 0)
+        {
+            return;
+        }
+    }
+}
+
+TaskGroup::TaskGroup(ThreadPool& pool)
+    : _pool(pool)
+    , _state(std::make_shared<State>())
+{ }
+
+TaskGroup::~TaskGroup()
+{
+    // Tasks reference the group's creator, so never let it go away under them
+    std::unique_lock lock(_state->mutex);
+    _state->doneCondition.wait(lock, [this]() { return _state->remaining == 0; });
+}
+
+void TaskGroup::run(ThreadPool::Task task)
+{
+    {
+        std::scoped_lock lock(_state->mutex);
+        _state->tasks.push_back(std::move(task));
+        ++_state->remaining;
+    }
+
+    // Each pool task runs whichever of the group's tasks is next, if waiting hasn't already
+    _pool.submit([state = _state]()
+    {
+        runQueuedTask(*state);
+    });
+}
+
+bool TaskGroup::runQueuedTask(State& state)
+{
+    ThreadPool::Task task;
+    {
+        std::scoped_lock lock(state.mutex);
+        if(state.tasks.empty())
+        {
+            return false;
+        }
+        task = std::move(state.tasks.front());
+        state.tasks.pop_front();
+    }
+
+    try
+    {
+        task();
+    }
+    catch(...)
+    {
+        std::scoped_lock lock(state.mutex);
+        if(!state.exception)
+        {
+            state.exception = std::current_exception();
+        }
+    }
+
+    std::scoped_lock lock(state.mutex);
+    if(--state.remaining == 0)
+    {
+        state.doneCondition.notify_all();
+    }
+    return true;
+}
+
+void TaskGroup::wait()
+{
+    // Help out while waiting. Once nothing is left to pick up, the remaining
+    // tasks are already running elsewhere and we can just block.
+    while(runQueuedTask(*_state))
+    {
+    }
+
+    std::exception_ptr exception;
+    {
+        std::unique_lock lock(_state->mutex);
+        _state->doneCondition.wait(lock, [this]() { return _state->remaining == 0; });
+        std::swap(exception, _state->exception);
+    }
+    if(exception)
+    {
+        std::rethrow_exception(exception);
+    }
+}
@@ -0,0 +1,142 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+// Process wide pool of worker threads. Each worker has its own task queue, and
+// idle workers steal from the others, so tasks spawned from within a task stay
+// on the same thread unless someone else is out of work.
+class ThreadPool
+{
+public:
+    using Task = std::function<void()>;
+
+    explicit ThreadPool(size_t threadCount);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool& other) = delete;
+    ThreadPool& operator=(const ThreadPool& other) = delete;
+
+    // The shared pool, sized to the hardware concurrency.
+    static ThreadPool& instance();
+    // Hardware concurrency, or 1 if it isn't known. Callers sizing work for the machine
+    // should use this rather than threadCount, which grows with reserveThreads.
+    static size_t defaultThreadCount();
+
+    size_t threadCount() const;
+
+    // Makes sure there are at least threadCount workers. Used by callers that
+    // park a blocking task per worker (e.g. running processes) and need a
+    // guaranteed number of slots.
+    void reserveThreads(size_t threadCount);
+
+    void submit(Task task);
+
+    template<typename Callable>
+    auto async(Callable callable) -> std::future<std::invoke_result_t<Callable>>
+    {
+        using Result = std::invoke_result_t<Callable>;
+        auto task = std::make_shared<std::packaged_task<Result()>>(std::move(callable));
+        auto future = task->get_future();
+        submit([task]() { (*task)(); });
+        return future;
+    }
+
+private:
+    struct Worker
+    {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+        std::thread thread;
+    };
+
+    void addWorkers(size_t count);
+    void workerLoop(size_t index);
+    bool popTask(size_t preferredIndex, Task& task);
+
+    mutable std::shared_mutex _workersMutex;
+    std::vector<std::unique_ptr<Worker>> _workers;
+    std::mutex _wakeMutex;
+    std::condition_variable _wakeCondition;
+    std::atomic<size_t> _pendingTasks = 0;
+    std::atomic<size_t> _nextWorker = 0;
+    std::atomic<bool> _stopping = false;
+};
+
+// A set of tasks that can be waited on as a unit. Waiting runs the group's own tasks
+// that haven't been picked up yet, so it is safe to wait on a group from within a pool
+// task. It never runs other pool tasks, which may block for a long time (like running
+// a process).
+class TaskGroup
+{
+public:
+    TaskGroup(ThreadPool& pool = ThreadPool::instance());
+    ~TaskGroup();
+
+    TaskGroup(const TaskGroup& other) = delete;
+    TaskGroup& operator=(const TaskGroup& other) = delete;
+
+    void run(ThreadPool::Task task);
+
+    // Waits for all tasks in the group, rethrowing the first exception thrown by any of them.
+    void wait();
+
+private:
+    // Shared with the pool tasks, which may outlive the group when waiting ran their task
+    struct State
+    {
+        std::mutex mutex;
+        std::condition_variable doneCondition;
+        std::deque<ThreadPool::Task> tasks;
+        size_t remaining = 0;
+        std::exception_ptr exception;
+    };
+
+    // Runs one of the group's tasks that nobody has started, if there is one.
+    static bool runQueuedTask(State& state);
+
+    ThreadPool& _pool;
+    std::shared_ptr<State> _state;
+};
+
+// Calls callable(begin, end) for consecutive chunks of [0, count) on the thread pool
+// and waits for all of them. A chunkSize of 0 picks a chunk size giving a few chunks
+// per worker, which balances well enough when the cost per item varies.
+template<typename Callable>
+void parallelFor(size_t count, size_t chunkSize, Callable callable, ThreadPool& pool = ThreadPool::instance())
+{
+    if(count == 0)
+    {
+        return;
+    }
+
+    if(chunkSize == 0)
+    {
+        chunkSize = std::max((size_t)1, count / (pool.threadCount() * 4));
+    }
+
+    if(chunkSize >= count)
+    {
+        callable((size_t)0, count);
+        return;
+    }
+
+    TaskGroup group(pool);
+    for(size_t begin = 0; begin < count; begin += chunkSize)
+    {
+        size_t end = std::min(count, begin + chunkSize);
+        group.run([&callable, begin, end]() { callable(begin, end); });
+    }
+    group.wait();
+}
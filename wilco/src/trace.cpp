@@ -0,0 +1,391 @@
+#include "trace.h"
+#include "fileutil.h"
+#include "util/string.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <new>
+#include <set>
+#include <vector>
+
+#if _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/resource.h>
+#endif
+
+namespace trace
+{
+
+namespace
+{
+    struct Event
+    {
+        std::string name;
+        const char* category;
+        Clock::time_point start;
+        Clock::time_point end;
+        uint32_t thread;
+    };
+
+    struct Phase
+    {
+        const char* name;
+        size_t parent;
+        uint64_t calls = 0;
+        Clock::duration time = {};
+        std::chrono::microseconds systemTime = {};
+        uint64_t allocatedBytes = 0;
+        uint64_t allocations = 0;
+    };
+
+    std::atomic<bool> enabled = false;
+    Clock::time_point startTime;
+    std::mutex eventMutex;
+    std::vector<Event> events;
+
+    std::atomic<bool> profiling = false;
+    std::atomic<uint64_t> allocatedBytes = 0;
+    std::atomic<uint64_t> allocations = 0;
+    std::mutex phaseMutex;
+    std::vector<Phase> phases;
+    size_t currentPhase = SIZE_MAX;
+
+    int64_t toMicroseconds(Clock::duration duration)
+    {
+        return std::chrono::duration_cast<std::chrono::microseconds>(duration).count();
+    }
+}
+
+void enable()
+{
+    std::scoped_lock lock(eventMutex);
+    if(!enabled)
+    {
+        startTime = Clock::now();
+        enabled = true;
+    }
+}
+
+bool isEnabled()
+{
+    return enabled;
+}
+
+void record(std::string name, const char* category, Clock::time_point start, Clock::time_point end, uint32_t thread)
+{
+    if(!enabled)
+    {
+        return;
+    }
+
+    std::scoped_lock lock(eventMutex);
+    events.push_back({std::move(name), category, start, end, thread});
+}
+
+void write(const std::filesystem::path& path)
+{
+    std::scoped_lock lock(eventMutex);
+
+    std::set<uint32_t> threads = { MAIN_THREAD };
+    std::string json = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+    for(auto& event : events)
+    {
+        threads.insert(event.thread);
+        json += "{\"name\":" + str::quote(event.name) +
+                ",\"cat\":\"" + event.category + "\"" +
+                ",\"ph\":\"X\",\"pid\":1,\"tid\":" + std::to_string(event.thread) +
+                ",\"ts\":" + std::to_string(toMicroseconds(event.start - startTime)) +
+                ",\"dur\":" + std::to_string(toMicroseconds(event.end - event.start)) + "},\n";
+    }
+
+    // Name the trace threads so slots and check workers show up as such in the viewer
+    for(auto thread : threads)
+    {
+        std::string threadName = thread == MAIN_THREAD ? "wilco" : thread >= FIRST_CHECK_THREAD ? "check " + std::to_string(thread - FIRST_CHECK_THREAD + 1) : "slot " + std::to_string(thread);
+        json += "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" + std::to_string(thread) +
+                ",\"args\":{\"name\":\"" + threadName + "\"}}";
+        json += thread != *threads.rbegin() ? ",\n" : "\n";
+    }
+    json += "]}\n";
+
+    writeFile(path, json, false);
+}
+
+void enableProfiling()
+{
+    profiling = true;
+}
+
+bool isProfilingEnabled()
+{
+    return profiling;
+}
+
+std::chrono::microseconds systemTime()
+{
+#if _WIN32
+    FILETIME creation, exit, kernel, user;
+    if(!GetProcessTimes(GetCurrentProcess(), &creation, &exit, &kernel, &user))
+    {
+        return {};
+    }
+    // In 100 nanosecond units
+    uint64_t time = ((uint64_t)kernel.dwHighDateTime << 32) | kernel.dwLowDateTime;
+    return std::chrono::microseconds(time / 10);
+#else
+    rusage usage;
+    if(getrusage(RUSAGE_SELF, &usage) != 0)
+    {
+        return {};
+    }
+    return std::chrono::seconds(usage.ru_stime.tv_sec) + std::chrono::microseconds(usage.ru_stime.tv_usec);
+#endif
+}
+
+bool countsAllocations()
+{
+#if WILCO_COUNT_ALLOCATIONS
+    return true;
+#else
+    return false;
+#endif
+}
+
+uint64_t totalAllocations()
+{
+    return allocations;
+}
+
+uint64_t totalAllocatedBytes()
+{
+    return allocatedBytes;
+}
+
+namespace
+{
+#if WILCO_COUNT_ALLOCATIONS
+    void countAllocation(size_t size)
+    {
+        if(profiling.load(std::memory_order_relaxed))
+        {
+            allocatedBytes.fetch_add(size, std::memory_order_relaxed);
+            allocations.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+#endif
+
+    std::string formatMilliseconds(Clock::duration duration)
+    {
+        char buffer[32];
+        std::snprintf(buffer, sizeof(buffer), "%.1f", std::chrono::duration<double, std::milli>(duration).count());
+        return buffer;
+    }
+
+    std::string formatBytes(uint64_t bytes)
+    {
+        const char* units[] = { "B", "KB", "MB", "GB" };
+        double value = (double)bytes;
+        size_t unit = 0;
+        while(value >= 1024 && unit + 1 < std::size(units))
+        {
+            value /= 1024;
+            ++unit;
+        }
+
+        char buffer[32];
+        std::snprintf(buffer, sizeof(buffer), unit == 0 ? "%.0f %s" : "%.1f %s", value, units[unit]);
+        return buffer;
+    }
+
+    void printPhases(std::ostream& stream, size_t parent, size_t depth)
+    {
+        for(size_t i = 0; i < phases.size(); ++i)
+        {
+            auto& phase = phases[i];
+            if(phase.parent != parent)
+            {
+                continue;
+            }
+
+            stream << str::padRightToSize(std::string(depth * 2, ' ') + phase.name, 36)
+                   << str::padLeftToSize(std::to_string(phase.calls), 6)
+                   << str::padLeftToSize(formatMilliseconds(phase.time), 12)
+                   << str::padLeftToSize(formatMilliseconds(phase.systemTime), 13);
+            if(countsAllocations())
+            {
+                stream << str::padLeftToSize(std::to_string(phase.allocations), 13)
+                       << str::padLeftToSize(formatBytes(phase.allocatedBytes), 12);
+            }
+            stream << "\n";
+
+            printPhases(stream, i, depth + 1);
+        }
+    }
+}
+
+void printProfile(std::ostream& stream)
+{
+    std::scoped_lock lock(phaseMutex);
+
+    stream << str::padRightToSize("Phase", 36)
+           << str::padLeftToSize("Calls", 6)
+           << str::padLeftToSize("Time (ms)", 12)
+           << str::padLeftToSize("System (ms)", 13);
+    if(countsAllocations())
+    {
+        stream << str::padLeftToSize("Allocations", 13)
+               << str::padLeftToSize("Allocated", 12);
+    }
+    stream << "\n";
+    printPhases(stream, SIZE_MAX, 0);
+    stream << std::flush;
+}
+
+Scope::Scope(const char* name, uint32_t thread)
+    : _name(name)
+    , _thread(thread)
+{
+    if(profiling && thread == MAIN_THREAD)
+    {
+        std::scoped_lock lock(phaseMutex);
+        auto it = std::find_if(phases.begin(), phases.end(), [&](const Phase& phase)
+        {
+            return phase.parent == currentPhase && std::strcmp(phase.name, name) == 0;
+        });
+        if(it == phases.end())
+        {
+            phases.push_back({name, currentPhase});
+            it = phases.end() - 1;
+        }
+        _phase = it - phases.begin();
+        currentPhase = _phase;
+
+        _systemTime = systemTime();
+        _allocatedBytes = allocatedBytes;
+        _allocations = allocations;
+    }
+
+    if(enabled || _phase != SIZE_MAX)
+    {
+        _start = Clock::now();
+    }
+}
+
+Scope::~Scope()
+{
+    if(_start == Clock::time_point())
+    {
+        return;
+    }
+
+    auto end = Clock::now();
+    if(enabled)
+    {
+        record(_name, "wilco", _start, end, _thread);
+    }
+
+    if(_phase != SIZE_MAX)
+    {
+        std::scoped_lock lock(phaseMutex);
+        auto& phase = phases[_phase];
+        ++phase.calls;
+        phase.time += end - _start;
+        phase.systemTime += systemTime() - _systemTime;
+        phase.allocatedBytes += allocatedBytes - _allocatedBytes;
+        phase.allocations += allocations - _allocations;
+        currentPhase = phase.parent;
+    }
+}
+
+}
+
+#if WILCO_COUNT_ALLOCATIONS
+// Allocations are counted by replacing the global allocation functions. The array
+// and nothrow variants are specified to forward to these, so they are covered too.
+namespace
+{
+    void* allocate(std::size_t size, std::size_t alignment)
+    {
+        trace::countAllocation(size);
+        if(size == 0)
+        {
+            size = 1;
+        }
+
+        while(true)
+        {
+            void* pointer = nullptr;
+            if(alignment <= alignof(std::max_align_t))
+            {
+                pointer = std::malloc(size);
+            }
+            else
+            {
+#if _WIN32
+                pointer = _aligned_malloc(size, alignment);
+#else
+                // aligned_alloc wants the size to be a multiple of the alignment
+                pointer = std::aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment);
+#endif
+            }
+            if(pointer)
+            {
+                return pointer;
+            }
+
+            auto handler = std::get_new_handler();
+            if(!handler)
+            {
+                throw std::bad_alloc();
+            }
+            handler();
+        }
+    }
+
+    void freeAligned(void* pointer)
+    {
+#if _WIN32
+        _aligned_free(pointer);
+#else
+        std::free(pointer);
+#endif
+    }
+}
+
+void* operator new(std::size_t size)
+{
+    return allocate(size, alignof(std::max_align_t));
+}
+
+void* operator new(std::size_t size, std::align_val_t alignment)
+{
+    return allocate(size, (std::size_t)alignment);
+}
+
+void operator delete(void* pointer) noexcept
+{
+    std::free(pointer);
+}
+
+void operator delete(void* pointer, std::size_t) noexcept
+{
+    std::free(pointer);
+}
+
+void operator delete(void* pointer, std::align_val_t) noexcept
+{
+    freeAligned(pointer);
+}
+
+void operator delete(void* pointer, std::size_t, std::align_val_t) noexcept
+{
+    freeAligned(pointer);
+}
+#endif
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <ostream>
+#include <string>
+
+// Records a timeline of what wilco is doing, for export as a Chrome trace event
+// file (viewable in chrome://tracing or Perfetto). Recording is off unless
+// explicitly enabled, in which case events are collected in memory until written.
+//
+// The same scopes also drive the phase profiler, which sums up time, kernel time
+// and (if counted) allocations per phase of wilco's own work into a table.
+namespace trace
+{
+    using Clock = std::chrono::steady_clock;
+
+    // Trace thread used for wilco's own phases. Command slots are numbered from 1.
+    static constexpr uint32_t MAIN_THREAD = 0;
+    // Trace threads of the workers checking which commands are dirty, numbered from here
+    // so they never clash with command slots.
+    static constexpr uint32_t FIRST_CHECK_THREAD = 1u << 16;
+
+    void enable();
+    bool isEnabled();
+
+    // Records an event spanning [start, end) on the given trace thread.
+    void record(std::string name, const char* category, Clock::time_point start, Clock::time_point end, uint32_t thread = MAIN_THREAD);
+
+    // Writes all recorded events as Chrome trace event json.
+    void write(const std::filesystem::path& path);
+
+    void enableProfiling();
+    bool isProfilingEnabled();
+
+    // Time the OS has spent in the kernel on behalf of the whole process, as
+    // reported by getrusage or GetProcessTimes.
+    std::chrono::microseconds systemTime();
+
+    // Allocations are only counted when wilco is built with WILCO_COUNT_ALLOCATIONS
+    // defined, which replaces the global allocation functions. Otherwise the totals
+    // stay at zero and the profile leaves out its Allocations and Allocated columns
+    // rather than print zeros.
+    bool countsAllocations();
+
+    // Totals counted since profiling was enabled.
+    uint64_t totalAllocations();
+    uint64_t totalAllocatedBytes();
+
+    // Prints time, system time and any counted allocations for each main thread scope,
+    // nested and in the order they were first entered.
+    void printProfile(std::ostream& stream);
+
+    // Records an event for the lifetime of the scope.
+    struct Scope
+    {
+        Scope(const char* name, uint32_t thread = MAIN_THREAD);
+        ~Scope();
+
+        Scope(const Scope& other) = delete;
+        Scope& operator=(const Scope& other) = delete;
+
+    private:
+        const char* _name;
+        uint32_t _thread;
+        Clock::time_point _start;
+        size_t _phase = SIZE_MAX;
+        std::chrono::microseconds _systemTime = {};
+        uint64_t _allocatedBytes = 0;
+        uint64_t _allocations = 0;
+    };
+}
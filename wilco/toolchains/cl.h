@@ -39,6 +39,18 @@ namespace extensions
             pch.ignoredFiles += other.pch.ignoredFiles;
             if(other.pch.forceInclude) pch.forceInclude = other.pch.forceInclude;
         }
+
+        virtual void digest(hash::Md5& hasher) const
+        {
+            hash::digestList(hasher, compilerFlags);
+            hash::digestList(hasher, linkerFlags);
+            hash::digestList(hasher, archiverFlags);
+            hash::digestValue(hasher, solutionFolder);
+            hash::digestValue(hasher, pch.header);
+            hash::digestValue(hasher, pch.source);
+            hash::digestList(hasher, pch.ignoredFiles);
+            hash::digestValue(hasher, pch.forceInclude ? std::to_string(*pch.forceInclude) : "");
+        }
     };
 }
 
@@ -59,4 +71,5 @@ struct ClToolchainProvider : public ToolchainProvider
     std::string getCommonLinkerFlags(Project& project, std::filesystem::path pathOffset) const;
     std::string getLinkerFlags(Project& project, std::filesystem::path pathOffset, const std::vector<std::string>& inputs, const std::string& output) const;
 	void process(Project& project, const std::filesystem::path& workingDir, const std::filesystem::path& dataDir) const override;
+	bool digest(const Project& project, hash::Md5& hasher) const override;
 };
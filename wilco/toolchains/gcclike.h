@@ -8,8 +8,16 @@
 #include "modules/language.h"
 #include "modules/feature.h"
 #include "modules/toolchain.h"
+#include "util/cli.h"
 #include "util/string.h"
 
+// "generate" builds binaries recording profiles of how they run, and "use" optimizes with the
+// profiles they recorded. Compiles take the profile as an input, so recording new profiles
+// rebuilds what they affect. See GccLikeToolchainProvider::process.
+extern cli::StringArgument pgoMode;
+// Threads each LTO link generates code on, when set.
+extern cli::StringArgument ltoJobs;
+
 namespace extensions
 {
     struct Gcc
@@ -23,8 +31,96 @@ namespace extensions
             std::filesystem::path build;
             std::filesystem::path use;
             ListPropertyValue<std::filesystem::path> ignoredFiles;
+
+            // Builds and uses a generated header, including the headers included by most of
+            // the sources last time they were built, when build and use aren't set. Only
+            // headers outside the configuration's directory are picked unless projectHeaders
+            // is set. The header is rewritten when the picked headers change, which rebuilds
+            // everything using it, so headers have to become a lot less common to be dropped.
+            struct Automatic
+            {
+                bool enabled = false;
+                // Share of the sources that must include a header for it to be picked
+                double minShare = 0.5;
+                size_t maxHeaders = 64;
+                bool projectHeaders = false;
+            } automatic;
         } pch;
 
+        // Compiles sources in batches, each through a generated file including them all.
+        // Only sources in the same directory, of the same language and with the same PCH
+        // use end up in a batch, batches are formed in path order, and a batch is closed when
+        // it reaches maxFiles sources or maxBytes of source (0 is no limit). A batch of one
+        // is compiled as is.
+        struct Unity
+        {
+            bool enabled = false;
+            size_t maxFiles = 8;
+            size_t maxBytes = 0;
+            // Sources that don't build together with others, e.g. from clashing statics or macros
+            ListPropertyValue<std::filesystem::path> ignoredFiles;
+            // Compiles sources git reports as modified or untracked on their own, so editing them
+            // doesn't rebuild whole batches. Editing a source still in a batch runs the configuration
+            // again, which takes it out, so its batch is rebuilt once without it and from then on
+            // only the source itself is.
+            bool isolateChangedFiles = false;
+        } unity;
+
+        // Compiles C++ sources using C++20 modules. Each C++ source is scanned for the modules it
+        // provides and imports before it's compiled, and sources importing a module are compiled
+        // after the source providing it. Module interface units are told apart by extension
+        // (.cppm, .ixx or .mpp). C++ sources aren't put in unity batches.
+        struct Modules
+        {
+            bool enabled = false;
+            // clang-scan-deps to use with clang, or empty to use gcc's own scanning and module mapper
+            std::string scanner = "clang-scan-deps";
+        } modules;
+
+        // Where links with clang and the ThinLTO feature keep the code generated for each module,
+        // so relinking only generates code again for modules that changed. The cache is kept in
+        // the data directory, and the linker prunes it after each link to stay within the limits.
+        struct ThinLtoCache
+        {
+            bool enabled = true;
+            // 0 leaves the limit to the linker
+            size_t maxSizeMB = 4096;
+            size_t pruneAfterHours = 24 * 7;
+        } thinLtoCache;
+
+        // Profile guided optimization, enabled with --pgo
+        struct Pgo
+        {
+            // Merges the raw profiles written by binaries built with clang
+            std::string profdata = "llvm-profdata";
+        } pgo;
+
+        // Optimizes the layout of linked executables with BOLT, using a profile recorded by running
+        // them on a representative workload. The executable is linked to the data directory, the
+        // training run records a profile of it, and llvm-bolt rewrites it into the output. Training
+        // runs again when the linked executable or the training inputs change. Only ELF executables
+        // can be optimized, so this does nothing on macOS and Windows.
+        struct Bolt
+        {
+            bool enabled = false;
+            enum Profile
+            {
+                // Samples the executable with perf record
+                Perf,
+                // Runs a copy of the executable instrumented by llvm-bolt
+                Instrument
+            } profile = Perf;
+            // Arguments the executable is run with when training, in the working directory
+            std::string trainingArguments;
+            // Files the training run reads
+            ListPropertyValue<std::filesystem::path> trainingInputs;
+            // Samples with last branch records, which machines without them (e.g. most VMs) lack
+            bool branchSampling = true;
+            std::string optimizations = "-reorder-blocks=ext-tsp -reorder-functions=hfsort -split-functions -split-all-cold -split-eh";
+            std::string llvmBolt = "llvm-bolt";
+            std::string perf = "perf";
+        } bolt;
+
         virtual void import(const Gcc& other)
         {
             compilerFlags += other.compilerFlags;
@@ -34,6 +130,67 @@ namespace extensions
             if(!other.pch.build.empty()) pch.build = other.pch.build;
             if(!other.pch.use.empty()) pch.use = other.pch.use;
             pch.ignoredFiles += other.pch.ignoredFiles;
+            if(other.pch.automatic.enabled) pch.automatic = other.pch.automatic;
+
+            if(other.unity.enabled)
+            {
+                unity.enabled = true;
+                unity.maxFiles = other.unity.maxFiles;
+                unity.maxBytes = other.unity.maxBytes;
+            }
+            if(other.unity.isolateChangedFiles) unity.isolateChangedFiles = true;
+            unity.ignoredFiles += other.unity.ignoredFiles;
+
+            if(other.modules.enabled) modules = other.modules;
+            // Settings left at their defaults don't override anything
+            const ThinLtoCache defaultCache;
+            if(!other.thinLtoCache.enabled) thinLtoCache.enabled = false;
+            if(other.thinLtoCache.maxSizeMB != defaultCache.maxSizeMB) thinLtoCache.maxSizeMB = other.thinLtoCache.maxSizeMB;
+            if(other.thinLtoCache.pruneAfterHours != defaultCache.pruneAfterHours) thinLtoCache.pruneAfterHours = other.thinLtoCache.pruneAfterHours;
+            if(other.pgo.profdata != Pgo().profdata) pgo.profdata = other.pgo.profdata;
+            if(other.bolt.enabled)
+            {
+                bolt.enabled = true;
+                bolt.profile = other.bolt.profile;
+                bolt.trainingArguments = other.bolt.trainingArguments;
+                bolt.branchSampling = other.bolt.branchSampling;
+                bolt.optimizations = other.bolt.optimizations;
+                bolt.llvmBolt = other.bolt.llvmBolt;
+                bolt.perf = other.bolt.perf;
+            }
+            bolt.trainingInputs += other.bolt.trainingInputs;
+        }
+
+        virtual void digest(hash::Md5& hasher) const
+        {
+            hash::digestList(hasher, compilerFlags);
+            hash::digestList(hasher, linkerFlags);
+            hash::digestList(hasher, archiverFlags);
+
+            hash::digestValue(hasher, pch.build);
+            hash::digestValue(hasher, pch.use);
+            hash::digestList(hasher, pch.ignoredFiles);
+            hash::digestValue(hasher, std::to_string(pch.automatic.enabled) + " " + std::to_string(pch.automatic.minShare) + " " +
+                                      std::to_string(pch.automatic.maxHeaders) + " " + std::to_string(pch.automatic.projectHeaders));
+
+            hash::digestValue(hasher, std::to_string(unity.enabled) + " " + std::to_string(unity.maxFiles) + " " +
+                                      std::to_string(unity.maxBytes) + " " + std::to_string(unity.isolateChangedFiles));
+            hash::digestList(hasher, unity.ignoredFiles);
+
+            hash::digestValue(hasher, std::to_string(modules.enabled));
+            hash::digestValue(hasher, modules.scanner);
+
+            hash::digestValue(hasher, std::to_string(thinLtoCache.enabled) + " " + std::to_string(thinLtoCache.maxSizeMB) + " " +
+                                      std::to_string(thinLtoCache.pruneAfterHours));
+
+            hash::digestValue(hasher, pgo.profdata);
+
+            hash::digestValue(hasher, std::to_string(bolt.enabled) + " " + std::to_string(bolt.profile) + " " + std::to_string(bolt.branchSampling));
+            hash::digestValue(hasher, bolt.trainingArguments);
+            hash::digestList(hasher, bolt.trainingInputs);
+            hash::digestValue(hasher, bolt.optimizations);
+            hash::digestValue(hasher, bolt.llvmBolt);
+            hash::digestValue(hasher, bolt.perf);
         }
     };
 }
@@ -54,4 +211,5 @@ struct GccLikeToolchainProvider : public ToolchainProvider
     std::string getCommonLinkerFlags(Project& project, Architecture arch, std::filesystem::path pathOffset) const;
     std::string getLinkerFlags(Project& project, Architecture arch, std::filesystem::path pathOffset, const std::vector<std::string>& inputs, const std::string& output) const;
 	void process(Project& project, const std::filesystem::path& workingDir, const std::filesystem::path& dataDir) const override;
+	bool digest(const Project& project, hash::Md5& hasher) const override;
 };
@@ -7,6 +7,7 @@
 
 #include "core/flags.h"
 #include "modules/command.h"
+#include "util/path.h"
 #include "util/string.h"
 
 namespace commands
@@ -50,10 +51,18 @@ inline CommandEntry chain(const std::vector<CommandEntry>& commands, std::string
     }
 
     // Remove intermediate steps from inputs
+	paths::NormalizationCache pathCache;
+	std::vector<const std::filesystem::path*> normalizedOutputs;
+	normalizedOutputs.reserve(result.outputs.size());
+	for (auto& output : result.outputs)
+	{
+		normalizedOutputs.push_back(&pathCache.absoluteNormal(output));
+	}
 	result.inputs.erase(std::remove_if(result.inputs.begin(), result.inputs.end(), [&](const auto& input) {
-		return std::find_if(result.outputs.begin(), result.outputs.end(), [input = std::filesystem::absolute(input).lexically_normal()](const auto& output) {
-			return input == std::filesystem::absolute(output).lexically_normal();
-		}) != result.outputs.end();
+		auto& normalizedInput = pathCache.absoluteNormal(input);
+		return std::find_if(normalizedOutputs.begin(), normalizedOutputs.end(), [&normalizedInput](const auto* output) {
+			return normalizedInput == *output;
+		}) != normalizedOutputs.end();
 	}), result.inputs.end());
 
 	if (!newDescription.empty())
@@ -1,9 +1,12 @@
 #pragma once
 
 #include <array>
+#include <filesystem>
 #include <string>
 #include <string_view>
 
+#include "core/typedid.h"
+
 namespace hash
 {
 
@@ -37,4 +40,38 @@ std::array<unsigned char, 16> md5(std::string_view input);
 std::string md5String(std::string_view input);
 std::string md5String(std::array<unsigned char, 16> hash);
 
+// Digests a value followed by a terminator, so a sequence of values hashes differently from
+// any other sequence of the same characters
+inline void digestValue(Md5& hasher, std::string_view value)
+{
+    hasher.digest(value);
+    hasher.digest("", 1);
+}
+
+inline void digestValue(Md5& hasher, const std::string& value)
+{
+    digestValue(hasher, std::string_view(value));
+}
+
+inline void digestValue(Md5& hasher, const std::filesystem::path& value)
+{
+    digestValue(hasher, std::string_view(value.string()));
+}
+
+template<typename Derived>
+void digestValue(Md5& hasher, const TypedId<Derived>& value)
+{
+    digestValue(hasher, value.id);
+}
+
+template<typename List>
+void digestList(Md5& hasher, const List& values)
+{
+    digestValue(hasher, std::to_string(values.size()));
+    for(auto& value : values)
+    {
+        digestValue(hasher, value);
+    }
+}
+
 }
\ No newline at end of file
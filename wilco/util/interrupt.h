@@ -4,4 +4,8 @@ namespace interrupt
 {
     void installHandlers();
     bool isInterrupted();
+
+    // Sets or clears the interrupted state, as if a signal had been received. Lets
+    // tests exercise interrupt handling.
+    void setInterrupted(bool interrupted);
 }
\ No newline at end of file
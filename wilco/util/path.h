@@ -0,0 +1,44 @@
+#pragma once
+
+#include <deque>
+#include <filesystem>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+namespace paths
+{
+
+/** Returns true if path is already absolute and lexically normal, i.e. if
+    std::filesystem::absolute(path).lexically_normal() would give back the same string.
+    May return false for some paths that actually are normal; it's only meant as a fast path. */
+bool isAbsoluteNormal(std::string_view path);
+
+/** Caches absolute, lexically normal versions of paths, relative to a fixed working directory.
+    Depfiles and command graphs mention the same paths over and over, and normalizing them
+    through std::filesystem is comparatively expensive. The cache is safe to use from multiple threads. */
+class NormalizationCache
+{
+public:
+    NormalizationCache();
+    NormalizationCache(std::filesystem::path workingDirectory);
+
+    NormalizationCache(const NormalizationCache& other) = delete;
+    NormalizationCache& operator=(const NormalizationCache& other) = delete;
+
+    /** Returns the absolute normal version of path. The reference stays valid for the lifetime of the cache. */
+    const std::filesystem::path& absoluteNormal(std::string_view path);
+    const std::filesystem::path& absoluteNormal(const std::filesystem::path& path);
+    const std::filesystem::path& absoluteNormal(const std::string& path) { return absoluteNormal(std::string_view(path)); }
+    const std::filesystem::path& absoluteNormal(const char* path) { return absoluteNormal(std::string_view(path)); }
+
+private:
+    std::filesystem::path _workingDirectory;
+    std::shared_mutex _mutex;
+    // Owns the key strings, since the map is keyed by views to avoid allocating on lookup
+    std::deque<std::string> _keys;
+    std::unordered_map<std::string_view, std::filesystem::path> _entries;
+};
+
+}
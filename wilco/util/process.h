@@ -6,6 +6,8 @@
 #include <stdio.h>
 #include <string>
 #include <filesystem>
+#include <functional>
+#include <string_view>
 #include "core/os.h"
 
 namespace process
@@ -17,7 +19,12 @@ struct ProcessResult
     std::string output;
 };
 
+using OutputCallback = std::function<void(std::string_view)>;
+
 std::filesystem::path findCurrentModulePath();
 ProcessResult run(std::string command, bool echoOutput = false);
+// Runs command, passing output chunks to outputCallback as they arrive. The output is
+// also collected in the result as usual.
+ProcessResult run(std::string command, const OutputCallback& outputCallback);
 
 }
\ No newline at end of file